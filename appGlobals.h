@@ -123,7 +123,7 @@
  
 #define APP_VER "10.9.3"
 // to determine if newer data files need to be loaded
-#define CFG_VER 37
+#define CFG_VER 41
 
 #if defined(AUXILIARY)
 #define APP_NAME "ESP-CAM_AUX" // max 15 chars
@@ -142,10 +142,11 @@
 
 #define HTTP_CLIENTS 2 // http(s), ws(s)
 #define MAX_STREAMS 4 // (web stream, playback, download), NVR, audio, subtitle
+#define MAX_SUSTAIN (MAX_STREAMS + MAX_PLAY_SESSIONS - 1) // additional tasks for concurrent playback
 #define FILE_NAME_LEN 64
 #define IN_FILE_NAME_LEN (FILE_NAME_LEN * 2)
 #define JSON_BUFF_LEN (32 * 1024) // set big enough to hold all file names in a folder
-#define MAX_CONFIGS 220 // must be > number of entries in configs.txt
+#define MAX_CONFIGS 240 // must be > number of entries in configs.txt
 #define MIN_RAM 8 // min object size stored in ram instead of PSRAM default is 4096
 #define MAX_RAM 4096 // max object size stored in ram instead of PSRAM default is 4096
 #define TLS_HEAP (64 * 1024) // min free heap for TLS session
@@ -169,13 +170,32 @@
 #define AVI_EXT "avi"
 #define CSV_EXT "csv"
 #define SRT_EXT "srt"
-#define AVI_HEADER_LEN 310 // AVI header length
+#define EVT_EXT "evt"
+#define THUMBPACK "/thumbs.pak" // per folder pack of recording thumbnails
+#define THUMB_MAX (1024 * 16) // max jpeg length for thumbnail
+#define SPR_EXT "spr" // cached sprite sheet for scrubbing recording
+#define SPRITE_TILES 36 // max frames in sprite sheet, evenly spaced through recording
+#define SPRITE_COLS 6 // tiles per sprite sheet row
+#define SPRITE_DIM 120 // larger dimension of tile, other keeps frame aspect ratio
+#define MP4_EXT "mp4"
+#define AVI_HEADER_LEN 478 // AVI header length
+#define AVIX_HDR_LEN 24 // OpenDML segment header length
 #define CHUNK_HDR 8 // bytes per jpeg hdr in AVI 
-#define WAVTEMP "/current.wav"
 #define AVITEMP "/current.avi"
 #define TLTEMP "/current.tl"
+#define AVIPOOL "/pool%u.avi" // preallocated avi files
+#define DASH_DIR "/dashcam" // dashcam ring folder, not listed or deleted as recordings
+#define DASHSEG DASH_DIR "/dash%02u.avi" // dashcam ring segment files
+#define DASHMAN DASH_DIR "/dash.man" // dashcam ring manifest
+#define DASH_RING_MAX 32 // max number of dashcam ring segments
+#define MAX_PLAY_SPEED 64 // max trick play speed multiple, forward or reverse
+#define PLAY_SLOTS 4 // depth of read ahead ring per playback session
+#define PLAY_BLOCK (RAMSIZE * 2) // SD read per ring slot, multiple of sector size
+#define MAX_PLAY_SESSIONS 3 // max concurrent playback sessions, each with its own read ahead ring
 #define TELETEMP "/current.csv"
 #define SRTTEMP "/current.srt"
+#define IDXTEMP "/current.idx" // index file and checkpoint for crash recovery
+#define TLIDXTEMP "/current.tli" // timelapse index file
 
 #define DMA_BUFF_LEN 512 // used for I2S buffer size
 #define DMA_BUFF_CNT 4
@@ -199,8 +219,11 @@
 #define MQTT_STACK_SIZE (1024 * 4)
 #define PING_STACK_SIZE (1024 * 6)
 #define PLAYBACK_STACK_SIZE (1024 * 2)
+#define POOL_STACK_SIZE (1024 * 4)
+#define SDWRITE_STACK_SIZE (1024 * 4)
 #define SERVO_STACK_SIZE (1024 * 1)
 #define SUSTAIN_STACK_SIZE (1024 * 4)
+#define SUBSTREAM_STACK_SIZE (1024 * 4)
 #define TGRAM_STACK_SIZE (1024 * 6)
 #define TELEM_STACK_SIZE (1024 * 4)
 #define HB_STACK_SIZE (1024 * 2)
@@ -216,9 +239,12 @@
 #define AUDIO_PRI 5
 #define INTERCOM_PRI 5
 #define LOG_PRI 5
+#define SDWRITE_PRI 5
 #define PLAY_PRI 4
 #define TELEM_PRI 3
+#define SUBSTREAM_PRI 3
 #define TGRAM_PRI 1
+#define POOL_PRI 1
 #define EMAIL_PRI 1
 #define FTP_PRI 1
 #define MQTT_PRI 1
@@ -236,14 +262,38 @@ struct mjpegStruct {
   size_t buffLen;
   size_t buffOffset;
   size_t jpegSize;
+  uint8_t* buff; // playback session buffer holding data to send
 };
 
+struct playSession; // playback state, private to mjpeg2sd.cpp
+struct mp4Session; // remux state of one mp4 download, private to mp4.cpp
+
 struct fnameStruct {
   uint8_t recFPS;
   uint32_t recDuration;
-  uint16_t frameCnt;
+  uint32_t frameCnt;
+};
+
+struct aviRecovery {
+  char aviName[FILE_NAME_LEN]; // temporary avi file being recorded
+  char partName[FILE_NAME_LEN]; // date folder and time prefix for final name
+  uint8_t FPS;
+  uint8_t frameType;
+  uint32_t frames; // frames indexed at checkpoint
+  uint32_t audioBytes; // pcm bytes indexed at checkpoint
+  size_t filePos; // avi file position after indexed content
+  uint32_t tag; // in chunk following each jpeg chunk of this recording
 };
 
+struct aviSource {
+  // byte source for avi demux, so chunk parsing is independent of storage
+  size_t (*readAt)(void* ctx, size_t filePos, uint8_t* buff, size_t len);
+  void* ctx;
+  size_t size; // bytes available from source
+};
+
+enum aviChunkType {AVI_END, AVI_VIDEO, AVI_AUDIO, AVI_INDEX, AVI_SEGMENT, AVI_JUNK};
+
 enum audioAction {NO_ACTION, UPDATE_CONFIG, RECORD_ACTION, PLAY_ACTION, PASS_ACTION, WAV_ACTION, STOP_ACTION};
 enum stepperModel {BYJ_48, BIPOLAR_8mm};
 
@@ -252,33 +302,50 @@ enum stepperModel {BYJ_48, BIPOLAR_8mm};
 void applyFilters();
 void applyVolume();
 void appShutdown();
+size_t audioRecordLen();
+bool aviFrameInfo(const aviSource* src, uint32_t* frameCnt, uint16_t* width, uint16_t* height);
+bool aviSegmentFull(size_t chunkLen);
 void browserMicInput(uint8_t* wsMsg, size_t wsMsgLen);
-void buildAviHdr(uint8_t FPS, uint8_t frameType, uint16_t frameCnt, bool isTL = false);
+void buildAviHdr(uint8_t FPS, uint8_t frameType, uint32_t frameCnt, bool isTL = false, uint32_t audioDelay = 0);
 void buildAviIdx(size_t dataSize, bool isVid = true, bool isTL = false);
+size_t buildAviSegHdr(uint8_t* segBuff, uint8_t seg);
+void buildEventJson(const char* aviName, char* buff, size_t buffLen);
+void buildLatencyJson(char* buff, size_t buffLen);
 size_t buildSubtitle(int srtSeqNo, uint32_t sampleInterval);
 void buzzerAlert(bool buzzerOn);
 bool checkAccelMove();
 int8_t checkPotVol(int8_t adjVol);
 bool checkSDFiles();
+void closeAviIndex(bool isTL = false);
+void closeMp4Remux(mp4Session* mr);
 void currentStackUsage();
 void displayAudioLed(int16_t audioSample);
-void finalizeAviIndex(uint16_t frameCnt, bool isTL = false);
+void finalizeAviIndex(bool isTL = false, size_t filePos = 0);
+size_t findAviFrame(const aviSource* src, uint32_t frameNum);
+size_t findAviMovi(const aviSource* src, bool* isOdml);
+size_t findLiveFrame(uint32_t frameNum, size_t writtenPos);
 void finishAudioRecord(bool isValid);
 float* getBMx280();
 float* getMPUdata();
 int getInputPeripheral(uint8_t cmd);
-mjpegStruct getNextFrame(bool firstCall = false);
+mjpegStruct getNextFrame(playSession* ps, bool firstCall = false);
 bool getPIRval();
 
-bool haveWavFile(bool isTL = false);
 bool identifyBMx();
 bool identifyMPU(char* _mpuModel);
 void intercom();
 bool isNight(uint8_t nightSwitch);
 void laserLevel() ;
+bool loadAviCheckpoint(aviRecovery* rec);
 void micTaskStatus();
 void motorSpeed(int speedVal, bool leftMotor = true);
-void openSDfile(const char* streamFile);
+uint32_t mp4Fragments(const mp4Session* mr);
+uint8_t nextAviChunk(const aviSource* src, size_t filePos, uint32_t* chunkLen);
+void openAviCheckpoint(const char* aviName, const char* partName, uint8_t FPS, uint8_t frameType, uint32_t tag);
+mp4Session* openMp4Remux(const aviSource* src);
+playSession* openSDfile(const char* streamFile, bool isLive = false);
+uint8_t parseAviChunk(const uint8_t* chunkHdr, bool isOdml, uint32_t* chunkLen);
+const uint8_t* peekAudioRecord(size_t* len);
 void prepAudio();
 void prepAviIndex(bool isTL = false);
 bool prepCam();
@@ -288,6 +355,15 @@ void prepMic();
 void prepMotors();
 void prepRTSP();
 void prepUart();
+size_t readAviFile(void* ctx, size_t filePos, uint8_t* buff, size_t len);
+void releaseAudioRecord(size_t len);
+size_t remuxMp4(mp4Session* mr, uint8_t* clientBuf, size_t buffSize);
+void resetLatency();
+void saveAviCheckpoint(size_t filePos);
+uint8_t sdQueueDepth();
+esp_err_t sendMp4(File& df, httpd_req_t* req);
+esp_err_t sendSprites(httpd_req_t* req, const char* aviName);
+esp_err_t sendThumbs(httpd_req_t* req, const char* folderName);
 void setCamPan(int panVal);
 void setCamTilt(int tiltVal);
 uint8_t setFPS(uint8_t val);
@@ -296,17 +372,21 @@ void setInputPeripheral(uint8_t cmd, uint32_t controlVal);
 void setLamp(uint8_t lampVal);
 void setLightsRC(bool lightsOn);
 bool setOutputPeripheral(uint8_t cmd, uint32_t rxValue);
+void setPlaySpeed(int speed);
 void setSteering(int steerVal);
 void setStepperPin(uint8_t pinNum, uint8_t pinPos);
 void setStickTimer(bool restartTimer, uint32_t interval = 0);
 bool shareI2C(int sdaShare, int sclShare);
+void skipAviIdx(size_t chunkLen);
 void startAudioRecord();
+uint8_t startAviSegment(size_t filePos);
 void startHeartbeat();
 void startSustainTasks();
 bool startTelemetry();
 void stepperDone();
 void stepperRun(float RPM, float revFraction, bool _clockwise, stepperModel thisStepper);
 void stopPlaying();
+void stopSession(playSession* ps);
 void stopSustainTask(int taskId);
 void stopTelemetry(const char* fileName);
 void storeSensorData(bool fromStream);
@@ -315,11 +395,29 @@ void trackSteeering(int controlVal, bool steering);
 size_t updateWavHeader();
 size_t writeAviIndex(byte* clientBuf, size_t buffSize, bool isTL = false);
 bool writeUart(uint8_t cmd, uint32_t outputData);
-size_t writeWavFile(byte* clientBuf, size_t buffSize);
 
 #ifndef AUXILIARY
+struct frameRef {
+  camera_fb_t* fb;
+  uint8_t refCnt; // number of users of camera frame buffer
+};
+
+struct subFrame {
+  uint8_t* buf; // jpeg, to be freed by caller
+  size_t len;
+  uint16_t width;
+  uint16_t height;
+};
+
 bool checkMotion(camera_fb_t* fb, bool motionStatus, bool lightLevelOnly = false);
+void dropMotionThumb();
+void endStreamFrames(uint8_t streamId);
 void keepFrame(camera_fb_t* fb);
+uint8_t* motionThumb(size_t* jpgLen);
+void releaseFrame(frameRef* ref);
+void snapMotionThumb();
+frameRef* waitStreamFrame(uint8_t streamId, uint32_t waitMs);
+subFrame waitSubFrame(uint32_t waitMs);
 #endif
 
 /******************** Global app declarations *******************/
@@ -327,6 +425,16 @@ void keepFrame(camera_fb_t* fb);
 // motion detection parameters
 extern int moveStartChecks; // checks per second for start motion
 extern int moveStopSecs; // secs between each check for stop, also determines post motion time
+extern int preRollSecs; // secs of frames prior to motion detection to include in recording
+
+// frame rate governor
+extern bool fpsGovernor; // adjust frame rate and jpeg quality to match processing load
+extern int minFPS; // lowest frame rate governor can set
+extern int maxQuality; // highest jpeg quality value (ie lowest quality) governor can set
+extern uint8_t govFPS; // frame rate currently set by governor
+extern int govQuality; // jpeg quality currently set by governor
+extern float achievedFPS; // frame rate actually processed
+extern bool sdDirect; // write recordings directly with FatFs
 
 // motion recording parameters
 extern int detectMotionFrames; // min sequence of changed frames to confirm motion 
@@ -349,7 +457,7 @@ extern bool autoUpload;
 extern bool dbgMotion;
 extern bool doPlayback;
 extern bool doRecording; // whether to capture to SD or not
-extern bool forceRecord; // Recording enabled by rec button or dashcam slider
+extern bool forceRecord; // Recording enabled by rec button
 extern uint8_t FPS;
 extern uint8_t fsizePtr; // index to frameData[] for record
 extern bool isCapturing;
@@ -361,11 +469,11 @@ extern uint8_t minSeconds; // default min video length (includes moveStopSecs ti
 extern float motionVal;  // motion sensitivity setting - min percentage of changed pixels that constitute a movement
 extern uint8_t nightSwitch; // initial white level % for night/day switching
 extern bool nightTime; 
-extern bool stopPlayback;
 extern bool useMotion; // whether to use camera for motion detection (with motionDetect.cpp)  
 extern uint8_t colorDepth;
 extern bool timeLapseOn; // enable time lapse recording
 extern int dashCamOn; // enable continuous recording, with given interval
+extern uint8_t dashRing; // number of dashcam ring segments, 0 for dated files
 extern int maxFrames;
 extern uint8_t xclkMhz;
 extern char camModel[];
@@ -374,8 +482,18 @@ extern int alertMax; // too many could cause account suspension (daily emails)
 extern bool streamVid;
 extern bool streamAud;
 extern bool streamSrt;
+extern bool mp4Remux; // download avi as fragmented mp4
 extern uint8_t numStreams;
 extern uint8_t vidStreams;
+extern int subStream;
+extern int playEvent;
+extern int playFrame;
+extern int playSecs;
+extern int playSpeed;
+extern uint8_t playSessions;
+extern uint8_t sdQueueHigh;
+extern uint32_t sdQueueDrops;
+extern uint32_t captureSkips;
 
 #ifndef AUXILIARY
 extern framesize_t maxFS;
@@ -386,8 +504,7 @@ extern uint8_t iSDbuffer[];
 extern uint8_t aviHeader[];
 extern const uint8_t dcBuf[]; // 00dc
 extern const uint8_t wbBuf[]; // 01wb
-extern byte* streamBuffer[]; // buffer for stream frame
-extern size_t streamBufferSize[];
+extern const uint8_t junkBuf[]; // JUNK
 extern uint8_t* motionJpeg;
 extern size_t motionJpegLen;
 extern uint8_t* audioBuffer;
@@ -531,6 +648,9 @@ extern TaskHandle_t fsHandle;
 extern TaskHandle_t logHandle;
 extern TaskHandle_t mqttTaskHandle;
 extern TaskHandle_t playbackHandle;
+extern TaskHandle_t sdWriteHandle;
+extern TaskHandle_t aviPoolHandle;
+extern TaskHandle_t subStreamHandle;
 extern esp_ping_handle_t pingHandle;
 extern TaskHandle_t servoHandle;
 extern TaskHandle_t stickHandle;
@@ -541,6 +661,7 @@ extern TaskHandle_t uartRxHandle;
 extern TaskHandle_t audioHandle;
 extern SemaphoreHandle_t frameSemaphore[];
 extern SemaphoreHandle_t motionSemaphore;
+extern SemaphoreHandle_t aviMutex;
 
 
 /************************** structures ********************************/
@@ -41,6 +41,13 @@ bool updateAppStatus(const char* variable, const char* value, bool fromUser) {
   else if (!strcmp(variable, "moveStartChecks")) moveStartChecks = intVal;
   else if (!strcmp(variable, "moveStopSecs")) moveStopSecs = intVal;
   else if (!strcmp(variable, "maxFrames")) maxFrames = intVal > 0 ? intVal : maxFrames;
+  else if (!strcmp(variable, "preRollSecs")) preRollSecs = intVal;
+  else if (!strcmp(variable, "fpsGovernor")) fpsGovernor = (bool)intVal;
+  else if (!strcmp(variable, "minFPS")) minFPS = intVal > 0 ? intVal : 1;
+  else if (!strcmp(variable, "maxQuality")) maxQuality = intVal;
+  else if (!strcmp(variable, "sdDirect")) sdDirect = (bool)intVal;
+  else if (!strcmp(variable, "dashRing")) dashRing = constrain(intVal, 0, DASH_RING_MAX);
+  else if (!strcmp(variable, "playSessions")) playSessions = constrain(intVal, 1, MAX_PLAY_SESSIONS);
   else if (!strcmp(variable, "detectMotionFrames")) detectMotionFrames = intVal;
   else if (!strcmp(variable, "detectNightFrames")) detectNightFrames = intVal;
   else if (!strcmp(variable, "detectNumBands")) detectNumBands = intVal;
@@ -59,10 +66,7 @@ bool updateAppStatus(const char* variable, const char* value, bool fromUser) {
     LOG_INF("%s motion detection by camera", useMotion ? "Enabling" : "Disabling");
   }
   else if (!strcmp(variable, "timeLapseOn")) timeLapseOn = intVal;
-  else if (!strcmp(variable, "dashCamOn")) {
-    dashCamOn = intVal;
-    if (dashCamOn == 0) forceRecord = false;
-  }
+  else if (!strcmp(variable, "dashCamOn")) dashCamOn = intVal; // continuous recording stops when 0
   else if (!strcmp(variable, "tlSecsBetweenFrames")) tlSecsBetweenFrames = intVal;
   else if (!strcmp(variable, "tlDurationMins")) tlDurationMins = intVal;
   else if (!strcmp(variable, "tlPlaybackFPS")) tlPlaybackFPS = intVal; 
@@ -71,13 +75,14 @@ bool updateAppStatus(const char* variable, const char* value, bool fromUser) {
   else if (!strcmp(variable, "streamAud")) streamAud = (bool)intVal; 
   else if (!strcmp(variable, "streamSrt")) streamSrt = (bool)intVal; 
 #endif
+  else if (!strcmp(variable, "subStream")) subStream = intVal;
   else if (!strcmp(variable, "lswitch")) nightSwitch = intVal;
 #endif // AUXILIARY
 #if INCLUDE_FTP_HFS
   else if (!strcmp(variable, "upload")) fsStartTransfer(value); 
 #endif
   else if (!strcmp(variable, "delete")) {
-    stopPlayback = true;
+    stopPlaying(); // in case file being played
     deleteFolderOrFile(value);
   }
   else if (!strcmp(variable, "record")) doRecording = (intVal) ? true : false;   
@@ -343,6 +348,29 @@ esp_err_t appSpecificWebHandler(httpd_req_t *req, const char* variable, const ch
   else if (!strcmp(variable, "formatSD")) {
     if (formatSDcard()) doRestart("user requested format of SD card");
   } 
+  else if (!strcmp(variable, "events")) {
+    // list events recorded in given avi file
+    buildEventJson(value, jsonBuff, JSON_BUFF_LEN);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, jsonBuff);
+  } 
+  else if (!strcmp(variable, "thumbs")) sendThumbs(req, value); // thumbnails for recordings in given folder
+  else if (!strcmp(variable, "sprites")) sendSprites(req, value); // scrub preview for given avi file
+  else if (!strcmp(variable, "playEvent")) playEvent = atoi(value); // start next playback at given event
+  else if (!strcmp(variable, "playFrame")) playFrame = atoi(value); // or at given frame number
+  else if (!strcmp(variable, "playSecs")) playSecs = atoi(value); // or at given time in recording
+  else if (!strcmp(variable, "playSpeed")) {
+    // trick play speed, eg 8 for 8x forward, -8 for 8x reverse, 1 for normal
+    setPlaySpeed(atoi(value));
+  }
+  else if (!strcmp(variable, "latency")) {
+    // capture pipeline latency histograms, reset if value is 0
+    if (atoi(value)) {
+      buildLatencyJson(jsonBuff, JSON_BUFF_LEN);
+      httpd_resp_set_type(req, "application/json");
+      httpd_resp_sendstr(req, jsonBuff);
+    } else resetLatency();
+  } 
   else return ESP_FAIL;
   return ESP_OK;
 }
@@ -505,6 +533,10 @@ void buildAppJsonString(bool filter) {
     p += sprintf(p, "\"total_bytes\":\"%s\",", fmtSize(STORAGE.totalBytes()));
   }
   p += sprintf(p, "\"free_psram\":\"%s\",", fmtSize(ESP.getFreePsram()));     
+  p += sprintf(p, "\"achievedFPS\":\"%0.1f / %u\",", achievedFPS, FPS); // achieved / requested
+  if (fpsGovernor) p += sprintf(p, "\"govFPS\":\"%u FPS, quality %d\",", govFPS, govQuality);
+  p += sprintf(p, "\"sdQueue\":\"%u / %u\",", sdQueueDepth(), sdQueueHigh); // current / max depth
+  p += sprintf(p, "\"sdDrops\":\"%lu / %lu\",", sdQueueDrops, captureSkips); // frames dropped / skipped
 #endif
 #if INCLUDE_FTP_HFS
   p += sprintf(p, "\"progressBar\":%d,", percentLoaded);  
@@ -596,6 +628,9 @@ void currentStackUsage() {
 #endif
   // 7: pingtask
   checkStackUse(playbackHandle, 8);
+  checkStackUse(sdWriteHandle, 21);
+  checkStackUse(aviPoolHandle, 22);
+  checkStackUse(subStreamHandle, 23);
 #if INCLUDE_PERIPH
  #if INCLUDE_DS18B20
   checkStackUse(DS18B20handle, 1);
@@ -616,6 +651,7 @@ void currentStackUsage() {
 #endif
   // 16: http webserver
   for (int i=0; i < numStreams; i++) checkStackUse(sustainHandle[i], 17 + i);
+  for (int i = MAX_STREAMS; i < MAX_SUSTAIN; i++) checkStackUse(sustainHandle[i], 17 + i);
 }
 
 static void stopRC() {
@@ -861,6 +897,13 @@ tlSecsBetweenFrames~600~1~N~Timelapse interval (secs)
 tlDurationMins~720~1~N~Timelapse duration (mins)
 tlPlaybackFPS~1~1~N~Timelapse playback FPS
 maxFrames~20000~1~N~Max frames in recording
+preRollSecs~0~1~N~Pre-motion recording (secs)
+fpsGovernor~0~1~C~Reduce FPS / quality if overloaded
+minFPS~1~1~N~Min FPS when overloaded
+maxQuality~30~1~N~Max quality value when overloaded
+sdDirect~0~1~C~Write recordings directly with FatFs
+dashRing~0~1~N~DashCam ring segments, 0 for dated files
+playSessions~1~1~N~Max concurrent playbacks (restart)
 dashCamOn~0~98~~na
 moveStartChecks~5~1~N~Checks per second for start motion
 moveStopSecs~2~1~N~Non movement to stop recording (secs)
@@ -876,6 +919,7 @@ depthColor~0~1~C~Color depth for motion detection: Gray <> RGB
 streamVid~0~8~C~Enable NVR Video stream: /sustain?video=1
 streamAud~0~8~C~Enable NVR Audio stream: /sustain?audio=1
 streamSrt~0~8~C~Enable NVR Subtitle stream: /sustain?srt=1
+subStream~0~8~S:Full:1/4:1/8~NVR / RTSP video resolution
 smtpUse~0~2~C~Enable email sending
 smtpMaxEmails~10~2~N~Max daily alerts
 sdMinCardFreeSpace~100~2~N~Min free MBytes on SD before action
@@ -41,7 +41,7 @@ bool micRem = false; // use browser mic (depends on app)
 static bool ampUse = false; // whether esp amp / speaker available
 bool spkrRem = false; // use browser speaker
 bool volatile stopAudio = false;
-static bool micRecording = false;
+static volatile bool micRecording = false;
 
 // I2S devices
 bool I2Smic; // true if I2S, false if PDM
@@ -88,7 +88,14 @@ static const char* micLabels[2] = {"PDM", "I2S"};
 #endif
 #ifdef ISCAM
 bool AudActive = false; // whether to show audio features
-static File wavFile;
+
+// recorded mic input passed to SD write task for interleaving into avi
+// single producer (audio task) and single consumer (SD write task)
+#define AUD_RING_LEN (1024 * 64) // must be power of 2, 2 secs at 16kHz
+static uint8_t* audRing = NULL;
+static volatile uint32_t audHead = 0; // only updated by audio task
+static volatile uint32_t audTail = 0; // only updated by SD write task
+static uint32_t audDrops = 0; // bytes lost as ring full
 #endif
 #ifdef ISVC
 uint8_t* recAudioBuffer = NULL;
@@ -353,14 +360,12 @@ void browserMicInput(uint8_t* wsMsg, size_t wsMsgLen) {
 
 void startAudioRecord() {
   // called from openAvi() in mjpeg2sd.cpp
-  // start audio recording and write recorded audio to SD card as WAV file 
-  // combined into AVI file as PCM channel on FTP upload or browser download
-  // so can be read by media players
-  if (micUse && micGain) {
-      wavFile = STORAGE.open(WAVTEMP, FILE_WRITE);
-      wavFile.write(wavHeader, WAV_HDR_LEN); 
-      micRecording = true;
-      totalSamples = 0;
+  // start audio recording, recorded audio is interleaved into AVI file 
+  // as PCM chunks by SD write task, so can be read by media players
+  if (micUse && micGain && audRing != NULL) {
+    audHead = audTail = audDrops = 0;
+    totalSamples = 0;
+    micRecording = true;
   } else {
     micRecording = false;
     LOG_WRN("No ESP mic defined or mic is off");
@@ -368,21 +373,47 @@ void startAudioRecord() {
 }
 
 void finishAudioRecord(bool isValid) {
-  // called from closeAvi() in mjpeg2sd.cpp
+  // called from closeAvi() in mjpeg2sd.cpp, before remaining audio taken
   if (micRecording) {
-    // finish a recording and save if valid
     micRecording = false; 
     if (isValid) {
-      size_t dataBytes = updateWavHeader();
-      wavFile.seek(0, SeekSet); // start of file
-      wavFile.write(wavHeader, WAV_HDR_LEN); // overwrite default header
-      wavFile.close();  
       LOG_INF("Captured %d audio samples with gain factor %i", totalSamples, micGain - MIC_GAIN_CENTER);
-      LOG_INF("Saved %s to SD for %s", fmtSize(dataBytes + WAV_HDR_LEN), WAVTEMP);
+      if (audDrops) LOG_WRN("Audio samples dropped as SD writes too slow: %lu", audDrops / sampleWidth);
     }
   }
 }
 
+static void queueAudioRecord(const uint8_t* audData, size_t audLen) {
+  // add mic input to ring for SD write task, dropped if no space
+  uint32_t head = audHead;
+  if (AUD_RING_LEN - (head - __atomic_load_n(&audTail, __ATOMIC_ACQUIRE)) < audLen) {
+    audDrops += audLen;
+    return;
+  }
+  size_t ringPos = head & (AUD_RING_LEN - 1);
+  size_t partLen = std::min(audLen, AUD_RING_LEN - ringPos);
+  memcpy(audRing + ringPos, audData, partLen);
+  memcpy(audRing, audData + partLen, audLen - partLen);
+  __atomic_store_n(&audHead, head + audLen, __ATOMIC_RELEASE);
+}
+
+size_t audioRecordLen() {
+  // recorded audio bytes waiting for SD write task
+  return __atomic_load_n(&audHead, __ATOMIC_ACQUIRE) - audTail;
+}
+
+const uint8_t* peekAudioRecord(size_t* len) {
+  // waiting audio, up to end of ring, len reduced if ring wraps
+  size_t ringPos = audTail & (AUD_RING_LEN - 1);
+  *len = std::min(*len, AUD_RING_LEN - ringPos);
+  return audRing + ringPos;
+}
+
+void releaseAudioRecord(size_t len) {
+  // audio from peekAudioRecord() now buffered for SD
+  __atomic_store_n(&audTail, audTail + len, __ATOMIC_RELEASE);
+}
+
 static void camActions() {
   // apply esp mic input to required outputs
   while (true) {
@@ -391,7 +422,7 @@ static void camActions() {
     if (bytesRead) {
       if (micRecording) {
         // record mic input to SD
-        wavFile.write((uint8_t*)sampleBuffer, bytesRead);
+        queueAudioRecord((uint8_t*)sampleBuffer, bytesRead);
         totalSamples += bytesRead / sampleWidth; 
       }
       if (!audioBytes && audioBuffer) {
@@ -494,6 +525,8 @@ void prepAudio() {
   wsBufferLen = 0;
   // Audio task only needed for esp microphone
   if (!micUse) return;
+  if (audRing == NULL && psramFound()) audRing = (uint8_t*)ps_malloc(AUD_RING_LEN);
+  if (audRing == NULL) LOG_WRN("Insufficient memory to record audio");
 #endif
   if (audioHandle == NULL) xTaskCreateWithCaps(audioTask, "audioTask", AUDIO_STACK_SIZE, NULL, AUDIO_PRI, &audioHandle, STACK_MEM);
 #ifdef ISCAM
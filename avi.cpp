@@ -7,17 +7,22 @@ s60sc 2020, 2022
 
 /* AVI file format:
 header:
- 310 bytes
+ 478 bytes, including empty OpenDML super indexes
 per jpeg:
  4 byte 00dc marker
  4 byte jpeg size
  jpeg frame content
 0-3 bytes filler to align on DWORD boundary
-per PCM (audio file)
+ a jpeg size of 0 is an empty frame, inserted where capture missed a frame interval,
+ so that a player repeats the previous frame and keeps to the capture timeline
+per motion capture jpeg, following it, ignored by players
+ 4 byte JUNK marker
+ 4 byte size of 4
+ 4 byte random tag of recording, so crash recovery only keeps content of this recording
+per PCM (audio block), interleaved with jpegs as recorded
  4 byte 01wb marker
  4 byte pcm size
- pcm content
- 0-3 bytes filler to align on DWORD boundary
+ pcm content, multiple of 4 bytes
 footer:
  4 byte idx1 marker
  4 byte index size
@@ -31,6 +36,43 @@ footer:
   4 byte 0000
   4 byte pcm location
   4 byte pcm size
+
+OpenDML (AVI 2.0) standard indexes, for motion capture:
+ movi of last segment ends with a standard index of jpegs per segment, then one for all pcm:
+  4 byte ix00 or ix01 marker
+  4 byte index size
+  24 byte index header, with segment movi location as base offset, first segment for pcm
+  per jpeg or pcm:
+   4 byte location of content relative to base offset
+   4 byte size
+ super indexes in header reference each standard index, so a given frame
+ is located directly whatever the file size, as jpeg entries are separate from pcm
+ 
+OpenDML extension, when movi data exceeds segment size:
+ first RIFF AVI segment ends with idx1 for its frames only
+ each following segment:
+  4 byte RIFF marker
+  4 byte RIFF size
+  4 byte AVIX marker
+  4 byte LIST marker
+  4 byte movi size
+  4 byte movi marker
+  per jpeg as above
+ last segment has no idx1
+
+Index storage:
+ only the latest index entries are held in memory, earlier entries are spilled to
+ an index file on SD and read back when the index is appended to the avi
+
+Crash recovery:
+ for motion capture the index file is also a sidecar, whose header holds the recording
+ and segment details, updated periodically for the frames already flushed to SD.
+ At startup an orphaned sidecar means the recording was interrupted, so its index
+ is restored and only the chunks written after the last checkpoint are scanned
+
+Demux:
+ chunks are identified from an aviSource, which reads from a given file position,
+ so the same parsing serves playback and crash recovery, whatever the storage
 */
 
 #include "appGlobals.h"
@@ -38,17 +80,25 @@ footer:
 // avi header data
 const uint8_t dcBuf[4] = {0x30, 0x30, 0x64, 0x63};   // 00dc
 const uint8_t wbBuf[4] = {0x30, 0x31, 0x77, 0x62};   // 01wb
+const uint8_t junkBuf[4] = {0x4A, 0x55, 0x4E, 0x4B}; // JUNK
 static const uint8_t idx1Buf[4] = {0x69, 0x64, 0x78, 0x31}; // idx1
+static const uint8_t riffBuf[4] = {0x52, 0x49, 0x46, 0x46}; // RIFF
+static const uint8_t avixBuf[4] = {0x41, 0x56, 0x49, 0x58}; // AVIX
+static const uint8_t listBuf[4] = {0x4C, 0x49, 0x53, 0x54}; // LIST
+static const uint8_t moviBuf[4] = {0x6D, 0x6F, 0x76, 0x69}; // movi
+static const uint8_t ix00Buf[4] = {0x69, 0x78, 0x30, 0x30}; // ix00
+static const uint8_t ix01Buf[4] = {0x69, 0x78, 0x30, 0x31}; // ix01
+static const uint8_t indxBuf[4] = {0x69, 0x6E, 0x64, 0x78}; // indx
 static const uint8_t zeroBuf[4] = {0x00, 0x00, 0x00, 0x00}; // 0000
 static uint8_t* idxBuf[2] = {NULL, NULL};
 
 uint8_t aviHeader[AVI_HEADER_LEN] = { // AVI header template
   0x52, 0x49, 0x46, 0x46, 0x00, 0x00, 0x00, 0x00, 0x41, 0x56, 0x49, 0x20, 0x4C, 0x49, 0x53, 0x54,
-  0x16, 0x01, 0x00, 0x00, 0x68, 0x64, 0x72, 0x6C, 0x61, 0x76, 0x69, 0x68, 0x38, 0x00, 0x00, 0x00,
+  0xBE, 0x01, 0x00, 0x00, 0x68, 0x64, 0x72, 0x6C, 0x61, 0x76, 0x69, 0x68, 0x38, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0xe0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4C, 0x49, 0x53, 0x54, 0x6C, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4C, 0x49, 0x53, 0x54, 0xCC, 0x00, 0x00, 0x00,
   0x73, 0x74, 0x72, 0x6C, 0x73, 0x74, 0x72, 0x68, 0x30, 0x00, 0x00, 0x00, 0x76, 0x69, 0x64, 0x73,
   0x4D, 0x4A, 0x50, 0x47, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0A, 0x00, 0x00, 0x00,
@@ -56,13 +106,24 @@ uint8_t aviHeader[AVI_HEADER_LEN] = { // AVI header template
   0x28, 0x00, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x01, 0x00, 0x18, 0x00, 0x4D, 0x4A, 0x50, 0x47, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
-  0x4C, 0x49, 0x53, 0x54, 0x56, 0x00, 0x00, 0x00, 
+  0x69, 0x6E, 0x64, 0x78, 0x58, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x30, 0x30, 0x64, 0x63, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x4C, 0x49, 0x53, 0x54, 0x86, 0x00, 0x00, 0x00, 
   0x73, 0x74, 0x72, 0x6C, 0x73, 0x74, 0x72, 0x68, 0x30, 0x00, 0x00, 0x00, 0x61, 0x75, 0x64, 0x73,
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x01, 0x00, 0x00, 0x00, 0x11, 0x2B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x11, 0x2B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x73, 0x74, 0x72, 0x66,
   0x12, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x11, 0x2B, 0x00, 0x00, 0x11, 0x2B, 0x00, 0x00,
   0x02, 0x00, 0x10, 0x00, 0x00, 0x00, 
+  0x69, 0x6E, 0x64, 0x78, 0x28, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x30, 0x31, 0x77, 0x62, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x4C, 0x49, 0x53, 0x54, 0x10, 0x00, 0x00, 0x00, 0x6F, 0x64, 0x6D, 0x6C, 0x64, 0x6D, 0x6C, 0x68,
+  0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
   0x4C, 0x49, 0x53, 0x54, 0x00, 0x00, 0x00, 0x00, 0x6D, 0x6F, 0x76, 0x69,
 };
 
@@ -100,37 +161,172 @@ static const frameSizeStruct frameSizeData[] = {
 };
 
 #define IDX_ENTRY 16 // bytes per index entry
+#define IX_HDR 32 // bytes in standard index header
+#define IX_ENTRY 8 // bytes per standard index entry
+#define AVI_SEGMENTS 4 // max RIFF segments, as FAT32 file size limited to 4GB
+#ifndef AVI_SEG_MAX // smaller in host test build, for segments in short recordings
+#define AVI_SEG_MAX (ONEMEG * 896) // max movi data per segment, below 1GB for legacy players
+#endif
+#define IDX_WINDOW 256 // index entries held in memory before spilling to index file
+#define IDX_CACHE 64 // index entries read back from index file at a time
+#ifndef LIVE_FRAMES // smaller in host test build, so earlier frames are located from index
+#define LIVE_FRAMES 2048 // most recent video frames of motion capture held for live playback
+#endif
 
 // separate index for motion capture and timelapse
-static size_t idxPtr[2];
+// only latest entries held in window, earlier entries are spilled to index file
+static File idxFile[2];
+static uint8_t* idxCache[2] = {NULL, NULL};
+static uint32_t idxCount[2]; // total index entries
+static uint32_t idxSpilled[2]; // entries written to index file
+static uint32_t cacheFirst[2]; // first entry held in cache
+static uint32_t cacheCnt[2];
+static size_t idxRead[2];
 static size_t idxOffset[2];
 static size_t moviSize[2];
-static size_t audSize;
 static size_t indexLen[2];
-static File wavFile;
-bool haveSoundFile = false;
+static size_t audSize; // total pcm bytes in motion capture
+static uint32_t audEntries; // pcm index entries in motion capture
 
-void prepAviIndex(bool isTL) {
-  // prep buffer to store index data, gets appended to end of file
-  if (idxBuf[isTL] == NULL) idxBuf[isTL] = (uint8_t*)ps_malloc((maxFrames+2)*IDX_ENTRY); // include space for header & audio index 
-  memcpy(idxBuf[isTL], idx1Buf, 4); // index header
-  idxPtr[isTL] = CHUNK_HDR;  // leave 4 bytes for index size
-  moviSize[isTL] = indexLen[isTL] = 0;
+// OpenDML segments for motion capture
+struct aviSegment {
+  size_t riffPos; // file position of RIFF marker
+  size_t moviPos; // file position of movi marker, base for index offsets
+  size_t moviEnd; // file position after last frame in segment
+  size_t ixPos; // file position of standard index
+  uint32_t firstEntry; // first index entry in segment
+  uint32_t vidEntries; // jpeg index entries in segment
+};
+static aviSegment aviSegs[AVI_SEGMENTS];
+static uint8_t segCnt = 1;
+static size_t aviEnd; // end of standard indexes, which is file size when multiple segments
+static uint8_t odmlSeg; // standard index being written, segCnt for audio
+static uint32_t odmlEntry;
+static bool ixStarted; // header of current standard index written
+static bool liveIndex = false; // motion capture index still being built, so can be used for live playback
+
+// position of recent video frames of motion capture, so live playback need not search index under aviMutex
+struct liveFrame {
+  uint32_t filePos; // file position of chunk
+  uint32_t dataSize;
+};
+static liveFrame* liveRing = NULL; // allocated for each motion capture, freed once its index finalized
+static uint32_t liveFrames; // video frames added to live ring, earlier ones overwritten
+
+// index checkpoint sidecar for motion capture, is also its index file
+#define CKPT_MAGIC 0x32504B43 // CKP2
+struct ckptHeader {
+  uint32_t magic;
+  aviRecovery rec;
+  uint32_t entries; // index entries for content before rec.filePos
+  uint8_t segCnt;
+  aviSegment segs[AVI_SEGMENTS];
+};
+static ckptHeader ckptHdr;
+
+static inline size_t idxBase(bool isTL) {
+  // file position of first entry in index file
+  return isTL ? 0 : sizeof(ckptHeader);
+}
+
+static void spillAviIndex(bool isTL) {
+  // append entries in window to index file, leaving window empty
+  uint32_t inWindow = idxCount[isTL] - idxSpilled[isTL];
+  if (!inWindow) return;
+  idxFile[isTL].seek(idxBase(isTL) + idxSpilled[isTL] * IDX_ENTRY, SeekSet);
+  if (idxFile[isTL].write(idxBuf[isTL], inWindow * IDX_ENTRY) != inWindow * IDX_ENTRY) 
+    LOG_WRN("Failed to write %lu index entries to %s", inWindow, isTL ? TLIDXTEMP : IDXTEMP);
+  idxSpilled[isTL] = idxCount[isTL];
+}
+
+static const uint8_t* idxEntry(bool isTL, uint32_t entry) {
+  // get index entry from window, else read from index file via cache
+  if (entry >= idxSpilled[isTL]) return idxBuf[isTL] + (entry - idxSpilled[isTL]) * IDX_ENTRY;
+  if (entry < cacheFirst[isTL] || entry >= cacheFirst[isTL] + cacheCnt[isTL]) {
+    cacheFirst[isTL] = entry;
+    cacheCnt[isTL] = std::min((uint32_t)IDX_CACHE, idxSpilled[isTL] - entry);
+    idxFile[isTL].seek(idxBase(isTL) + entry * IDX_ENTRY, SeekSet);
+    if (idxFile[isTL].read(idxCache[isTL], cacheCnt[isTL] * IDX_ENTRY) != cacheCnt[isTL] * IDX_ENTRY) {
+      LOG_WRN("Failed to read index entry %lu from %s", entry, isTL ? TLIDXTEMP : IDXTEMP);
+      memset(idxCache[isTL], 0, cacheCnt[isTL] * IDX_ENTRY);
+    }
+  }
+  return idxCache[isTL] + (entry - cacheFirst[isTL]) * IDX_ENTRY;
+}
+
+static bool openIdxFile(bool isTL, const char* mode) {
+  // open index file, and allocate fixed size window and cache when first used
+  if (idxBuf[isTL] == NULL) idxBuf[isTL] = (uint8_t*)ps_malloc(IDX_WINDOW * IDX_ENTRY);
+  if (idxCache[isTL] == NULL) idxCache[isTL] = (uint8_t*)ps_malloc(IDX_CACHE * IDX_ENTRY);
+  if (idxFile[isTL]) idxFile[isTL].close();
+  idxFile[isTL] = STORAGE.open(isTL ? TLIDXTEMP : IDXTEMP, mode);
+  if (!idxFile[isTL]) LOG_WRN("Failed to open %s", isTL ? TLIDXTEMP : IDXTEMP);
+  return (bool)idxFile[isTL];
+}
+
+static void resetAviIndex(bool isTL) {
+  // initialise index state for new recording
+  idxCount[isTL] = idxSpilled[isTL] = cacheFirst[isTL] = cacheCnt[isTL] = 0;
+  moviSize[isTL] = indexLen[isTL] = idxRead[isTL] = 0;
   idxOffset[isTL] = 4; // 4 byte offset
+  if (!isTL) {
+    // single segment until movi data exceeds segment size
+    audSize = audEntries = liveFrames = 0;
+    segCnt = 1;
+    aviSegs[0] = {0, AVI_HEADER_LEN - 4, 0, 0, 0, 0};
+    aviEnd = 0;
+  }
+}
+
+void prepAviIndex(bool isTL) {
+  // prep index window, entries spill to index file which is appended to end of avi
+  openIdxFile(isTL, "w+");
+  resetAviIndex(isTL);
+  if (!isTL) {
+    if (liveRing == NULL) liveRing = (liveFrame*)ps_malloc(LIVE_FRAMES * sizeof(liveFrame));
+    liveIndex = true;
+  }
 }
 
-void buildAviHdr(uint8_t FPS, uint8_t frameType, uint16_t frameCnt, bool isTL) {
+static uint32_t segEnd(uint8_t seg) {
+  // index entry after last entry in given segment
+  return seg + 1 < segCnt ? aviSegs[seg + 1].firstEntry : idxCount[0];
+}
+
+static uint8_t entrySeg(uint32_t entry) {
+  // segment holding given index entry
+  uint8_t seg = 0;
+  while (seg + 1 < segCnt && entry >= aviSegs[seg + 1].firstEntry) seg++;
+  return seg;
+}
+
+void buildAviHdr(uint8_t FPS, uint8_t frameType, uint32_t frameCnt, bool isTL, uint32_t audioDelay) {
   // update AVI header template with file specific details
-  size_t aviSize = moviSize[isTL] + AVI_HEADER_LEN + ((CHUNK_HDR+IDX_ENTRY) * (frameCnt+(haveSoundFile?1:0))); // AVI content size 
+  bool isOdml = !isTL && segCnt > 1;
+  bool haveIx = !isTL && aviEnd; // standard indexes written
+  bool haveAudio = !isTL && audEntries;
+  size_t aviSize = moviSize[isTL] + AVI_HEADER_LEN + ((CHUNK_HDR+IDX_ENTRY) * idxCount[isTL]); // AVI content size 
+  uint32_t dataSize = moviSize[isTL] + (idxCount[isTL] * CHUNK_HDR) + 4; 
+  uint32_t firstFrames = frameCnt;
+  if (isOdml) {
+    // first RIFF only covers first segment and its idx1
+    aviSize = aviSegs[1].riffPos - 8;
+    dataSize = aviSegs[0].moviEnd - aviSegs[0].moviPos;
+    firstFrames = aviSegs[0].vidEntries;
+  } else if (haveIx) {
+    // standard indexes at end of movi, before idx1
+    aviSize += aviEnd - aviSegs[0].moviEnd;
+    dataSize += aviEnd - aviSegs[0].moviEnd;
+  }
   // update aviHeader with relevant stats
   memcpy(aviHeader+4, &aviSize, 4);
   uint32_t usecs = (uint32_t)round(1000000.0f / FPS); // usecs_per_frame 
   memcpy(aviHeader+0x20, &usecs, 4); 
-  memcpy(aviHeader+0x30, &frameCnt, 2);
-  memcpy(aviHeader+0x8C, &frameCnt, 2);
+  memcpy(aviHeader+0x30, &firstFrames, 4);
+  memcpy(aviHeader+0x8C, &frameCnt, 4);
+  memcpy(aviHeader+0x1CE, &frameCnt, 4); // dmlh total frames
   memcpy(aviHeader+0x84, &FPS, 1);
-  uint32_t dataSize = moviSize[isTL] + ((frameCnt+(haveSoundFile?1:0)) * CHUNK_HDR) + 4; 
-  memcpy(aviHeader+0x12E, &dataSize, 4); // data size 
+  memcpy(aviHeader+0x1D6, &dataSize, 4); // data size 
 
   // apply video framesize to avi header
   memcpy(aviHeader+0x40, frameSizeData[frameType].frameWidth, 2);
@@ -138,105 +334,478 @@ void buildAviHdr(uint8_t FPS, uint8_t frameType, uint16_t frameCnt, bool isTL) {
   memcpy(aviHeader+0x44, frameSizeData[frameType].frameHeight, 2);
   memcpy(aviHeader+0xAC, frameSizeData[frameType].frameHeight, 2);
 
+  // super indexes, timelapse only has idx1
+  uint32_t superCnt = haveIx ? segCnt : 0;
+  memcpy(aviHeader+0xD8, &superCnt, 4);
+  for (uint8_t i = 0; i < superCnt; i++) {
+    uint64_t ixPos = aviSegs[i].ixPos;
+    uint32_t entries = aviSegs[i].vidEntries;
+    uint32_t ixSize = IX_HDR + entries * IX_ENTRY;
+    memcpy(aviHeader+0xEC+(i*16), &ixPos, 8);
+    memcpy(aviHeader+0xEC+(i*16)+8, &ixSize, 4);
+    memcpy(aviHeader+0xEC+(i*16)+12, &entries, 4); // duration in frames
+  }
+  superCnt = haveIx && haveAudio ? 1 : 0;
+  memcpy(aviHeader+0x196, &superCnt, 4);
+  if (superCnt) {
+    uint32_t ixSize = IX_HDR + audEntries * IX_ENTRY;
+    uint64_t ixPos = aviEnd - ixSize;
+    uint32_t samples = audSize / 2;
+    memcpy(aviHeader+0x1AA, &ixPos, 8);
+    memcpy(aviHeader+0x1B2, &ixSize, 4);
+    memcpy(aviHeader+0x1B6, &samples, 4);
+  }
+
 #if INCLUDE_AUDIO
-  uint8_t withAudio = 2; // increase number of streams for audio
-  if (isTL) memcpy(aviHeader+0x100, zeroBuf, 4); // no audio for timelapse
+  uint8_t streams = haveAudio ? 2 : 1; // increase number of streams for audio
+  memcpy(aviHeader+0x38, &streams, 1); 
+  if (isTL) memcpy(aviHeader+0x160, zeroBuf, 4); // no audio for timelapse
   else {
-    if (haveSoundFile) memcpy(aviHeader+0x38, &withAudio, 1); 
-    memcpy(aviHeader+0x100, &audSize, 4); // audio data size
+    uint32_t samples = audSize / 2;
+    memcpy(aviHeader+0x160, &samples, 4); // audio length in samples
   }
+  // audio stream start, in samples, if audio recording started after first frame
+  uint32_t audioStart = isTL ? 0 : (uint32_t)((uint64_t)audioDelay * SAMPLE_RATE / 1000);
+  memcpy(aviHeader+0x15C, &audioStart, 4);
   // apply audio details to avi header
-  memcpy(aviHeader+0xF8, &SAMPLE_RATE, 4);
+  memcpy(aviHeader+0x158, &SAMPLE_RATE, 4);
   uint32_t bytesPerSec = SAMPLE_RATE * 2;
-  memcpy(aviHeader+0x104, &bytesPerSec, 4); // suggested buffer size
-  memcpy(aviHeader+0x11C, &SAMPLE_RATE, 4);
-  memcpy(aviHeader+0x120, &bytesPerSec, 4); // bytes per sec
+  memcpy(aviHeader+0x164, &bytesPerSec, 4); // suggested buffer size
+  memcpy(aviHeader+0x17C, &SAMPLE_RATE, 4);
+  memcpy(aviHeader+0x180, &bytesPerSec, 4); // bytes per sec
 #else
-  memcpy(aviHeader+0x100, zeroBuf, 4);
+  memcpy(aviHeader+0x160, zeroBuf, 4);
 #endif
 
-  // reset state for next recording
-  moviSize[isTL] = idxPtr[isTL] = 0;
+  // reset state for next recording, index retained until written
+  moviSize[isTL] = 0;
   idxOffset[isTL] = 4; // 4 byte offset
 }
 
+static void addLiveFrame(size_t filePos, uint32_t dataSize) {
+  // add video frame to live playback ring, replacing oldest, called with aviMutex held
+  if (liveRing != NULL) liveRing[liveFrames % LIVE_FRAMES] = {(uint32_t)filePos, dataSize};
+  liveFrames++;
+}
+
 void buildAviIdx(size_t dataSize, bool isVid, bool isTL) {
   // build AVI video index into buffer - 16 bytes per frame
   // called from saveFrame() for each frame
+  // motion capture index is shared with live playback, so held while updated
+  if (!isTL) xSemaphoreTake(aviMutex, portMAX_DELAY);
   moviSize[isTL] += dataSize;
-  if (idxPtr[isTL] + IDX_ENTRY > (maxFrames+2)*IDX_ENTRY) doRestart("Need to reboot if max frames changed");
-  if (isVid) memcpy(idxBuf[isTL]+idxPtr[isTL], dcBuf, 4);
-  else memcpy(idxBuf[isTL]+idxPtr[isTL], wbBuf, 4);
-  memcpy(idxBuf[isTL]+idxPtr[isTL]+4, zeroBuf, 4);
-  memcpy(idxBuf[isTL]+idxPtr[isTL]+8, &idxOffset[isTL], 4); 
-  memcpy(idxBuf[isTL]+idxPtr[isTL]+12, &dataSize, 4); 
+  if (idxCount[isTL] - idxSpilled[isTL] >= IDX_WINDOW) spillAviIndex(isTL);
+  uint8_t* entry = idxBuf[isTL] + (idxCount[isTL] - idxSpilled[isTL]) * IDX_ENTRY;
+  if (isVid) memcpy(entry, dcBuf, 4);
+  else memcpy(entry, wbBuf, 4);
+  memcpy(entry+4, zeroBuf, 4);
+  memcpy(entry+8, &idxOffset[isTL], 4); 
+  memcpy(entry+12, &dataSize, 4); 
+  if (!isTL && isVid) addLiveFrame(aviSegs[segCnt - 1].moviPos + idxOffset[isTL], dataSize); // offset is from movi marker
   idxOffset[isTL] += dataSize + CHUNK_HDR;
-  idxPtr[isTL] += IDX_ENTRY; 
+  idxCount[isTL]++; 
+  if (!isTL) {
+    if (isVid) aviSegs[segCnt - 1].vidEntries++;
+    else {
+      audSize += dataSize;
+      audEntries++;
+    }
+    xSemaphoreGive(aviMutex);
+  }
+}
+
+void skipAviIdx(size_t chunkLen) {
+  // account for motion capture chunk that is not indexed, ie recording tag following each jpeg
+  // movi size counts whole chunk, as only indexed chunks have their header added
+  moviSize[0] += chunkLen;
+  idxOffset[0] += chunkLen;
+}
+
+bool aviSegmentFull(size_t chunkLen) {
+  // whether chunk would take current segment movi data beyond segment size
+  return idxOffset[0] + chunkLen > AVI_SEG_MAX;
+}
+
+static void finalizeIdx1(bool isTL) {
+  // size idx1 for all index entries, and start reading them
+  indexLen[isTL] = idxCount[isTL] * IDX_ENTRY + CHUNK_HDR;
+  idxRead[isTL] = 0; // position in idx1 content
+}
+
+uint8_t startAviSegment(size_t filePos) {
+  // end current segment at filePos, and start next OpenDML segment
+  // for first segment, idx1 is then obtained from writeAviIndex(), followed by segment header
+  // returns new segment number, or 0 if none available
+  if (segCnt >= AVI_SEGMENTS) return 0;
+  aviSegs[segCnt - 1].moviEnd = filePos;
+  if (segCnt == 1) {
+    finalizeIdx1(false);
+    filePos += indexLen[0];
+  }
+  aviSegs[segCnt] = {filePos, filePos + 20, 0, 0, idxCount[0], 0};
+  idxOffset[0] = 4; // index offsets now relative to new movi
+  return segCnt++;
+}
+
+size_t buildAviSegHdr(uint8_t* segBuff, uint8_t seg) {
+  // build header for given segment, with sizes once file completed
+  // returns its file position, or 0 if no such segment
+  if (seg == 0 || seg >= segCnt) return 0;
+  uint32_t riffSize = 0, listSize = 0;
+  if (aviEnd) {
+    riffSize = (seg + 1 < segCnt ? aviSegs[seg + 1].riffPos : aviEnd) - aviSegs[seg].riffPos - 8;
+    listSize = (seg + 1 < segCnt ? aviSegs[seg].moviEnd : aviEnd) - aviSegs[seg].moviPos;
+  }
+  memcpy(segBuff, riffBuf, 4);
+  memcpy(segBuff+4, &riffSize, 4);
+  memcpy(segBuff+8, avixBuf, 4);
+  memcpy(segBuff+12, listBuf, 4);
+  memcpy(segBuff+16, &listSize, 4);
+  memcpy(segBuff+20, moviBuf, 4);
+  return aviSegs[seg].riffPos;
+}
+
+static size_t writeOdmlIndex(byte* clientBuf, size_t buffSize) {
+  // write standard index of jpegs for each segment, then of pcm for whole file
+  size_t buffLen = 0;
+  while (odmlSeg < segCnt + (audEntries ? 1 : 0)) {
+    bool isAud = odmlSeg == segCnt;
+    uint8_t seg = isAud ? 0 : odmlSeg;
+    uint32_t entries = isAud ? audEntries : aviSegs[seg].vidEntries;
+    uint32_t lastEntry = isAud ? idxCount[0] : segEnd(seg);
+    if (!ixStarted) {
+      // start of standard index
+      if (buffLen + IX_HDR > buffSize) break;
+      uint32_t ixSize = IX_HDR - CHUNK_HDR + entries * IX_ENTRY;
+      uint16_t longsPerEntry = 2;
+      uint8_t indexType = 1; // index of chunks
+      uint64_t baseOffset = aviSegs[seg].moviPos;
+      memset(clientBuf+buffLen, 0, IX_HDR);
+      memcpy(clientBuf+buffLen, isAud ? ix01Buf : ix00Buf, 4);
+      memcpy(clientBuf+buffLen+4, &ixSize, 4);
+      memcpy(clientBuf+buffLen+8, &longsPerEntry, 2);
+      memcpy(clientBuf+buffLen+11, &indexType, 1);
+      memcpy(clientBuf+buffLen+12, &entries, 4);
+      memcpy(clientBuf+buffLen+16, isAud ? wbBuf : dcBuf, 4);
+      memcpy(clientBuf+buffLen+20, &baseOffset, 8);
+      buffLen += IX_HDR;
+      odmlEntry = aviSegs[seg].firstEntry;
+      ixStarted = true;
+    }
+    for (; odmlEntry < lastEntry && buffLen + IX_ENTRY <= buffSize; odmlEntry++) {
+      const uint8_t* entry = idxEntry(0, odmlEntry);
+      if (memcmp(entry, isAud ? wbBuf : dcBuf, 4)) continue;
+      // offset of content rather than marker, size with bit 31 clear as every frame is a key frame
+      // pcm offsets are relative to first segment, as file is under 4GB
+      uint32_t offset;
+      memcpy(&offset, entry+8, 4);
+      offset += CHUNK_HDR;
+      if (isAud) offset += aviSegs[entrySeg(odmlEntry)].moviPos - aviSegs[0].moviPos;
+      memcpy(clientBuf+buffLen, &offset, 4);
+      memcpy(clientBuf+buffLen+4, entry+12, 4);
+      buffLen += IX_ENTRY;
+    }
+    if (odmlEntry < lastEntry) break; // client buffer full
+    odmlSeg++;
+    ixStarted = false;
+  }
+  return buffLen;
 }
 
 size_t writeAviIndex(byte* clientBuf, size_t buffSize, bool isTL) {
   // write completed index to avi file
   // called repeatedly from closeAvi() until return 0
-  if (idxPtr[isTL] < indexLen[isTL]) {
-    if (indexLen[isTL]-idxPtr[isTL] > buffSize) {
-      memcpy(clientBuf, idxBuf[isTL]+idxPtr[isTL], buffSize);
-      idxPtr[isTL] += buffSize;
-      return buffSize;
-    } else {
-      // final part of index
-      size_t final = indexLen[isTL]-idxPtr[isTL];
-      memcpy(clientBuf, idxBuf[isTL]+idxPtr[isTL], final);
-      idxPtr[isTL] = indexLen[isTL];
-      return final;
-    }
+  if (!isTL && aviEnd) {
+    // standard indexes, followed by idx1 if single segment
+    size_t buffLen = writeOdmlIndex(clientBuf, buffSize);
+    if (buffLen || segCnt > 1) return buffLen;
+  }
+  size_t buffLen = 0;
+  if (!idxRead[isTL] && indexLen[isTL] && buffSize >= CHUNK_HDR) {
+    // index header
+    uint32_t sizeOfIndex = indexLen[isTL] - CHUNK_HDR;
+    memcpy(clientBuf, idx1Buf, 4);
+    memcpy(clientBuf+4, &sizeOfIndex, 4);
+    buffLen = idxRead[isTL] = CHUNK_HDR;
+  }
+  while (idxRead[isTL] < indexLen[isTL] && buffLen + IDX_ENTRY <= buffSize) {
+    memcpy(clientBuf+buffLen, idxEntry(isTL, (idxRead[isTL] - CHUNK_HDR) / IDX_ENTRY), IDX_ENTRY);
+    buffLen += IDX_ENTRY;
+    idxRead[isTL] += IDX_ENTRY;
   }
-  return idxPtr[isTL] = 0;
+  return buffLen;
 }
   
-void finalizeAviIndex(uint16_t frameCnt, bool isTL) {
+void finalizeAviIndex(bool isTL, size_t filePos) {
   // update index with size
-  uint32_t sizeOfIndex = (frameCnt+(haveSoundFile?1:0))*IDX_ENTRY;
-  memcpy(idxBuf[isTL]+4, &sizeOfIndex, 4); // size of index 
-  indexLen[isTL] = sizeOfIndex + CHUNK_HDR;
-  idxPtr[isTL] = 0; // pointer to index buffer
+  if (!isTL) {
+    // index now ready to be written to avi, so no longer available for live playback
+    xSemaphoreTake(aviMutex, portMAX_DELAY);
+    liveIndex = false;
+    free(liveRing);
+    liveRing = NULL;
+    xSemaphoreGive(aviMutex);
+    // standard indexes appended at filePos, within movi of last segment
+    odmlSeg = 0;
+    ixStarted = false;
+    aviSegs[segCnt - 1].moviEnd = filePos;
+    for (uint8_t i = 0; i < segCnt; i++) {
+      aviSegs[i].ixPos = filePos;
+      filePos += IX_HDR + aviSegs[i].vidEntries * IX_ENTRY;
+    }
+    if (audEntries) filePos += IX_HDR + audEntries * IX_ENTRY;
+    aviEnd = filePos;
+    if (segCnt > 1) return;
+  }
+  finalizeIdx1(isTL);
 }
 
-bool haveWavFile(bool isTL) {
-  haveSoundFile = false;
-  audSize = 0;
-#if INCLUDE_AUDIO
-  if (isTL) return false;
-  // check if wave file exists
-  if (!STORAGE.exists(WAVTEMP)) return false; 
-  // open it and get its size
-  wavFile = STORAGE.open(WAVTEMP, FILE_READ);
-  if (wavFile) {
-    // add sound file index
-    audSize = wavFile.size() - WAV_HDR_LEN;
-    buildAviIdx(audSize, false); 
-    // add sound file header    
-    wavFile.seek(WAV_HDR_LEN, SeekSet); // skip over header
-    haveSoundFile = true;
-  } 
-#endif
-  return haveSoundFile;
+void openAviCheckpoint(const char* aviName, const char* partName, uint8_t FPS, uint8_t frameType, uint32_t tag) {
+  // initialise sidecar header for recording just opened, after prepAviIndex()
+  memset(&ckptHdr, 0, sizeof(ckptHdr));
+  ckptHdr.magic = CKPT_MAGIC;
+  strncpy(ckptHdr.rec.aviName, aviName, FILE_NAME_LEN - 1);
+  strncpy(ckptHdr.rec.partName, partName, FILE_NAME_LEN - 1);
+  ckptHdr.rec.FPS = FPS;
+  ckptHdr.rec.frameType = frameType;
+  ckptHdr.rec.tag = tag;
+  saveAviCheckpoint(AVI_HEADER_LEN); // recovery scans from first frame
 }
 
-size_t writeWavFile(byte* clientBuf, size_t buffSize) {
-  // read in wav file and write to avi file
-  // called repeatedly from closeAvi() until return 0
-  static size_t offsetWav = CHUNK_HDR;
-  if (offsetWav) {
-    // add sound file header
-    memcpy(clientBuf, wbBuf, 4);
-    memcpy(clientBuf+4, &audSize, 4); 
-  } 
-  size_t readLen = wavFile.read(clientBuf+offsetWav, buffSize-offsetWav) + offsetWav; 
-  offsetWav = 0;
-  if (readLen) return readLen; 
-  // get here if finished
-  wavFile.close();
-  STORAGE.remove(WAVTEMP);
-  offsetWav = CHUNK_HDR;
+void saveAviCheckpoint(size_t filePos) {
+  // spill index entries to sidecar, then update header for content now on SD
+  // only called once avi file flushed up to filePos, and all indexed chunks end before it
+  if (!idxFile[0]) return;
+  xSemaphoreTake(aviMutex, portMAX_DELAY);
+  spillAviIndex(false);
+  idxFile[0].flush(); // entries must be on SD before header refers to them
+  ckptHdr.rec.frames = idxCount[0] - audEntries;
+  ckptHdr.rec.audioBytes = audSize;
+  ckptHdr.rec.filePos = filePos;
+  ckptHdr.entries = idxCount[0];
+  ckptHdr.segCnt = segCnt;
+  memcpy(ckptHdr.segs, aviSegs, sizeof(aviSegs));
+  idxFile[0].seek(0, SeekSet);
+  idxFile[0].write((uint8_t*)&ckptHdr, sizeof(ckptHdr));
+  idxFile[0].flush();
+  xSemaphoreGive(aviMutex);
+}
+
+static liveFrame indexedFrame(uint32_t frameNum) {
+  // position of given video frame from index entries, called with aviMutex held
+  // segment found from its video entries, whose entries are only searched if audio interleaved
+  uint8_t seg = 0;
+  while (seg < segCnt && frameNum >= aviSegs[seg].vidEntries) frameNum -= aviSegs[seg++].vidEntries;
+  if (seg >= segCnt) return {0, 0};
+  uint32_t entry = aviSegs[seg].firstEntry + frameNum;
+  if (audEntries) {
+    uint32_t vidCnt = 0;
+    for (entry = aviSegs[seg].firstEntry; entry < segEnd(seg); entry++) 
+      if (!memcmp(idxEntry(false, entry), dcBuf, 4) && vidCnt++ == frameNum) break;
+    if (entry >= segEnd(seg)) return {0, 0};
+  }
+  const uint8_t* idxPtr = idxEntry(false, entry);
+  uint32_t offset, dataSize;
+  memcpy(&offset, idxPtr + 8, 4);
+  memcpy(&dataSize, idxPtr + 12, 4);
+  return {(uint32_t)(aviSegs[seg].moviPos + offset), dataSize}; // offset is from movi marker
+}
+
+size_t findLiveFrame(uint32_t frameNum, size_t writtenPos) {
+  // file position of chunk for given video frame of motion capture in progress, 
+  // or 0 if not yet indexed or not yet written to SD up to writtenPos
+  // recent frames located from live ring in memory, earlier ones from index
+  size_t framePos = 0;
+  xSemaphoreTake(aviMutex, portMAX_DELAY);
+  if (liveIndex && frameNum < liveFrames) {
+    liveFrame frame = liveRing != NULL && liveFrames - frameNum <= LIVE_FRAMES 
+      ? liveRing[frameNum % LIVE_FRAMES] : indexedFrame(frameNum);
+    if (frame.filePos + CHUNK_HDR + frame.dataSize <= writtenPos) framePos = frame.filePos;
+  }
+  xSemaphoreGive(aviMutex);
+  return framePos;
+}
+
+void closeAviIndex(bool isTL) {
+  // index written to avi, so index file no longer needed
+  if (idxFile[isTL]) idxFile[isTL].close();
+  const char* idxName = isTL ? TLIDXTEMP : IDXTEMP;
+  if (STORAGE.exists(idxName)) STORAGE.remove(idxName);
+}
+
+bool loadAviCheckpoint(aviRecovery* rec) {
+  // restore index state from sidecar of interrupted recording, if present
+  if (!STORAGE.exists(IDXTEMP)) return false;
+  if (!openIdxFile(false, "r+")) return false;
+  resetAviIndex(false);
+  if (idxFile[0].read((uint8_t*)&ckptHdr, sizeof(ckptHdr)) != sizeof(ckptHdr) || ckptHdr.magic != CKPT_MAGIC 
+      || ckptHdr.segCnt < 1 || ckptHdr.segCnt > AVI_SEGMENTS 
+      || idxBase(false) + ckptHdr.entries * IDX_ENTRY > idxFile[0].size()) {
+    LOG_WRN("Invalid checkpoint %s", IDXTEMP);
+    return false;
+  }
+  // entries remain in sidecar, any beyond checkpoint are overwritten
+  idxCount[0] = idxSpilled[0] = ckptHdr.entries;
+  segCnt = ckptHdr.segCnt;
+  memcpy(aviSegs, ckptHdr.segs, sizeof(aviSegs));
+  // pcm size from restored entries
+  for (uint32_t i = 0; i < idxCount[0]; i++) {
+    const uint8_t* entry = idxEntry(false, i);
+    uint32_t dataSize;
+    memcpy(&dataSize, entry + 12, 4);
+    if (!memcmp(entry, wbBuf, 4)) {
+      audSize += dataSize;
+      audEntries++;
+    }
+  }
+  // next offset, and movi size including unindexed tag chunks, from checkpoint position
+  idxOffset[0] = ckptHdr.rec.filePos - aviSegs[segCnt - 1].moviPos;
+  if (segCnt == 1) moviSize[0] = idxOffset[0] - 4 - idxCount[0] * CHUNK_HDR;
+  *rec = ckptHdr.rec;
+  return true;
+}
+
+/*************** avi demux ****************/
+
+size_t readAviFile(void* ctx, size_t filePos, uint8_t* buff, size_t len) {
+  // aviSource read from SD file, with ctx as File*
+  File* file = (File*)ctx;
+  return file->seek(filePos, SeekSet) ? file->read(buff, len) : 0;
+}
+
+uint8_t parseAviChunk(const uint8_t* chunkHdr, bool isOdml, uint32_t* chunkLen) {
+  // identify chunk from its 8 byte header, with length to start of next chunk
+  uint32_t chunkSize;
+  memcpy(&chunkSize, chunkHdr + 4, 4);
+  *chunkLen = CHUNK_HDR + chunkSize + (chunkSize & 1);
+  if (!memcmp(chunkHdr, dcBuf, 4)) return AVI_VIDEO;
+  if (!memcmp(chunkHdr, wbBuf, 4)) return AVI_AUDIO;
+  if (!memcmp(chunkHdr, junkBuf, 4)) return AVI_JUNK;
+  // idx1 is only followed by further content if OpenDML segments
+  if (isOdml && !memcmp(chunkHdr, idx1Buf, 4)) return AVI_INDEX;
+  if (!memcmp(chunkHdr, riffBuf, 4)) {
+    *chunkLen = AVIX_HDR_LEN; // RIFF AVIX and LIST movi headers
+    return AVI_SEGMENT;
+  }
+  *chunkLen = 0;
+  return AVI_END;
+}
+
+uint8_t nextAviChunk(const aviSource* src, size_t filePos, uint32_t* chunkLen) {
+  // identify chunk at filePos, only if complete and valid, otherwise AVI_END
+  // for file which may be incomplete, so assumed to have OpenDML segments
+  uint8_t chunkHdr[CHUNK_HDR + 4];
+  *chunkLen = 0;
+  if (filePos + CHUNK_HDR > src->size) return AVI_END;
+  size_t hdrLen = src->readAt(src->ctx, filePos, chunkHdr, std::min(sizeof(chunkHdr), src->size - filePos));
+  if (hdrLen < CHUNK_HDR) return AVI_END;
+  uint32_t chunkSize;
+  memcpy(&chunkSize, chunkHdr + 4, 4);
+  uint8_t chunkType = parseAviChunk(chunkHdr, true, chunkLen);
+  switch (chunkType) {
+    case AVI_SEGMENT:
+      // later segments start without idx1, size fields may not yet be written
+      if (hdrLen < sizeof(chunkHdr) || memcmp(chunkHdr + CHUNK_HDR, avixBuf, 4) 
+        || filePos + AVIX_HDR_LEN > src->size) chunkType = AVI_END;
+      return chunkType;
+    case AVI_END:
+      return chunkType;
+  }
+  if (chunkSize > src->size - filePos - CHUNK_HDR) chunkType = AVI_END; // incomplete chunk
+  else if (chunkType == AVI_VIDEO) {
+    // either empty frame or jpeg
+    if (chunkSize && (chunkSize < 4 || chunkHdr[CHUNK_HDR] != 0xFF || chunkHdr[CHUNK_HDR + 1] != 0xD8)) chunkType = AVI_END;
+  } else if (chunkType == AVI_INDEX) {
+    // complete idx1 is followed by next segment
+    uint8_t marker[4];
+    if (src->readAt(src->ctx, filePos + *chunkLen, marker, 4) != 4 || memcmp(marker, riffBuf, 4)) chunkType = AVI_END;
+  }
+  if (chunkType == AVI_END) *chunkLen = 0;
+  return chunkType;
+}
+
+size_t findAviMovi(const aviSource* src, bool* isOdml) {
+  // locate first chunk in movi list from RIFF structure, as header length depends on AVI version
+  uint8_t chunkHdr[12];
+  uint32_t chunkSize = 0;
+  if (src->readAt(src->ctx, 0, chunkHdr, 12) == 12) memcpy(&chunkSize, chunkHdr + 4, 4);
+  // further RIFF AVIX segments follow first, rather than unused space in a preallocated file
+  size_t filePos = chunkSize + CHUNK_HDR;
+  *isOdml = filePos + 12 <= src->size && src->readAt(src->ctx, filePos, chunkHdr, 12) == 12
+    && !memcmp(chunkHdr, riffBuf, 4) && !memcmp(chunkHdr + 8, avixBuf, 4);
+  filePos = 12;
+  while (filePos + 12 <= src->size && src->readAt(src->ctx, filePos, chunkHdr, 12) == 12) {
+    memcpy(&chunkSize, chunkHdr + 4, 4);
+    if (!memcmp(chunkHdr, listBuf, 4) && !memcmp(chunkHdr + 8, moviBuf, 4)) return filePos + 12;
+    filePos += CHUNK_HDR + chunkSize + (chunkSize & 1);
+  }
+  return AVI_HEADER_LEN;
+}
+
+size_t findAviFrame(const aviSource* src, uint32_t frameNum) {
+  // file position of chunk for given video frame, or 0 if not found
+  // located from OpenDML standard index via header super index, else from idx1
+  uint8_t buff[IDX_ENTRY * IDX_CACHE];
+  if (src->readAt(src->ctx, 0, buff, 0xEC + AVI_SEGMENTS * 16) != 0xEC + AVI_SEGMENTS * 16) return 0;
+  uint8_t streams = buff[0x38];
+  uint32_t superCnt = 0;
+  if (!memcmp(buff + 0xCC, indxBuf, 4)) memcpy(&superCnt, buff + 0xD8, 4);
+  uint8_t superIdx[AVI_SEGMENTS * 16];
+  memcpy(superIdx, buff + 0xEC, sizeof(superIdx));
+  for (uint32_t i = 0; i < std::min(superCnt, (uint32_t)AVI_SEGMENTS); i++) {
+    uint64_t ixPos;
+    uint32_t entries;
+    memcpy(&ixPos, superIdx + i * 16, 8);
+    memcpy(&entries, superIdx + i * 16 + 12, 4);
+    if (frameNum >= entries) {
+      frameNum -= entries; // in later segment
+      continue;
+    }
+    // standard index for segment holding frame
+    uint64_t baseOffset;
+    uint32_t offset;
+    if (src->readAt(src->ctx, ixPos, buff, IX_HDR) != IX_HDR || memcmp(buff, ix00Buf, 4)) return 0;
+    memcpy(&baseOffset, buff + 20, 8);
+    if (src->readAt(src->ctx, ixPos + IX_HDR + frameNum * IX_ENTRY, buff, IX_ENTRY) != IX_ENTRY) return 0;
+    memcpy(&offset, buff, 4);
+    return baseOffset + offset - CHUNK_HDR; // entry locates content rather than marker
+  }
+  if (superCnt) return 0; // beyond last frame
+  // idx1 ends first RIFF, with offsets relative to movi marker
+  bool isOdml;
+  size_t moviPos = findAviMovi(src, &isOdml) - 4;
+  uint32_t listSize, idxSize;
+  if (src->readAt(src->ctx, moviPos - 4, buff, 4) != 4) return 0;
+  memcpy(&listSize, buff, 4);
+  size_t idxPos = moviPos + listSize;
+  if (src->readAt(src->ctx, idxPos, buff, CHUNK_HDR) != CHUNK_HDR || memcmp(buff, idx1Buf, 4)) return 0;
+  memcpy(&idxSize, buff + 4, 4);
+  uint32_t entryCnt = idxSize / IDX_ENTRY;
+  idxPos += CHUNK_HDR;
+  // without pcm, entry for frame is found directly, otherwise count jpeg entries
+  uint32_t entry = streams == 1 ? frameNum : 0;
+  while (entry < entryCnt) {
+    uint32_t readCnt = std::min(entryCnt - entry, (uint32_t)IDX_CACHE);
+    if (src->readAt(src->ctx, idxPos + entry * IDX_ENTRY, buff, readCnt * IDX_ENTRY) != readCnt * IDX_ENTRY) return 0;
+    for (uint32_t i = 0; i < readCnt; i++) {
+      if (memcmp(buff + i * IDX_ENTRY, dcBuf, 4)) continue;
+      if (streams > 1 && frameNum--) continue;
+      uint32_t offset;
+      memcpy(&offset, buff + i * IDX_ENTRY + 8, 4);
+      return moviPos + offset;
+    }
+    if (streams == 1) break; // entry was not jpeg
+    entry += readCnt;
+  }
   return 0;
 }
+
+bool aviFrameInfo(const aviSource* src, uint32_t* frameCnt, uint16_t* width, uint16_t* height) {
+  // total video frames and frame dimensions from avi header
+  uint8_t buff[0x90];
+  if (src->readAt(src->ctx, 0, buff, sizeof(buff)) != sizeof(buff) || memcmp(buff, riffBuf, 4)) return false;
+  memcpy(frameCnt, buff + 0x8C, 4); // strh length, covers all segments
+  memcpy(width, buff + 0x40, 2);
+  memcpy(height, buff + 0x44, 2);
+  return true;
+}
@@ -350,7 +350,7 @@ static bool uploadFolderOrFileFs(const char* fileOrFolder) {
 static void fileServerTask(void* parameter) {
   // process an FTP or HTTPS request
 #ifdef ISCAM
-  doPlayback = false; // close any current playback
+  stopPlaying(); // close any current playback
 #endif
   fsChunk = psramFound() ? (byte*)ps_malloc(CHUNKSIZE) : (byte*)malloc(CHUNKSIZE); 
   if (strlen(storedPathName) >= 2) {
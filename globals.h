@@ -164,6 +164,7 @@ void logLine();
 void logSetup();
 void OTAprereq();
 bool parseJson(int rxSize);
+bool preallocFile(const char* fileName, size_t fileSize);
 bool prepFreq(int maxFreq, int sampleInterval);
 bool prepI2C();
 void prepPeripherals();
@@ -186,9 +187,10 @@ void resetCrashLoop();
 void reset_log();
 void resetWatchDog(int wdIndex, uint32_t wdTimeout = 1);
 bool retrieveConfigVal(const char* variable, char* value);
+size_t sdClusterSize();
 void runTaskStats(bool _onceOnly = false);
 void saveRamLog(const char* ramLogName);
-esp_err_t sendChunks(File df, httpd_req_t *req, bool endChunking = true);
+esp_err_t sendChunks(File df, httpd_req_t *req, bool endChunking = true, size_t sendLen = 0);
 void sendSSE(const char* eventType, const char* eventData);
 void setFolderName(const char* fname, char* fileName);
 void setPeripheralResponse(const byte pinNum, const uint32_t responseData);
@@ -205,6 +207,7 @@ void stopPing();
 void syncToBrowser(uint32_t browserUTC);
 char* toCase(char *s, bool toLower = true);
 char* trim(char* str);
+bool truncateFile(const char* fileName, size_t fileSize);
 bool updateConfigVect(const char* variable, const char* value);
 void updateStatus(const char* variable, const char* _value, bool fromUser = true);
 esp_err_t uploadHandler(httpd_req_t *req);
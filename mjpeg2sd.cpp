@@ -7,6 +7,7 @@
 */
 
 #include "appGlobals.h"
+#include "ff.h"
 #if INCLUDE_AF
 #if __has_include("../libraries/OV5640_Auto_Focus_for_ESP32_Camera/src/ESP32_OV5640_AF.h") 
 #include <ESP32_OV5640_AF.h>
@@ -26,6 +27,7 @@ bool forceRecord = false; // Recording enabled by rec button
 int moveStartChecks = 5; // checks per second for start motion
 int moveStopSecs = 2; // secs between each check for stop, also determines post motion time
 int maxFrames = 20000; // maximum number of frames in video before auto close
+int preRollSecs = 0; // secs of frames prior to motion detection to include in recording
 
 // record timelapse avi independently of motion capture, file name has same format as avi except ends with T
 int tlSecsBetweenFrames; // too short interval will interfere with other activities
@@ -33,7 +35,7 @@ int tlDurationMins; // a new file starts when previous ends
 int tlPlaybackFPS;  // rate to playback the timelapse, min 1
 
 // status & control fields
-uint8_t FPS = 0;
+uint8_t FPS = 0; // requested frame rate
 bool nightTime = false;
 uint8_t fsizePtr; // index to frameData[]
 uint8_t minSeconds = 5; // default min video length (includes POST_MOTION_TIME)
@@ -49,61 +51,143 @@ static int frameLimit;
 
 // header and reporting info
 static uint32_t vidSize; // total video size
-static uint16_t frameCnt;
+static uint32_t frameCnt;
+static uint32_t aviFrames; // frames in avi, including empty frames for missed intervals
+static uint8_t aviFPS; // nominal frame rate of avi
+static uint32_t firstFrameMs; // capture time of first frame in avi
+static uint32_t audioStartMs; // time audio recording started
 static uint32_t startTime; // total overall time
 static uint32_t dTimeTot; // total frame decode/monitor time
 static uint32_t fTimeTot; // total frame buffering time
 static uint32_t wTimeTot; // total SD write time
 static uint32_t oTime; // file opening time
 static uint32_t cTime; // file closing time
-static uint32_t sTime; // file streaming time
 static uint32_t frameInterval; // units of us between frames
 
+// frame rate governor
+bool fpsGovernor = false; // adjust frame rate and jpeg quality to match processing load
+int minFPS = 1; // lowest frame rate governor can set
+int maxQuality = 30; // highest jpeg quality value (ie lowest quality) governor can set
+uint8_t govFPS = 0; // frame rate currently set by governor
+int govQuality = 0; // jpeg quality currently set by governor
+float achievedFPS = 0; // frame rate actually processed
+static uint32_t capBusyMs = 0; // capture task processing time
+static uint32_t procFrames = 0; // frames processed by capture task
+static volatile uint32_t sdBusyMs = 0; // SD write task processing time
+
 // SD card storage
-uint8_t iSDbuffer[(RAMSIZE + CHUNK_HDR) * 2];
-static size_t highPoint;
-static File aviFile;
+uint8_t iSDbuffer[RAMSIZE + CHUNK_HDR]; // motion recording staging buffer
+static volatile bool aviFull = false; // no more segments available in avi
+static uint32_t audBytes; // audio interleaved in avi
+#define AUD_CHUNK_MIN (1024 * 4) // min audio bytes per avi chunk, except last
+#define CHECKPOINT_MS 10000 // interval between index checkpoints for crash recovery
+static uint32_t ckptMs; // time of last index checkpoint
+static uint32_t recTag; // random value identifying this recording, for recovery
+static uint8_t tagChunk[CHUNK_HDR + 4]; // JUNK chunk holding recTag, following each jpeg chunk
 static char aviFileName[FILE_NAME_LEN];
 
+// Each avi being recorded has its own file, staging buffer and avi index (selected by isTL),
+// so that motion and timelapse recordings are written concurrently from the same frames
+struct aviRecorder {
+  File file;
+  FIL fil;
+  bool direct = false; // written directly with FatFs
+  bool isTL = false; // timelapse recording
+  uint8_t* buff = NULL; // staging buffer, with CHUNK_HDR spare for frame header overflow
+  size_t buffLen = 0;
+  size_t highPoint = 0; // end of content in staging buffer
+  size_t aviPos = 0; // file position of end of buffered content
+  volatile size_t writtenPos = 0; // file position of end of content written to SD
+};
+static aviRecorder aviRec; // motion or continuous recording
+static aviRecorder tlRec; // timelapse recording
+
 // SD playback
-static File playbackFile;
 static char partName[FILE_NAME_LEN];
-static size_t readLen;
-static uint8_t recFPS;
-static uint32_t recDuration;
 static uint8_t saveFPS = 99;
-bool doPlayback = false; // controls playback
+bool doPlayback = false; // selected file can be played
+uint8_t playSessions = 1; // max concurrent playback sessions
+static volatile bool liveRec = false; // motion capture in progress available for live playback
+int playFrame = -1; // frame to start next playback from
+int playSecs = -1; // or time in recording to start next playback from
+int playSpeed = 1; // playback speed multiple, negative for reverse, can change during playback
 
 // task control
 TaskHandle_t captureHandle = NULL;
 TaskHandle_t playbackHandle = NULL;
-static SemaphoreHandle_t readSemaphore;
-static SemaphoreHandle_t playbackSemaphore;
+TaskHandle_t sdWriteHandle = NULL;
+TaskHandle_t aviPoolHandle = NULL;
 SemaphoreHandle_t frameSemaphore[MAX_STREAMS] = {NULL};
 SemaphoreHandle_t motionSemaphore = NULL;
 SemaphoreHandle_t aviMutex = NULL;
-static volatile bool isPlaying = false; // controls playback on app
 bool isCapturing = false;
-bool stopPlayback = false; // controls if playback allowed
 bool timeLapseOn = false;
 int dashCamOn = 0; // whether to use / duration of dashcam style continuous recording
 
 #ifndef AUXILIARY
 framesize_t maxFS = FRAMESIZE_SVGA; // default
 
+// camera frame buffers shared with streams
+static frameRef frameRefs[FB_CNT];
+static frameRef* volatile streamFrame[MAX_STREAMS] = {NULL}; // frame handed to each stream
+static volatile bool streamWait[MAX_STREAMS] = {false}; // stream ready for next frame
+static uint8_t heldFrames = 0; // number of camera frame buffers currently in use
+static portMUX_TYPE frameMux = portMUX_INITIALIZER_UNLOCKED;
+
+// SD write queue, single producer (capture task) and single consumer (SD write task)
+#define SD_QUEUE_LEN 32 // must be power of 2
+#define SD_SPILL_MAX (ONEMEG * 2) // max psram used for queued frames copied out of camera buffers
+enum sdAction {SD_OPEN, SD_FRAME, SD_CLOSE, SD_TL_OPEN, SD_TL_FRAME, SD_TL_CLOSE};
+struct sdEntry {
+  uint8_t action;
+  uint8_t event; // event marker for frame
+  frameRef* ref; // camera frame, NULL if spilled
+  uint8_t* spill; // psram copy of frame, freed by SD write task
+  size_t len;
+  uint32_t msecs; // capture time
+};
+static sdEntry sdQueue[SD_QUEUE_LEN];
+static volatile uint32_t sdHead = 0; // only updated by capture task
+static volatile uint32_t sdTail = 0; // only updated by SD write task
+static size_t spillBytes = 0; // psram held by spilled frames
+static uint32_t sdQueueSpills = 0; // frames copied to psram as camera buffers needed
+uint8_t sdQueueHigh = 0; // queue high water mark for current recording
+uint32_t sdQueueDrops = 0; // frames not recorded as queue or psram full
+uint32_t captureSkips = 0; // frame timer ticks missed as capture task too busy
+
+// pre-roll ring of recent frames in psram, to capture period before motion detected
+#define PREROLL_MAX (ONEMEG * 2) // max psram used for pre-roll frames
+#define PREROLL_FRAMES 256 // max number of pre-roll frames
+struct preRollEntry {
+  uint32_t offset; // of frame in preRollBuf
+  uint32_t len;
+  uint32_t msecs; // capture time
+};
+static preRollEntry preRollIdx[PREROLL_FRAMES];
+static uint8_t* preRollBuf = NULL;
+static size_t preRollSize = 0;
+static uint16_t preRollOldest = 0;
+static uint16_t preRollCnt = 0;
+static volatile bool preRollBusy = false; // ring being saved by SD write task
+
+static inline uint32_t frameTime(camera_fb_t* fb) {
+  // capture time of frame in ms, same time base as millis()
+  return fb->timestamp.tv_sec * 1000 + fb->timestamp.tv_usec / 1000;
+}
+
 /**************** timers & ISRs ************************/
 
+static hw_timer_t* frameTimer = NULL;
+
 static void IRAM_ATTR frameISR() {
   // interrupt at current frame rate
   BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-  if (isPlaying) xSemaphoreGiveFromISR (playbackSemaphore, &xHigherPriorityTaskWoken ); // notify playback to send frame
   if (captureHandle != NULL) vTaskNotifyGiveFromISR(captureHandle, &xHigherPriorityTaskWoken); // wake capture task to process frame
   portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
 void controlFrameTimer(bool restartTimer) {
   // frame timer control
-  static hw_timer_t* frameTimer = NULL;
   // stop current timer
   if (frameTimer) {
     timerDetachInterrupt(frameTimer);
@@ -122,6 +206,1042 @@ void controlFrameTimer(bool restartTimer) {
   }
 }
 
+static void changeFrameTimer(uint8_t newFPS) {
+  // change interval of running frame timer
+  if (frameTimer && newFPS) {
+    frameInterval = OneMHz / newFPS;
+    timerAlarm(frameTimer, frameInterval, true, 0);
+  }
+}
+
+/**************** frame rate governor ************************/
+
+// Once a second the load on the capture and SD write tasks is derived from their processing times.
+// If either task is overloaded, or frames are being dropped or skipped, then the JPEG quality value
+// is increased (smaller frames) if SD writes are the bottleneck, else the frame rate is reduced.
+// When the load has been low for several seconds, the frame rate then quality are restored.
+// The frame rate and quality are kept within the user set limits minFPS and maxQuality.
+
+#define GOV_HIGH 90 // % load where governor reduces load
+#define GOV_LOW 60 // % load where governor can increase load
+#define GOV_CALM 5 // secs of low load before increasing load
+#define GOV_STEP 2 // change in jpeg quality value per adjustment
+
+static uint8_t baseFPS = 0; // user frame rate that governor adjusts from
+static int baseQuality = 0; // user jpeg quality that governor adjusts from
+
+static void setGovQuality(int newQuality) {
+  // change jpeg quality of sensor without changing user setting
+  sensor_t* s = esp_camera_sensor_get();
+  if (s != NULL && s->set_quality(s, newQuality) == ESP_OK) govQuality = newQuality;
+}
+
+static void resetGovernor() {
+  // restore user settings, which governor then adjusts from
+  if (govQuality && govQuality != quality) setGovQuality(quality);
+  if (govFPS != FPS) changeFrameTimer(FPS);
+  govFPS = baseFPS = FPS;
+  govQuality = baseQuality = quality;
+}
+
+static void governFrameRate() {
+  // adjust frame rate and jpeg quality to processing load
+  static uint32_t windowStart = 0;
+  static uint32_t lastSdBusy = 0, lastDrops = 0, lastSkips = 0;
+  static uint8_t calmCnt = 0;
+  uint32_t windowMs = millis() - windowStart;
+  if (windowMs < 1000) return;
+  achievedFPS = (float)procFrames * 1000 / windowMs;
+  uint32_t capLoad = 100 * capBusyMs / windowMs;
+  uint32_t sdLoad = 100 * (sdBusyMs - lastSdBusy) / windowMs;
+  // drop counters are reset at start of each recording
+  bool lostFrames = sdQueueDrops > lastDrops || captureSkips > lastSkips;
+  windowStart = millis();
+  capBusyMs = procFrames = 0;
+  lastSdBusy = sdBusyMs;
+  lastDrops = sdQueueDrops;
+  lastSkips = captureSkips;
+  if (!fpsGovernor) {
+    if (govFPS != FPS || govQuality != quality) resetGovernor();
+    return;
+  }
+  if (baseFPS != FPS || baseQuality != quality) {
+    // governor just enabled or user changed camera settings
+    resetGovernor();
+    calmCnt = 0;
+    return;
+  }
+  if (lostFrames || capLoad > GOV_HIGH || sdLoad > GOV_HIGH) {
+    // overloaded
+    calmCnt = 0;
+    if (sdLoad >= capLoad && govQuality < maxQuality) setGovQuality(std::min(govQuality + GOV_STEP, maxQuality));
+    else if (govFPS > minFPS) {
+      govFPS = std::max(govFPS - std::max(govFPS / 10, 1), minFPS);
+      changeFrameTimer(govFPS);
+    } else return;
+    LOG_VRB("Governor reduced load to %u FPS, quality %d, with capture load %lu%%, SD load %lu%%", govFPS, govQuality, capLoad, sdLoad);
+  } else if (capLoad < GOV_LOW && sdLoad < GOV_LOW && ++calmCnt >= GOV_CALM) {
+    // underloaded
+    calmCnt = 0;
+    if (govFPS < FPS) changeFrameTimer(++govFPS);
+    else if (govQuality > quality) setGovQuality(std::max(govQuality - GOV_STEP, quality));
+    else return;
+    LOG_VRB("Governor increased load to %u FPS, quality %d", govFPS, govQuality);
+  }
+}
+
+/**************** latency histograms ************************/
+
+// Each stage of the capture pipeline records its latency in a histogram of log2 buckets,
+// bucket n counting latencies from 2^(n-1) to 2^n - 1 us, so percentiles can be reported
+// without storing samples. Each stage is only updated by one task.
+
+#define LAT_BUCKETS 24 // last bucket holds latencies over 4 secs
+enum latencyStage {LAT_FB_GET, LAT_TIMELAPSE, LAT_STREAM, LAT_MOTION, LAT_BUFFER, LAT_SD_WRITE, LAT_INDEX, LAT_STAGES};
+static const char* latencyNames[LAT_STAGES] = {"fbGet", "timeLapse", "stream", "motion", "buffer", "sdWrite", "index"};
+static uint32_t latencyHist[LAT_STAGES][LAT_BUCKETS];
+static uint32_t coalescedFrames = 0; // frame timer ticks processed together by capture task
+
+static inline void addLatency(uint8_t stage, uint32_t startUs) {
+  // add elapsed time since startUs to histogram for stage
+  uint32_t elapsedUs = micros() - startUs;
+  int bucket = elapsedUs ? 32 - __builtin_clz(elapsedUs) : 0;
+  latencyHist[stage][std::min(bucket, LAT_BUCKETS - 1)]++;
+}
+
+static uint32_t latencyPercentile(const uint32_t* hist, uint32_t total, uint8_t percent) {
+  // upper bound in us of bucket containing required percentile
+  uint32_t required = ((uint64_t)total * percent + 99) / 100;
+  uint32_t count = 0;
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    count += hist[i];
+    if (count >= required) return i ? (1UL << i) - 1 : 0;
+  }
+  return 0;
+}
+
+void resetLatency() {
+  // clear all latency histograms
+  memset(latencyHist, 0, sizeof(latencyHist));
+  coalescedFrames = 0;
+}
+
+void buildLatencyJson(char* buff, size_t buffLen) {
+  // json of percentiles in us and bucket counts for each stage
+  char* p = buff;
+  char* endBuff = buff + buffLen;
+  p += snprintf(p, endBuff - p, "{\"coalesced\":%lu", coalescedFrames);
+  for (int i = 0; i < LAT_STAGES && p < endBuff; i++) {
+    uint32_t total = 0;
+    int highest = 0;
+    for (int j = 0; j < LAT_BUCKETS; j++) {
+      total += latencyHist[i][j];
+      if (latencyHist[i][j]) highest = j;
+    }
+    p += snprintf(p, endBuff - p, ",\"%s\":{\"count\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"buckets\":[",
+      latencyNames[i], total, latencyPercentile(latencyHist[i], total, 50),
+      latencyPercentile(latencyHist[i], total, 90), latencyPercentile(latencyHist[i], total, 99));
+    for (int j = 0; j <= highest && p < endBuff; j++) p += snprintf(p, endBuff - p, "%s%lu", j ? "," : "", latencyHist[i][j]);
+    if (p < endBuff) p += snprintf(p, endBuff - p, "]}");
+  }
+  if (p < endBuff) snprintf(p, endBuff - p, "}");
+}
+
+/**************** shared frames ************************/
+
+// Camera frame buffers are passed to each consumer by reference instead of being copied.
+// Each consumer holds a reference count on the frame, and the frame buffer is
+// returned to the camera when the last consumer releases it.
+// Streams only get a new frame if at least 2 frame buffers remain free for the camera,
+// so a slow stream drops frames rather than stalling capture.
+
+static frameRef* holdFrame(camera_fb_t* fb) {
+  // obtain reference for new camera frame, owned by capture task
+  frameRef* ref = NULL;
+  portENTER_CRITICAL(&frameMux);
+  for (int i = 0; i < FB_CNT; i++) {
+    if (!frameRefs[i].refCnt) {
+      ref = &frameRefs[i];
+      ref->fb = fb;
+      ref->refCnt = 1;
+      heldFrames++;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&frameMux);
+  return ref;
+}
+
+void releaseFrame(frameRef* ref) {
+  // drop reference to frame, return frame buffer to camera if last user
+  if (ref == NULL) return;
+  camera_fb_t* fb = NULL;
+  portENTER_CRITICAL(&frameMux);
+  if (ref->refCnt && !--ref->refCnt) {
+    fb = ref->fb;
+    ref->fb = NULL;
+    heldFrames--;
+  }
+  portEXIT_CRITICAL(&frameMux);
+  if (fb != NULL) esp_camera_fb_return(fb);
+}
+
+static inline bool addFrameUser(frameRef* ref, uint8_t maxHeld) {
+  // add user to frame unless it would leave too few frame buffers for camera
+  // must be called within frameMux
+  if (ref->refCnt > 1 || heldFrames < maxHeld) {
+    ref->refCnt++;
+    return true;
+  }
+  return false;
+}
+
+static void shareFrame(frameRef* ref) {
+  // hand frame to each waiting stream
+  bool sendFrame[MAX_STREAMS] = {false};
+  portENTER_CRITICAL(&frameMux);
+  for (int i = 0; i < vidStreams; i++) {
+    if (streamWait[i] && streamFrame[i] == NULL && addFrameUser(ref, FB_CNT - 1)) {
+      streamFrame[i] = ref;
+      streamWait[i] = false;
+      sendFrame[i] = true;
+    }
+  }
+  portEXIT_CRITICAL(&frameMux);
+  for (int i = 0; i < vidStreams; i++) if (sendFrame[i]) xSemaphoreGive(frameSemaphore[i]); // signal frame ready for stream
+}
+
+frameRef* waitStreamFrame(uint8_t streamId, uint32_t waitMs) {
+  // wait for next frame from processFrame(), caller must releaseFrame() after use
+  frameRef* ref = NULL;
+  if (frameSemaphore[streamId] == NULL) return ref;
+  streamWait[streamId] = true;
+  if (xSemaphoreTake(frameSemaphore[streamId], pdMS_TO_TICKS(waitMs)) == pdTRUE) {
+    portENTER_CRITICAL(&frameMux);
+    ref = streamFrame[streamId];
+    streamFrame[streamId] = NULL;
+    portEXIT_CRITICAL(&frameMux);
+  }
+  return ref;
+}
+
+void endStreamFrames(uint8_t streamId) {
+  // stream no longer wants frames, release any frame not yet collected
+  portENTER_CRITICAL(&frameMux);
+  streamWait[streamId] = false;
+  frameRef* ref = streamFrame[streamId];
+  streamFrame[streamId] = NULL;
+  portEXIT_CRITICAL(&frameMux);
+  releaseFrame(ref);
+  if (frameSemaphore[streamId] != NULL) xSemaphoreTake(frameSemaphore[streamId], 0); // clear stale signal
+}
+
+/**************** event markers ************************/
+
+// Events during a recording, ie what started it and when motion starts and stops, are
+// attached to the frame being queued. The SD write task records the position of each
+// event frame, and saves them as a sidecar file alongside the AVI so that playback
+// can start at an event without scanning the AVI.
+
+#define MAX_EVENTS 64 // per recording
+enum eventType {EVT_BUTTON, EVT_CAMERA, EVT_PIR, EVT_ACCEL, EVT_MOTION_ON, EVT_MOTION_OFF, EVT_NONE};
+static const char* eventNames[EVT_NONE] = {"Button", "Camera", "PIR", "Accelerometer", "Motion on", "Motion off"};
+struct aviEvent {
+  uint32_t frameNum; // frame number in avi, including empty frames
+  uint32_t offset; // file offset of frame chunk
+  uint32_t msecs; // time since first frame
+  uint8_t type;
+  uint8_t reserved[3];
+};
+static aviEvent aviEvents[MAX_EVENTS];
+static uint8_t eventCnt = 0;
+static uint32_t lastFrameNum = 0; // position of frame most recently saved
+static uint32_t lastFrameOffset = 0;
+int playEvent = -1; // event to start next playback from
+
+static void addEvent(uint8_t type, uint32_t frameMs) {
+  // record event at position of frame just saved
+  if (eventCnt < MAX_EVENTS) aviEvents[eventCnt++] = {lastFrameNum, lastFrameOffset, frameMs - firstFrameMs, type, {0}};
+  LOG_VRB("Event %s at frame %lu", eventNames[type], lastFrameNum);
+}
+
+static void saveEvents(const char* aviName) {
+  // save events for recording in sidecar file
+  if (!eventCnt) return;
+  char evtName[FILE_NAME_LEN];
+  strcpy(evtName, aviName);
+  changeExtension(evtName, EVT_EXT);
+  File evtFile = STORAGE.open(evtName, FILE_WRITE);
+  if (evtFile) {
+    evtFile.write((uint8_t*)aviEvents, eventCnt * sizeof(aviEvent));
+    evtFile.close();
+  } else LOG_WRN("Failed to save events to %s", evtName);
+}
+
+static File openEvents(const char* aviName) {
+  // open sidecar events file for given avi
+  char evtName[FILE_NAME_LEN];
+  strcpy(evtName, aviName);
+  changeExtension(evtName, EVT_EXT);
+  return STORAGE.open(evtName, FILE_READ);
+}
+
+static bool getEvent(const char* aviName, int eventNum, aviEvent* event) {
+  // retrieve given event for avi
+  File evtFile = openEvents(aviName);
+  if (!evtFile) return false;
+  bool res = evtFile.seek(eventNum * sizeof(aviEvent), SeekSet) 
+    && evtFile.read((uint8_t*)event, sizeof(aviEvent)) == sizeof(aviEvent);
+  evtFile.close();
+  return res;
+}
+
+void buildEventJson(const char* aviName, char* buff, size_t buffLen) {
+  // json array of events recorded in given avi
+  char* p = buff;
+  char* endBuff = buff + buffLen - 2; // space for closing bracket
+  p += sprintf(p, "[");
+  File evtFile = openEvents(aviName);
+  if (evtFile) {
+    aviEvent event;
+    for (int i = 0; p < endBuff && evtFile.read((uint8_t*)&event, sizeof(aviEvent)) == sizeof(aviEvent); i++) {
+      p += snprintf(p, endBuff - p, "%s{\"type\":\"%s\",\"frame\":%lu,\"offset\":%lu,\"secs\":%0.1f}", i ? "," : "",
+        event.type < EVT_NONE ? eventNames[event.type] : "Unknown", event.frameNum, event.offset, (float)event.msecs / 1000);
+    }
+    evtFile.close();
+  }
+  strcpy(std::min(p, endBuff), "]");
+}
+
+/**************** thumbnails ************************/
+
+// A small jpeg of each recording is appended to a pack file in its day folder when the
+// recording closes, so a browser can fetch the thumbnails for a whole folder in one request.
+// Each pack entry is a thumbHdr followed by the jpeg, a later entry for same name supersedes.
+
+struct thumbHdr {
+  char aviName[FILE_NAME_LEN]; // recording file name without folder, zero padded
+  uint32_t jpegLen; // length of jpeg that follows
+};
+
+static uint8_t* aviThumb(const char* aviName, size_t* jpegLen) {
+  // extract first frame of recording via avi index, if small enough for thumbnail
+  static uint8_t* thumbBuff = NULL;
+  *jpegLen = 0;
+  if (thumbBuff == NULL) thumbBuff = (uint8_t*)ps_malloc(THUMB_MAX);
+  File aviFile = STORAGE.open(aviName, FILE_READ);
+  if (!aviFile || thumbBuff == NULL) return NULL;
+  aviSource src = {readAviFile, &aviFile, aviFile.size()};
+  size_t framePos = findAviFrame(&src, 0);
+  uint32_t frameLen = 0;
+  if (framePos && readAviFile(&aviFile, framePos + 4, (uint8_t*)&frameLen, 4) == 4 && frameLen <= THUMB_MAX 
+    && readAviFile(&aviFile, framePos + CHUNK_HDR, thumbBuff, frameLen) == frameLen) *jpegLen = frameLen;
+  aviFile.close();
+  return thumbBuff;
+}
+
+static void saveThumb(const char* aviName) {
+  // append thumbnail for closed recording to pack in its folder
+  // from decoded motion bitmap, else from first frame of small resolution recording
+  uint32_t tTime = millis();
+  size_t jpegLen = 0;
+  uint8_t* jpeg = motionThumb(&jpegLen);
+  if (!jpegLen) jpeg = aviThumb(aviName, &jpegLen);
+  if (!jpegLen) return;
+  const char* baseName = strrchr(aviName, '/');
+  if (baseName == NULL) return;
+  thumbHdr hdr = {};
+  strncpy(hdr.aviName, baseName + 1, FILE_NAME_LEN - 1);
+  hdr.jpegLen = jpegLen;
+  char packName[FILE_NAME_LEN + sizeof(THUMBPACK)];
+  snprintf(packName, sizeof(packName), "%.*s%s", (int)(baseName - aviName), aviName, THUMBPACK);
+  File packFile = STORAGE.open(packName, FILE_APPEND);
+  if (packFile) {
+    packFile.write((uint8_t*)&hdr, sizeof(hdr));
+    packFile.write(jpeg, jpegLen);
+    packFile.close();
+    LOG_VRB("Saved %zu byte thumbnail in %lu ms", jpegLen, millis() - tTime);
+  } else LOG_WRN("Failed to save thumbnail to %s", packName);
+}
+
+esp_err_t sendThumbs(httpd_req_t* req, const char* folderName) {
+  // send thumbnail pack for given day folder, empty if none
+  char packName[FILE_NAME_LEN + sizeof(THUMBPACK)];
+  snprintf(packName, sizeof(packName), "%s%s", folderName, THUMBPACK);
+  httpd_resp_set_type(req, "application/octet-stream");
+  File packFile = STORAGE.open(packName, FILE_READ);
+  if (!packFile) return httpd_resp_send(req, NULL, 0);
+  return sendChunks(packFile, req); // closes pack file
+}
+
+/**************** sprite sheets ************************/
+
+// A sprite sheet of evenly spaced frames lets the browser scrub a recording from one small download.
+// Each frame is located via the avi index, decoded at reduced scale and sampled into a tile,
+// then the sheet is encoded as one jpeg. It is cached in a sidecar as a spriteHdr then the jpeg.
+// Decoding takes seconds, so the sheet is built by the low priority pool task rather than
+// the web server task, which meanwhile answers the browser with 202 until the sheet exists.
+
+#define SPRITE_QUAL 60 // jpeg quality % for sprite sheet
+
+struct spriteHdr {
+  uint32_t frameCnt; // frames in recording, tile n shows first non empty frame from n * frameCnt / tiles
+  uint16_t tileWidth;
+  uint16_t tileHeight;
+  uint8_t cols; // tiles per row
+  uint8_t tiles;
+  uint8_t filler[2];
+  uint32_t jpegLen; // length of jpeg that follows
+};
+
+static bool buildSprites(const char* aviName, const char* sprName) {
+  // decode evenly spaced frames of recording into tiles of sprite sheet
+  uint32_t sTime = millis();
+  File aviFile = STORAGE.open(aviName, FILE_READ);
+  if (!aviFile) return false;
+  aviSource src = {readAviFile, &aviFile, aviFile.size()};
+  spriteHdr hdr = {};
+  uint16_t width = 0, height = 0;
+  if (!aviFrameInfo(&src, &hdr.frameCnt, &width, &height) || !hdr.frameCnt || !width || !height) {
+    aviFile.close();
+    return false;
+  }
+  hdr.tiles = std::min(hdr.frameCnt, (uint32_t)SPRITE_TILES);
+  hdr.cols = std::min(hdr.tiles, (uint8_t)SPRITE_COLS);
+  hdr.tileWidth = width >= height ? SPRITE_DIM : std::max(SPRITE_DIM * width / height, 1);
+  hdr.tileHeight = width >= height ? std::max(SPRITE_DIM * height / width, 1) : SPRITE_DIM;
+  size_t sheetWidth = hdr.cols * hdr.tileWidth;
+  size_t sheetHeight = ((hdr.tiles + hdr.cols - 1) / hdr.cols) * hdr.tileHeight;
+  size_t sheetLen = sheetWidth * sheetHeight * RGB888_BYTES;
+  // decode at largest reduction that still fills a tile
+  uint8_t scale = JPG_SCALE_NONE;
+  while (scale < JPG_SCALE_8X && (width >> (scale + 1)) >= hdr.tileWidth && (height >> (scale + 1)) >= hdr.tileHeight) scale++;
+  uint16_t decWidth = width >> scale;
+  uint16_t decHeight = height >> scale;
+  uint8_t* sheet = (uint8_t*)ps_malloc(sheetLen);
+  uint8_t* rgbBuf = (uint8_t*)ps_malloc(decWidth * decHeight * RGB888_BYTES);
+  uint8_t* jpegBuf = NULL;
+  uint32_t jpegBufLen = 0;
+  uint8_t tileCnt = 0;
+  if (sheet != NULL) memset(sheet, 0, sheetLen); // any tile not decoded is left black
+  for (uint8_t tile = 0; sheet != NULL && rgbBuf != NULL && tile < hdr.tiles; tile++) {
+    // skip empty frames, which repeat the previous jpeg
+    uint32_t nextTile = (uint32_t)(tile + 1) * hdr.frameCnt / hdr.tiles;
+    uint32_t jpegLen = 0;
+    size_t framePos = 0;
+    for (uint32_t frameNum = tile * hdr.frameCnt / hdr.tiles; !jpegLen && frameNum < nextTile; frameNum++) {
+      framePos = findAviFrame(&src, frameNum);
+      if (!framePos || readAviFile(&aviFile, framePos + 4, (uint8_t*)&jpegLen, 4) != 4) {
+        jpegLen = 0;
+        break;
+      }
+    }
+    if (!jpegLen) continue;
+    if (jpegLen > jpegBufLen) {
+      free(jpegBuf);
+      jpegBuf = (uint8_t*)ps_malloc(jpegLen);
+      jpegBufLen = jpegBuf == NULL ? 0 : jpegLen;
+    }
+    if (!jpegBufLen || readAviFile(&aviFile, framePos + CHUNK_HDR, jpegBuf, jpegLen) != jpegLen
+      || !jpg2rgb888(jpegBuf, jpegLen, rgbBuf, (jpg_scale_t)scale)) continue;
+    // nearest neighbour sample of decoded frame into its tile
+    uint8_t* tilePtr = sheet + ((tile / hdr.cols) * hdr.tileHeight * sheetWidth + (tile % hdr.cols) * hdr.tileWidth) * RGB888_BYTES;
+    for (uint16_t y = 0; y < hdr.tileHeight; y++) {
+      const uint8_t* rowPtr = rgbBuf + (y * decHeight / hdr.tileHeight) * decWidth * RGB888_BYTES;
+      uint8_t* outPtr = tilePtr + y * sheetWidth * RGB888_BYTES;
+      for (uint16_t x = 0; x < hdr.tileWidth; x++) 
+        memcpy(outPtr + x * RGB888_BYTES, rowPtr + (x * decWidth / hdr.tileWidth) * RGB888_BYTES, RGB888_BYTES);
+    }
+    tileCnt++;
+  }
+  aviFile.close();
+  bool res = false;
+  if (tileCnt) {
+    uint8_t* jpg_buf = NULL;
+    size_t jpgLen = 0;
+    if (fmt2jpg(sheet, sheetLen, sheetWidth, sheetHeight, PIXFORMAT_RGB888, SPRITE_QUAL, &jpg_buf, &jpgLen)) {
+      hdr.jpegLen = jpgLen;
+      File sprFile = STORAGE.open(sprName, FILE_WRITE);
+      if (sprFile) {
+        res = sprFile.write((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) && sprFile.write(jpg_buf, jpgLen) == jpgLen;
+        sprFile.close();
+        if (!res) STORAGE.remove(sprName);
+      }
+    }
+    free(jpg_buf);
+  }
+  free(sheet);
+  free(rgbBuf);
+  free(jpegBuf);
+  if (res) LOG_INF("Built %u tile sprite sheet of %s in %lu ms", tileCnt, fmtSize(hdr.jpegLen), millis() - sTime);
+  else LOG_WRN("Failed to build sprite sheet for %s", aviName);
+  return res;
+}
+
+static char spriteAvi[FILE_NAME_LEN] = ""; // recording whose sprite sheet is to be built
+static char spriteFailed[FILE_NAME_LEN] = ""; // last recording whose sprite sheet could not be built
+static portMUX_TYPE spriteMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void buildQueuedSprites() {
+  // on pool task, build sprite sheet requested by browser, unless capture started since
+  char aviName[FILE_NAME_LEN];
+  char sprName[FILE_NAME_LEN];
+  portENTER_CRITICAL(&spriteMux);
+  strcpy(aviName, spriteAvi);
+  portEXIT_CRITICAL(&spriteMux);
+  if (!*aviName) return;
+  strcpy(sprName, aviName);
+  changeExtension(sprName, SPR_EXT);
+  bool built = isCapturing || STORAGE.exists(sprName) || buildSprites(aviName, sprName);
+  portENTER_CRITICAL(&spriteMux);
+  if (!built) strcpy(spriteFailed, aviName);
+  spriteAvi[0] = 0;
+  portEXIT_CRITICAL(&spriteMux);
+}
+
+esp_err_t sendSprites(httpd_req_t* req, const char* aviName) {
+  // send sprite sheet for given recording, else request it to be built
+  char sprName[FILE_NAME_LEN];
+  strncpy(sprName, aviName, FILE_NAME_LEN - 1);
+  sprName[FILE_NAME_LEN - 1] = 0;
+  changeExtension(sprName, SPR_EXT);
+  httpd_resp_set_type(req, "application/octet-stream");
+  if (!STORAGE.exists(sprName)) {
+    // decoding competes with recording for SD and cpu
+    if (isCapturing) {
+      LOG_WRN("Sprite sheet refused - capture in progress");
+      httpd_resp_set_status(req, "503 Capture in progress");
+      return httpd_resp_send(req, NULL, 0);
+    }
+    portENTER_CRITICAL(&spriteMux);
+    bool failed = !strcmp(aviName, spriteFailed);
+    portEXIT_CRITICAL(&spriteMux);
+    if (failed || aviPoolHandle == NULL || !STORAGE.exists(aviName)) {
+      httpd_resp_set_status(req, "404 No sprite sheet");
+      return httpd_resp_send(req, NULL, 0);
+    }
+    // one sheet built at a time, browser retries until available
+    portENTER_CRITICAL(&spriteMux);
+    bool building = !*spriteAvi || !strcmp(spriteAvi, aviName);
+    if (!*spriteAvi) strncpy(spriteAvi, aviName, FILE_NAME_LEN - 1);
+    portEXIT_CRITICAL(&spriteMux);
+    if (building) xTaskNotifyGive(aviPoolHandle);
+    httpd_resp_set_status(req, building ? "202 Building sprite sheet" : "503 Sprite sheet builder busy");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  File sprFile = STORAGE.open(sprName, FILE_READ);
+  if (!sprFile) return httpd_resp_send(req, NULL, 0);
+  return sendChunks(sprFile, req); // closes sprite file
+}
+
+/**************** SD write queue ************************/
+
+// The capture task queues frames and file actions to a separate SD write task,
+// so that a slow SD card write doesnt delay camera capture.
+// Frames are referenced not copied while the camera has frame buffers to spare.
+// When the SD card stalls, further frames are copied to psram so that their camera
+// buffers can be returned, up to SD_SPILL_MAX bytes. Only if the queue or this psram
+// is full is the frame dropped and counted.
+
+static uint8_t* spillFrame(camera_fb_t* fb) {
+  // copy frame to psram so that its camera buffer is not held by the queue
+  // padded to whole words, as saveFrame() writes the avi filler from the frame buffer
+  if (__atomic_load_n(&spillBytes, __ATOMIC_RELAXED) + fb->len > SD_SPILL_MAX) return NULL;
+  size_t spillLen = (fb->len + 3) & ~3;
+  uint8_t* spill = (uint8_t*)ps_malloc(spillLen);
+  if (spill != NULL) {
+    memcpy(spill, fb->buf, fb->len);
+    memset(spill + fb->len, 0, spillLen - fb->len);
+    __atomic_add_fetch(&spillBytes, fb->len, __ATOMIC_RELAXED);
+    sdQueueSpills++;
+  }
+  return spill;
+}
+
+static bool queueSD(uint8_t action, frameRef* ref = NULL, uint8_t event = EVT_NONE) {
+  // pass action to SD write task
+  if (sdWriteHandle == NULL) return false;
+  uint32_t head = sdHead;
+  uint32_t depth = head - __atomic_load_n(&sdTail, __ATOMIC_ACQUIRE);
+  uint8_t* spill = NULL;
+  size_t len = 0;
+  uint32_t msecs = 0;
+  if (ref != NULL) {
+    if (depth >= SD_QUEUE_LEN) {
+      sdQueueDrops++;
+      return false;
+    }
+    len = ref->fb->len;
+    msecs = frameTime(ref->fb);
+    // leave a camera buffer free, as streams do
+    portENTER_CRITICAL(&frameMux);
+    bool haveFrame = addFrameUser(ref, FB_CNT - 1);
+    portEXIT_CRITICAL(&frameMux);
+    if (!haveFrame && action == SD_FRAME && (spill = spillFrame(ref->fb)) != NULL) ref = NULL;
+    else if (!haveFrame) {
+      // recording has priority over streams for the last frame buffer
+      portENTER_CRITICAL(&frameMux);
+      haveFrame = addFrameUser(ref, FB_CNT);
+      portEXIT_CRITICAL(&frameMux);
+      if (!haveFrame) {
+        sdQueueDrops++;
+        return false;
+      }
+    }
+  } else {
+    // file actions must not be lost
+    while (depth >= SD_QUEUE_LEN) {
+      delay(10);
+      depth = head - __atomic_load_n(&sdTail, __ATOMIC_ACQUIRE);
+    }
+  }
+  sdQueue[head & (SD_QUEUE_LEN - 1)] = {action, event, ref, spill, len, msecs};
+  __atomic_store_n(&sdHead, head + 1, __ATOMIC_RELEASE);
+  if (++depth > sdQueueHigh) sdQueueHigh = depth;
+  xTaskNotifyGive(sdWriteHandle);
+  return true;
+}
+
+uint8_t sdQueueDepth() {
+  // number of actions waiting for SD write task
+  return sdHead - sdTail;
+}
+
+/**************** pre-roll ************************/
+
+// Whilst waiting for motion, each frame is copied once into a psram ring,
+// discarding the oldest frames when older than preRollSecs or space needed.
+// When recording starts the ring content is saved ahead of the live frames.
+
+static inline void dropPreRoll() {
+  // discard oldest frame in pre-roll ring
+  preRollOldest = (preRollOldest + 1) % PREROLL_FRAMES;
+  preRollCnt--;
+}
+
+static void addPreRoll(camera_fb_t* fb) {
+  // copy frame into pre-roll ring
+  if (preRollBuf == NULL) {
+    preRollSize = std::min((size_t)PREROLL_MAX, (size_t)ESP.getFreePsram() / 4);
+    preRollBuf = (uint8_t*)ps_malloc(preRollSize + 4); // allow for avi filler
+    if (preRollBuf == NULL) {
+      LOG_WRN("Insufficient PSRAM for pre-roll, disabled");
+      preRollSecs = 0;
+      return;
+    }
+    LOG_INF("Pre-roll buffer size %s", fmtSize(preRollSize));
+  }
+  if (fb->len > preRollSize / 2) return; // frame too large for ring
+  uint32_t nowMs = frameTime(fb);
+  while (preRollCnt && nowMs - preRollIdx[preRollOldest].msecs > preRollSecs * 1000) dropPreRoll();
+  // find space for frame after newest frame, or at start of buffer
+  uint32_t pos = 0;
+  while (preRollCnt) {
+    preRollEntry* newest = &preRollIdx[(preRollOldest + preRollCnt - 1) % PREROLL_FRAMES];
+    uint32_t oldestPos = preRollIdx[preRollOldest].offset;
+    uint32_t endPos = (newest->offset + newest->len + 3) & ~3;
+    if (newest->offset >= oldestPos) {
+      // used space is contiguous
+      if (endPos + fb->len <= preRollSize) {
+        pos = endPos;
+        break;
+      }
+      if (fb->len <= oldestPos) break; // wrap to start
+    } else if (endPos + fb->len <= oldestPos) {
+      // used space wraps, so use gap between newest and oldest
+      pos = endPos;
+      break;
+    }
+    dropPreRoll(); // make space
+  }
+  if (preRollCnt == PREROLL_FRAMES) dropPreRoll();
+  memcpy(preRollBuf + pos, fb->buf, fb->len);
+  preRollIdx[(preRollOldest + preRollCnt) % PREROLL_FRAMES] = {pos, (uint32_t)fb->len, nowMs};
+  preRollCnt++;
+}
+
+/**************** AVI file pool ************************/
+
+// Time to open a new file and allocate its clusters as frames are written increases as the
+// SD card fills, and recordings become fragmented. Instead a low priority task maintains
+// a pool of files, each preallocated as a contiguous extent sized for a typical recording.
+// A recording is written into a pool file, which is then truncated to its used size and renamed.
+
+#define AVI_POOL_LEN 2 // number of preallocated files
+#define AVI_POOL_MAX (ONEMEG * 1024) // max size of preallocated file
+enum poolState {POOL_EMPTY, POOL_READY, POOL_USED};
+static volatile uint8_t aviPool[AVI_POOL_LEN] = {POOL_EMPTY};
+static int poolIdx = -1; // pool file used by current recording
+static char aviTempName[FILE_NAME_LEN] = AVITEMP;
+static size_t avgFrameLen = 0; // from previous recording
+static void prepDashRing();
+
+static void aviPoolTask(void* parameter) {
+  // woken to preallocate empty pool files and dashcam ring segments, and build sprite sheets
+  char poolName[FILE_NAME_LEN];
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    buildQueuedSprites();
+    if (dashCamOn && dashRing) prepDashRing();
+    for (int i = 0; i < AVI_POOL_LEN; i++) {
+      if (aviPool[i] != POOL_EMPTY) continue;
+      snprintf(poolName, sizeof(poolName), AVIPOOL, i);
+      if (STORAGE.exists(poolName)) {
+        // still preallocated from before restart
+        aviPool[i] = POOL_READY;
+        continue;
+      }
+      // size for frame limit at typical frame size, but use at most a quarter of free space
+      size_t frameLen = avgFrameLen ? avgFrameLen : maxFrameBuffSize / 4;
+      uint64_t freeBytes = STORAGE.totalBytes() - STORAGE.usedBytes();
+      uint64_t poolSize = std::min((uint64_t)frameLen * frameLimit, std::min((uint64_t)AVI_POOL_MAX, freeBytes / 4));
+      if (poolSize < ONEMEG) break; // insufficient space
+      uint32_t pTime = millis();
+      if (!preallocFile(poolName, (size_t)poolSize)) break;
+      aviPool[i] = POOL_READY;
+      LOG_VRB("Preallocated %s of %s in %lu ms", poolName, fmtSize(poolSize), millis() - pTime);
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+/**************** direct SD write ************************/
+
+// Optionally the recording is written with FatFs f_write() rather than through the VFS
+// and stdio layers, from a DMA capable internal RAM buffer sized to the card allocation unit.
+// As the file position stays aligned to the buffer size, each write is passed by FatFs
+// straight to the SDMMC driver as a single multi sector transfer, without bounce copies.
+
+#define SD_DIRECT_MAX (1024 * 64) // max size of direct write buffer
+bool sdDirect = false; // write recordings directly with FatFs
+static uint8_t* directBuff = NULL;
+static size_t directLen = 0;
+
+static bool prepDirect() {
+  // allocate direct write buffer when first needed, sized to card allocation unit
+  if (directBuff != NULL) return true;
+  size_t clusterLen = sdClusterSize();
+  if (!clusterLen) return false;
+  directLen = std::max(std::min(clusterLen, (size_t)SD_DIRECT_MAX), (size_t)RAMSIZE);
+  while (directLen >= RAMSIZE) {
+    // extra space for frame header overflowing buffer
+    directBuff = (uint8_t*)heap_caps_aligned_alloc(4, directLen + CHUNK_HDR, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    if (directBuff != NULL) break;
+    directLen /= 2;
+  }
+  if (directBuff == NULL) {
+    LOG_WRN("Insufficient internal memory for direct SD write, using VFS");
+    return false;
+  }
+  LOG_INF("Direct SD write buffer %zuKB for allocation unit %zuKB", directLen / 1024, clusterLen / 1024);
+  return true;
+}
+
+static bool openAviFile(aviRecorder* rec, const char* fileName, bool overwrite) {
+  // open recording file, directly with FatFs if required
+  if (rec->direct) {
+    char fatPath[FILE_NAME_LEN + 2];
+    snprintf(fatPath, sizeof(fatPath), "0:%s", fileName);
+    FRESULT res = f_open(&rec->fil, fatPath, FA_WRITE | (overwrite ? FA_OPEN_EXISTING : FA_CREATE_ALWAYS));
+    if (res != FR_OK) LOG_WRN("Failed to open %s with FatFs, error %u", fileName, res);
+    return res == FR_OK;
+  }
+  rec->file = STORAGE.open(fileName, overwrite ? "r+" : FILE_WRITE); // r+ overwrites without truncating
+  return (bool)rec->file;
+}
+
+static void aviWrite(aviRecorder* rec, const uint8_t* buf, size_t len) {
+  // write to recording file
+  if (rec->direct) {
+    UINT written = 0;
+    FRESULT res = f_write(&rec->fil, buf, len, &written);
+    if (res != FR_OK || written != len) LOG_WRN("Direct SD write failed, error %u, wrote %u of %zu", res, written, len);
+  } else rec->file.write(buf, len);
+}
+
+static size_t aviPosition(aviRecorder* rec) {
+  // current size of recording file
+  return rec->direct ? (size_t)f_tell(&rec->fil) : rec->file.position();
+}
+
+static void aviSeek(aviRecorder* rec, size_t filePos) {
+  // reposition in recording file
+  if (rec->direct) f_lseek(&rec->fil, filePos);
+  else rec->file.seek(filePos, SeekSet);
+}
+
+static void aviFlush(aviRecorder* rec) {
+  // commit written content to SD
+  if (rec->direct) f_sync(&rec->fil);
+  else rec->file.flush();
+}
+
+static void closeAviFile(aviRecorder* rec) {
+  // save avi header at start of file, and any OpenDML segment headers, then close
+  uint8_t segHdr[AVIX_HDR_LEN];
+  size_t segPos;
+  // timelapse is not segmented
+  for (uint8_t seg = 1; !rec->isTL && (segPos = buildAviSegHdr(segHdr, seg)) > 0; seg++) {
+    aviSeek(rec, segPos);
+    aviWrite(rec, segHdr, AVIX_HDR_LEN);
+  }
+  aviSeek(rec, 0);
+  aviWrite(rec, aviHeader, AVI_HEADER_LEN);
+  if (rec->direct) f_close(&rec->fil);
+  else rec->file.close();
+}
+
+/**************** dashcam ring ************************/
+
+// For continuous recording, a fixed ring of equally sized segment files is preallocated
+// when first used, then overwritten in turn, so rollover takes constant time and
+// recordings no longer fragment the card. A manifest holds the time range of each segment,
+// updated in place as each segment is closed. A segment containing an event is promoted
+// out of the ring as a dated recording, and a replacement segment file preallocated.
+
+#define DASH_MAGIC 0x48534144 // "DASH"
+struct dashHeader {
+  uint32_t magic;
+  uint32_t segSize; // preallocated size of each segment
+  uint8_t segCnt;
+  uint8_t nextSeg; // segment to be recorded next
+  uint8_t spare[2];
+};
+struct dashEntry {
+  uint32_t startTime; // epoch time of first frame, 0 if segment holds no recording
+  uint32_t endTime;
+  uint32_t aviLen; // length of recorded content, segment file may be longer
+  uint32_t frames;
+};
+uint8_t dashRing = 0; // number of dashcam ring segments, 0 for dated files
+static dashHeader dashHdr = {0};
+static dashEntry dashSegs[DASH_RING_MAX];
+static volatile bool dashReady[DASH_RING_MAX] = {false}; // segment file preallocated
+static int dashIdx = -1; // ring segment used by current recording
+
+static void writeDashManifest(int seg) {
+  // update manifest header and given segment entry, or all entries if seg < 0
+  File manFile = STORAGE.open(DASHMAN, seg < 0 ? FILE_WRITE : "r+");
+  if (!manFile) {
+    LOG_WRN("Failed to open %s", DASHMAN);
+    return;
+  }
+  manFile.write((uint8_t*)&dashHdr, sizeof(dashHdr));
+  if (seg < 0) manFile.write((uint8_t*)dashSegs, dashHdr.segCnt * sizeof(dashEntry));
+  else {
+    manFile.seek(sizeof(dashHdr) + seg * sizeof(dashEntry), SeekSet);
+    manFile.write((uint8_t*)&dashSegs[seg], sizeof(dashEntry));
+  }
+  manFile.close();
+}
+
+static void prepDashRing() {
+  // load or create ring manifest, then preallocate any missing segment files
+  char segName[FILE_NAME_LEN];
+  uint8_t segCnt = std::min(dashRing, (uint8_t)DASH_RING_MAX);
+  if (dashHdr.magic != DASH_MAGIC || dashHdr.segCnt != segCnt) {
+    for (int i = 0; i < DASH_RING_MAX; i++) dashReady[i] = false;
+    File manFile = STORAGE.open(DASHMAN, FILE_READ);
+    if (manFile) {
+      // existing manifest only used if for same ring size
+      bool haveMan = manFile.read((uint8_t*)&dashHdr, sizeof(dashHdr)) == sizeof(dashHdr)
+        && dashHdr.magic == DASH_MAGIC && dashHdr.segCnt == segCnt && dashHdr.nextSeg < segCnt
+        && manFile.read((uint8_t*)dashSegs, segCnt * sizeof(dashEntry)) == segCnt * sizeof(dashEntry);
+      manFile.close();
+      if (!haveMan) dashHdr.magic = 0;
+    }
+    if (dashHdr.magic != DASH_MAGIC) {
+      if (!STORAGE.exists(DASH_DIR)) STORAGE.mkdir(DASH_DIR);
+      // size segments for dashcam interval at typical frame size, within share of free space
+      size_t frameLen = avgFrameLen ? avgFrameLen : maxFrameBuffSize / 4;
+      for (int i = 0; i < DASH_RING_MAX; i++) {
+        // discard segments of previous ring
+        snprintf(segName, sizeof(segName), DASHSEG, i);
+        if (STORAGE.exists(segName)) STORAGE.remove(segName);
+      }
+      uint64_t freeBytes = STORAGE.totalBytes() - STORAGE.usedBytes();
+      uint64_t segSize = std::min((uint64_t)frameLen * frameLimit, std::min((uint64_t)AVI_POOL_MAX, freeBytes / (segCnt + 1)));
+      if (segSize < ONEMEG) {
+        LOG_WRN("Insufficient space for dashcam ring, using dated files");
+        return;
+      }
+      dashHdr = {DASH_MAGIC, (uint32_t)segSize, segCnt, 0, {0}};
+      memset(dashSegs, 0, sizeof(dashSegs));
+      writeDashManifest(-1);
+      LOG_INF("Created dashcam ring of %u segments each %s", segCnt, fmtSize(segSize));
+    }
+  }
+  for (int i = 0; i < dashHdr.segCnt; i++) {
+    if (dashReady[i]) continue;
+    snprintf(segName, sizeof(segName), DASHSEG, i);
+    if (!STORAGE.exists(segName)) {
+      uint32_t pTime = millis();
+      if (!preallocFile(segName, dashHdr.segSize)) break;
+      LOG_VRB("Preallocated %s in %lu ms", segName, millis() - pTime);
+    }
+    dashReady[i] = true;
+  }
+}
+
+static bool claimDashSeg() {
+  // open next ring segment for continuous recording, if ring prepared
+  dashIdx = -1;
+  if (!dashCamOn || !dashRing || dashHdr.magic != DASH_MAGIC || dashHdr.segCnt != std::min(dashRing, (uint8_t)DASH_RING_MAX)) return false;
+  uint8_t seg = dashHdr.nextSeg;
+  if (!dashReady[seg]) return false;
+  snprintf(aviTempName, sizeof(aviTempName), DASHSEG, seg);
+  if (!openAviFile(&aviRec, aviTempName, true)) {
+    LOG_WRN("Failed to open %s", aviTempName);
+    return false;
+  }
+  // previous recording in segment now being overwritten
+  dashSegs[seg] = {0, 0, 0, 0};
+  writeDashManifest(seg);
+  dashIdx = seg;
+  return true;
+}
+
+static void closeDashSeg(size_t aviLen, uint32_t durationSecs) {
+  // record segment time range in manifest and advance ring, or replace segment if promoted
+  uint8_t seg = dashIdx;
+  dashIdx = -1;
+  dashHdr.nextSeg = (seg + 1) % dashHdr.segCnt;
+  if (eventCnt) {
+    // renamed as dated recording, so preallocate replacement segment
+    dashReady[seg] = false;
+    if (aviPoolHandle != NULL) xTaskNotifyGive(aviPoolHandle);
+    LOG_INF("Dashcam segment %u promoted to %s", seg, aviFileName);
+  } else {
+    uint32_t endTime = time(NULL);
+    dashSegs[seg] = {endTime - durationSecs, endTime, (uint32_t)aviLen, aviFrames};
+  }
+  writeDashManifest(seg);
+}
+
+static bool claimAviFile() {
+  // claim preallocated file from pool, else open new file
+  aviRec.direct = sdDirect && prepDirect();
+  aviRec.buff = aviRec.direct ? directBuff : iSDbuffer;
+  aviRec.buffLen = aviRec.direct ? directLen : RAMSIZE;
+  poolIdx = -1;
+  if (claimDashSeg()) return true;
+  for (int i = 0; i < AVI_POOL_LEN; i++) {
+    if (aviPool[i] == POOL_READY) {
+      snprintf(aviTempName, sizeof(aviTempName), AVIPOOL, i);
+      if (openAviFile(&aviRec, aviTempName, true)) {
+        aviPool[i] = POOL_USED;
+        poolIdx = i;
+        return true;
+      }
+      aviPool[i] = POOL_EMPTY;
+    }
+  }
+  poolIdx = -1;
+  strcpy(aviTempName, AVITEMP);
+  return openAviFile(&aviRec, AVITEMP, false);
+}
+
+static void bufferFrameHdr(aviRecorder* rec, size_t jpegSize) {
+  // add avi frame header to staging buffer
+  memcpy(rec->buff + rec->highPoint, dcBuf, 4);
+  memcpy(rec->buff + rec->highPoint + 4, &jpegSize, 4);
+  rec->highPoint += CHUNK_HDR;
+  rec->aviPos += CHUNK_HDR;
+  if (rec->highPoint >= rec->buffLen) {
+    // marker overflows buffer
+    rec->highPoint -= rec->buffLen;
+    aviWrite(rec, rec->buff, rec->buffLen);
+    rec->writtenPos = rec->aviPos - rec->highPoint;
+    // push overflow to buffer start
+    memcpy(rec->buff, rec->buff + rec->buffLen, rec->highPoint);
+  }
+}
+
+static void bufferAvi(aviRecorder* rec, const uint8_t* data, size_t dataLen) {
+  // add avi structure to staging buffer, writing to SD each time buffer filled
+  rec->aviPos += dataLen;
+  while (dataLen >= rec->buffLen - rec->highPoint) {
+    size_t partLen = rec->buffLen - rec->highPoint;
+    memcpy(rec->buff + rec->highPoint, data, partLen);
+    aviWrite(rec, rec->buff, rec->buffLen);
+    data += partLen;
+    dataLen -= partLen;
+    rec->highPoint = 0;
+    rec->writtenPos = rec->aviPos - dataLen;
+  }
+  memcpy(rec->buff + rec->highPoint, data, dataLen);
+  rec->highPoint += dataLen;
+}
+
+static void writeAviEnd(aviRecorder* rec) {
+  // write remaining buffered content and the avi index to SD
+  aviWrite(rec, rec->buff, rec->highPoint);
+  rec->highPoint = 0;
+  finalizeAviIndex(rec->isTL, aviPosition(rec));
+  // staging buffer now free to hold index content
+  size_t idxLen;
+  while ((idxLen = writeAviIndex(rec->buff, rec->buffLen, rec->isTL)) > 0) aviWrite(rec, rec->buff, idxLen);
+}
+
+/**************** recording sessions ************************/
+
+// Each recording session takes frames from the capture task when its own trigger fires,
+// so continuous, event and time lapse recording can all run at once:
+// - continuous: dashcam style segments of dashCamOn mins, while recording enabled
+// - event: motion, PIR or accelerometer detection, or record button, up to maxFrames
+// - time lapse: a frame every tlSecsBetweenFrames, to its own avi, index and buffer
+// Continuous and event sessions share the capture avi, so an event during continuous
+// recording is marked in the current segment, which is then kept rather than overwritten.
+
+enum recTrigger {REC_CONTINUOUS, REC_EVENT, REC_TIMELAPSE, REC_SESSIONS};
+
+struct recSession {
+  const char* name;
+  bool (*trigger)(bool haveMotion); // whether session wants current frame
+  bool triggered; // trigger state for current frame
+};
+
+static bool continuousTrigger(bool haveMotion) {
+  return dashCamOn && doRecording;
+}
+
+static bool eventTrigger(bool haveMotion) {
+  return haveMotion || forceRecord;
+}
+
+static bool timeLapseTrigger(bool haveMotion) {
+  return timeLapseOn && timeSynchronized;
+}
+
+static recSession recSess[REC_SESSIONS] = {
+  {"continuous", continuousTrigger, false},
+  {"event", eventTrigger, false},
+  {"time lapse", timeLapseTrigger, false}
+};
+
+static void triggerSessions(bool haveMotion) {
+  // update trigger state of each session for current frame
+  for (auto& rs : recSess) {
+    bool triggered = rs.trigger(haveMotion);
+    if (triggered != rs.triggered) LOG_VRB("%s recording %s", rs.name, triggered ? "triggered" : "idle");
+    rs.triggered = triggered;
+  }
+}
+
+static void prepRecSessions() {
+  // frames per capture avi, as continuous segment length if configured
+  frameLimit = maxFrames;
+  if (dashCamOn) {
+    // frameLimit is not changed if FPS later changed without restart
+    if (FPS * dashCamOn * 60 > maxFrames) LOG_WRN("Max continuous recording time interval is %d mins", maxFrames / FPS / 60);
+    else {
+      frameLimit = FPS * dashCamOn * 60;
+      LOG_INF("Do continuous recording at %d min intervals", dashCamOn);
+    }
+  }
+  if (timeLapseOn) LOG_INF("Do time lapse recording every %u secs", tlSecsBetweenFrames);
+}
+
 /**************** capture AVI  ************************/
 
 static void openAvi() {
@@ -132,20 +1252,33 @@ static void openAvi() {
   STORAGE.mkdir(partName); // make date folder if not present
   dateFormat(partName, sizeof(partName), false);
   // open avi file with temporary name
-  aviFile = STORAGE.open(AVITEMP, FILE_WRITE);
+  if (!claimAviFile()) LOG_WRN("Failed to open %s", aviTempName);
   oTime = millis() - oTime;
   LOG_VRB("File opening time: %lums", oTime);
 #if INCLUDE_AUDIO
   startAudioRecord();
 #endif
+  audioStartMs = millis();
 #if INCLUDE_TELEM
   haveSrt = startTelemetry();
 #endif
-  // initialisation of counters
+  // initialisation of counters, here rather than by capture task so that the
+  // previous recording has been closed and its stats reported
   startTime = millis();
-  frameCnt = fTimeTot = wTimeTot = dTimeTot = vidSize = 0;
-  highPoint = AVI_HEADER_LEN; // allot space for AVI header
+  frameCnt = aviFrames = fTimeTot = wTimeTot = vidSize = eventCnt = audBytes = 0;
+  dTimeTot = sdQueueHigh = sdQueueDrops = sdQueueSpills = captureSkips = 0;
+  aviFPS = FPS; // frame rate requested, not as achieved
+  aviRec.highPoint = aviRec.aviPos = AVI_HEADER_LEN; // allot space for AVI header
   prepAviIndex();
+  recTag = esp_random();
+  uint32_t tagSize = sizeof(recTag);
+  memcpy(tagChunk, junkBuf, 4);
+  memcpy(tagChunk + 4, &tagSize, 4);
+  memcpy(tagChunk + CHUNK_HDR, &recTag, sizeof(recTag));
+  openAviCheckpoint(aviTempName, partName, aviFPS, fsizePtr, recTag);
+  ckptMs = millis();
+  aviRec.writtenPos = 0;
+  liveRec = true;
 }
 
 static inline bool doMonitor(bool capturing) {
@@ -158,89 +1291,108 @@ static inline bool doMonitor(bool capturing) {
   return !(bool)motionCnt;
 }
 
-static void timeLapse(camera_fb_t* fb, bool tlStop = false) {
+static char TLname[FILE_NAME_LEN];
+static uint32_t tlFrames;
+
+static void openTimeLapse() {
+  // initialise time lapse avi
+  char tlPart[FILE_NAME_LEN];
+  dateFormat(tlPart, sizeof(tlPart), true);
+  STORAGE.mkdir(tlPart); // make date folder if not present
+  dateFormat(tlPart, sizeof(tlPart), false);
+  int tlen = snprintf(TLname, FILE_NAME_LEN - 1, "%s_%s_%u_%u_T.%s",
+                      tlPart, frameData[fsizePtr].frameSizeStr, tlPlaybackFPS, tlDurationMins, AVI_EXT);
+  if (tlen > FILE_NAME_LEN - 1) LOG_WRN("file name truncated");
+  if (STORAGE.exists(TLTEMP)) STORAGE.remove(TLTEMP);
+  if (tlRec.buff == NULL) {
+    // own staging buffer, as iSDbuffer is used by motion recording
+    tlRec.buff = (uint8_t*)ps_malloc(RAMSIZE + CHUNK_HDR);
+    if (tlRec.buff == NULL) {
+      LOG_WRN("Insufficient PSRAM for time lapse buffer");
+      return;
+    }
+    tlRec.buffLen = RAMSIZE;
+  }
+  tlRec.isTL = true;
+  if (!openAviFile(&tlRec, TLTEMP, false)) LOG_WRN("Failed to open %s", TLTEMP);
+  tlRec.highPoint = tlRec.aviPos = AVI_HEADER_LEN; // allot space for AVI header
+  prepAviIndex(true);
+  tlFrames = 0;
+  LOG_INF("Started time lapse file %s", TLname);
+}
+
+static void saveTimeLapse(camera_fb_t* fb) {
+  // save this frame to time lapse avi, buffered as for motion recording
+  if (!tlRec.file) return;
+  // align end of jpeg on 4 byte boundary for AVI
+  uint16_t filler = (4 - (fb->len & 0x00000003)) & 0x00000003;
+  size_t jpegSize = fb->len + filler;
+  bufferFrameHdr(&tlRec, jpegSize);
+  bufferAvi(&tlRec, fb->buf, jpegSize);
+  buildAviIdx(jpegSize, true, true); // save avi index for frame
+  tlFrames++;
+}
+
+static void closeTimeLapse() {
+  // finish timelapse recording
+  if (!tlRec.file) return;
+  xSemaphoreTake(aviMutex, portMAX_DELAY);
+  buildAviHdr(tlPlaybackFPS, fsizePtr, tlFrames, true);
+  xSemaphoreGive(aviMutex);
+  writeAviEnd(&tlRec);
+  closeAviFile(&tlRec);
+  closeAviIndex(true);
+  STORAGE.rename(TLTEMP, TLname);
+  LOG_INF("Finished time lapse: %s", TLname);
+#if INCLUDE_FTP_HFS
+  if (autoUpload) fsStartTransfer(TLname); // Transfer it to remote ftp server if requested
+#endif
+}
+
+static void timeLapse(frameRef* ref, bool tlStop = false) {
   // record a time lapse avi
   // Note that if FPS changed during time lapse recording,
   //  the time lapse counters wont be modified
   static int frameCntTL, requiredFrames, intervalCnt = 0;
   static int intervalMark = tlSecsBetweenFrames * saveFPS;
-  static File tlFile;
-  static char TLname[FILE_NAME_LEN];
   if (tlStop) {
     // force save of file on controlled shutdown
+    if (!frameCntTL) return;
     intervalCnt = 0;
     requiredFrames = frameCntTL - 1;
   }
-  if (timeLapseOn) {
-    if (timeSynchronized) {
-      if (!frameCntTL) {
-        // initialise time lapse avi
-        requiredFrames = tlDurationMins * 60 / tlSecsBetweenFrames;
-        if (requiredFrames > maxFrames) {
-          LOG_WRN("Frames required for timelapse %u reduced to max frame limit %u", requiredFrames, maxFrames);
-          requiredFrames = maxFrames;
-        }
-        dateFormat(partName, sizeof(partName), true);
-        STORAGE.mkdir(partName); // make date folder if not present
-        dateFormat(partName, sizeof(partName), false);
-        int tlen = snprintf(TLname, FILE_NAME_LEN - 1, "%s_%s_%u_%u_T.%s",
-                            partName, frameData[fsizePtr].frameSizeStr, tlPlaybackFPS, tlDurationMins, AVI_EXT);
-        if (tlen > FILE_NAME_LEN - 1) LOG_WRN("file name truncated");
-        if (STORAGE.exists(TLTEMP)) STORAGE.remove(TLTEMP);
-        tlFile = STORAGE.open(TLTEMP, FILE_WRITE);
-        tlFile.write(aviHeader, AVI_HEADER_LEN); // space for header
-        prepAviIndex(true);
-        LOG_INF("Started time lapse file %s, duration %u mins, for %u frames",  TLname, tlDurationMins, requiredFrames);
-        frameCntTL++; // to stop re-entering
+  if (recSess[REC_TIMELAPSE].triggered) {
+    if (!frameCntTL) {
+      // initialise time lapse avi
+      requiredFrames = tlDurationMins * 60 / tlSecsBetweenFrames;
+      if (requiredFrames > maxFrames) {
+        LOG_WRN("Frames required for timelapse %u reduced to max frame limit %u", requiredFrames, maxFrames);
+        requiredFrames = maxFrames;
       }
-      // switch on light before capture frame if nightTime
+      queueSD(SD_TL_OPEN);
+      LOG_INF("Time lapse duration %u mins, for %u frames", tlDurationMins, requiredFrames);
+      frameCntTL++; // to stop re-entering
+    }
+    // switch on light before capture frame if nightTime
 #if INCLUDE_PERIPH
-      if (nightTime && intervalCnt == intervalMark - (saveFPS / 2)) setLamp(lampLevel);
+    if (nightTime && intervalCnt == intervalMark - (saveFPS / 2)) setLamp(lampLevel);
 #endif
-      if (intervalCnt > intervalMark) {
-        // save this frame to time lapse avi
+    if (intervalCnt > intervalMark && ref != NULL && queueSD(SD_TL_FRAME, ref)) {
+      // this frame saved to time lapse avi
 #if INCLUDE_PERIPH
-        if (!lampNight) setLamp(0);
-#endif
-        uint8_t hdrBuff[CHUNK_HDR];
-        memcpy(hdrBuff, dcBuf, 4);
-        // align end of jpeg on 4 byte boundary for AVI
-        uint16_t filler = (4 - (fb->len & 0x00000003)) & 0x00000003;
-        uint32_t jpegSize = fb->len + filler;
-        memcpy(hdrBuff + 4, &jpegSize, 4);
-        tlFile.write(hdrBuff, CHUNK_HDR); // jpeg frame details
-        tlFile.write(fb->buf, jpegSize);
-        buildAviIdx(jpegSize, true, true); // save avi index for frame
-        frameCntTL++;
-        intervalCnt = 0;
-        intervalMark = tlSecsBetweenFrames * saveFPS;  // recalc in case FPS changed
-      }
-      intervalCnt++;
-      if (frameCntTL > requiredFrames) {
-        // finish timelapse recording
-        xSemaphoreTake(aviMutex, portMAX_DELAY);
-        buildAviHdr(tlPlaybackFPS, fsizePtr, --frameCntTL, true);
-        xSemaphoreGive(aviMutex);
-        // add index
-        finalizeAviIndex(frameCntTL, true);
-        size_t idxLen = 0;
-        do {
-          idxLen = writeAviIndex(iSDbuffer, RAMSIZE, true);
-          tlFile.write(iSDbuffer, idxLen);
-        } while (idxLen > 0);
-        // add header
-        tlFile.seek(0, SeekSet); // start of file
-        tlFile.write(aviHeader, AVI_HEADER_LEN);
-        tlFile.close();
-        STORAGE.rename(TLTEMP, TLname);
-        frameCntTL = intervalCnt = 0;
-        LOG_INF("Finished time lapse: %s", TLname);
-#if INCLUDE_FTP_HFS
-        if (autoUpload) fsStartTransfer(TLname); // Transfer it to remote ftp server if requested
+      if (!lampNight) setLamp(0);
 #endif
-      }
+      frameCntTL++;
+      intervalCnt = 0;
+      intervalMark = tlSecsBetweenFrames * saveFPS;  // recalc in case FPS changed
     }
-  } else frameCntTL = intervalCnt = 0;
+    intervalCnt++;
+    if (frameCntTL > requiredFrames) {
+      // finish timelapse recording
+      queueSD(SD_TL_CLOSE);
+      frameCntTL = intervalCnt = 0;
+    }
+  } else if (!timeLapseOn) frameCntTL = intervalCnt = 0;
 }
 
 void keepFrame(camera_fb_t* fb) {
@@ -251,87 +1403,154 @@ void keepFrame(camera_fb_t* fb) {
   }
 }
 
-static void saveFrame(camera_fb_t* fb) {
+static bool nextAviSegment() {
+  // end current RIFF segment, and continue recording in new OpenDML segment
+  // index is held as segment changes, as it is shared with live playback
+  xSemaphoreTake(aviMutex, portMAX_DELAY);
+  uint8_t seg = startAviSegment(aviRec.aviPos);
+  if (!seg) {
+    xSemaphoreGive(aviMutex);
+    LOG_WRN("Recording reached max file size");
+    aviFull = true;
+    return false;
+  }
+  // idx1 for first segment only, for legacy players
+  uint8_t idxChunk[256];
+  size_t idxLen;
+  while ((idxLen = writeAviIndex(idxChunk, sizeof(idxChunk))) > 0) bufferAvi(&aviRec, idxChunk, idxLen);
+  uint8_t segHdr[AVIX_HDR_LEN];
+  buildAviSegHdr(segHdr, seg); // sizes updated when file closed
+  bufferAvi(&aviRec, segHdr, AVIX_HDR_LEN);
+  xSemaphoreGive(aviMutex);
+  LOG_INF("Started AVI segment %u at %s", seg, fmtSize(aviRec.aviPos));
+  return true;
+}
+
+#if INCLUDE_AUDIO
+static void saveAudio(bool final) {
+  // interleave audio recorded since previous chunk as 01wb chunk, 
+  // in blocks of at least AUD_CHUNK_MIN unless recording finished
+  size_t audLen = audioRecordLen() & ~3; // whole samples, 4 byte aligned
+  if (!audLen || (!final && audLen < AUD_CHUNK_MIN)) return;
+  if (aviSegmentFull(audLen + CHUNK_HDR) && !nextAviSegment()) return;
+  uint8_t hdrBuff[CHUNK_HDR];
+  memcpy(hdrBuff, wbBuf, 4);
+  memcpy(hdrBuff + 4, &audLen, 4);
+  bufferAvi(&aviRec, hdrBuff, CHUNK_HDR);
+  for (size_t audRemain = audLen; audRemain; ) {
+    // audio ring may wrap
+    size_t partLen = audRemain;
+    const uint8_t* audPart = peekAudioRecord(&partLen);
+    bufferAvi(&aviRec, audPart, partLen);
+    releaseAudioRecord(partLen);
+    audRemain -= partLen;
+  }
+  buildAviIdx(audLen, false);
+  audBytes += audLen;
+}
+#endif
+
+static void saveFrame(const uint8_t* jpegBuf, size_t jpegLen, uint32_t frameMs) {
   // save frame on SD card
   uint32_t fTime = millis();
-  // align end of jpeg on 4 byte boundary for AVI
-  uint16_t filler = (4 - (fb->len & 0x00000003)) & 0x00000003;
-  size_t jpegSize = fb->len + filler;
-  // add avi frame header
-  memcpy(iSDbuffer + highPoint, dcBuf, 4);
-  memcpy(iSDbuffer + highPoint + 4, &jpegSize, 4);
-  highPoint += CHUNK_HDR;
-  if (highPoint >= RAMSIZE) {
-    // marker overflows buffer
-    highPoint -= RAMSIZE;
-    aviFile.write(iSDbuffer, RAMSIZE);
-    // push overflow to buffer start
-    memcpy(iSDbuffer, iSDbuffer + RAMSIZE, highPoint);
+  uint32_t bufferUs = micros(); // advanced to exclude SD write and index time
+  if (aviFull) return; // file size limit reached
+#if INCLUDE_AUDIO
+  saveAudio(false);
+  if (aviFull) return;
+#endif
+  if (!aviFrames) firstFrameMs = frameMs;
+  // add empty frames for any frame intervals missed since previous frame,
+  // so that playback and audio keep to the capture timeline
+  uint32_t frameSlot = ((uint64_t)(frameMs - firstFrameMs) * aviFPS + 500) / 1000;
+  while (aviFrames < frameSlot && aviFrames < maxFrames - 1) {
+    bufferFrameHdr(&aviRec, 0);
+    buildAviIdx(0);
+    vidSize += CHUNK_HDR;
+    aviFrames++;
   }
-  // add frame content
-  size_t jpegRemain = jpegSize;
+  if (aviFrames >= maxFrames) return; // no space left in index
+  // align end of jpeg on 4 byte boundary for AVI, followed by recording tag chunk
+  uint16_t filler = (4 - (jpegLen & 0x00000003)) & 0x00000003;
+  size_t jpegSize = jpegLen + filler;
+  if (aviSegmentFull(jpegSize + CHUNK_HDR + sizeof(tagChunk)) && !nextAviSegment()) return;
+  lastFrameNum = aviFrames;
+  lastFrameOffset = aviRec.aviPos;
+  bufferFrameHdr(&aviRec, jpegSize);
+  // add frame content, written to SD when buffer is filled
+  bool doWrite = jpegSize + sizeof(tagChunk) >= aviRec.buffLen - aviRec.highPoint;
   uint32_t wTime = millis();
-  while (jpegRemain >= RAMSIZE - highPoint) {
-    // write to SD when RAMSIZE is filled in buffer
-    memcpy(iSDbuffer + highPoint, fb->buf + jpegSize - jpegRemain, RAMSIZE - highPoint);
-    aviFile.write(iSDbuffer, RAMSIZE);
-    jpegRemain -= RAMSIZE - highPoint;
-    highPoint = 0;
+  uint32_t lTime = micros();
+  bufferAvi(&aviRec, jpegBuf, jpegSize);
+  bufferAvi(&aviRec, tagChunk, sizeof(tagChunk));
+  if (doWrite) {
+    if (millis() - ckptMs > CHECKPOINT_MS) {
+      // preceding frames now written, so flush file and checkpoint their index
+      aviFlush(&aviRec);
+      saveAviCheckpoint(lastFrameOffset);
+      ckptMs = millis();
+    }
+    addLatency(LAT_SD_WRITE, lTime);
+    bufferUs += micros() - lTime;
   }
   wTime = millis() - wTime;
   wTimeTot += wTime;
   LOG_VRB("SD storage time %lu ms", wTime);
-  // whats left or small frame
-  memcpy(iSDbuffer + highPoint, fb->buf + jpegSize - jpegRemain, jpegRemain);
-  highPoint += jpegRemain;
 
+  lTime = micros();
   buildAviIdx(jpegSize); // save avi index for frame
-  vidSize += jpegSize + CHUNK_HDR;
+  skipAviIdx(sizeof(tagChunk));
+  addLatency(LAT_INDEX, lTime);
+  bufferUs += micros() - lTime;
+  vidSize += jpegSize + CHUNK_HDR + sizeof(tagChunk);
   frameCnt++;
+  aviFrames++;
+  addLatency(LAT_BUFFER, bufferUs);
   fTime = millis() - fTime - wTime;
   fTimeTot += fTime;
   LOG_VRB("Frame processing time %lu ms", fTime);
   LOG_VRB("============================");
 }
 
+static void savePreRoll() {
+  // save pre-roll frames at start of recording
+  if (preRollCnt) {
+    startTime = preRollIdx[preRollOldest].msecs; // recording starts from oldest frame
+    LOG_INF("Saving %u pre-roll frames covering %lu ms", preRollCnt, millis() - startTime);
+    while (preRollCnt) {
+      preRollEntry* entry = &preRollIdx[preRollOldest];
+      saveFrame(preRollBuf + entry->offset, entry->len, entry->msecs);
+      dropPreRoll();
+    }
+  }
+  preRollBusy = false;
+}
+
 static bool closeAvi() {
   // closes the recorded file
+  liveRec = false; // live playback sessions end at what is already written
   uint32_t vidDuration = millis() - startTime;
   uint32_t vidDurationSecs = lround(vidDuration / 1000.0);
   logLine();
   LOG_VRB("Capture time %lu, min seconds: %u ", vidDurationSecs, minSeconds);
 
   cTime = millis();
-  // write remaining frame content to SD
-  aviFile.write(iSDbuffer, highPoint);
-  size_t readLen = 0;
-  bool haveWav = false;
 #if INCLUDE_AUDIO
-  // add wav file if exists
+  // add any audio recorded since last frame
   finishAudioRecord(true);
-  haveWav = haveWavFile();
-  if (haveWav) {
-    do {
-      readLen = writeWavFile(iSDbuffer, RAMSIZE);
-      aviFile.write(iSDbuffer, readLen);
-    } while (readLen > 0);
-  }
+  if (!aviFull) saveAudio(true);
 #endif
-  // save avi index
-  finalizeAviIndex(frameCnt);
-  do {
-    readLen = writeAviIndex(iSDbuffer, RAMSIZE);
-    if (readLen) aviFile.write(iSDbuffer, readLen);
-  } while (readLen > 0);
-  // save avi header at start of file
+  bool haveWav = audBytes > 0;
+  // write remaining content and avi index to SD
+  writeAviEnd(&aviRec);
+  size_t aviLen = aviPosition(&aviRec);
+  // save avi header at start of file, empty frames keep the nominal frame rate accurate
   float actualFPS = (1000.0f * (float)frameCnt) / ((float)vidDuration);
-  uint8_t actualFPSint = (uint8_t)(lround(actualFPS));
+  uint32_t audioDelay = frameCnt && audioStartMs > firstFrameMs ? audioStartMs - firstFrameMs : 0;
   xSemaphoreTake(aviMutex, portMAX_DELAY);
-  buildAviHdr(actualFPSint, fsizePtr, frameCnt);
+  buildAviHdr(aviFPS, fsizePtr, aviFrames, false, audioDelay);
   xSemaphoreGive(aviMutex);
-  aviFile.seek(0, SeekSet); // start of file
-  aviFile.write(aviHeader, AVI_HEADER_LEN);
-  aviFile.close();
+  closeAviFile(&aviRec);
   LOG_VRB("Final SD storage time %lu ms", millis() - cTime);
   uint32_t hTime = millis();
 #if INCLUDE_MQTT
@@ -344,23 +1563,36 @@ static bool closeAvi() {
   if (vidDurationSecs >= minSeconds) {
     // name file to include actual dateTime, FPS, duration, and frame count
     int alen = snprintf(aviFileName, FILE_NAME_LEN - 1, "%s_%s_%u_%lu%s%s%s.%s",
-                        partName, frameData[fsizePtr].frameSizeStr, actualFPSint, vidDurationSecs,
+                        partName, frameData[fsizePtr].frameSizeStr, aviFPS, vidDurationSecs,
                         haveWav ? "_S" : "", haveSrt ? "_M" : "", dashCamOn ? "_C" : "", AVI_EXT);
     if (alen > FILE_NAME_LEN - 1) LOG_WRN("file name truncated");
-    STORAGE.rename(AVITEMP, aviFileName);
+    if (dashIdx >= 0 && !eventCnt) strcpy(aviFileName, aviTempName); // stays in dashcam ring
+    else {
+      if (poolIdx >= 0 || dashIdx >= 0) truncateFile(aviTempName, aviLen); // release unused preallocated space
+      STORAGE.rename(aviTempName, aviFileName);
+    }
+    if (dashIdx >= 0) closeDashSeg(aviLen, vidDurationSecs);
+    closeAviIndex();
+    saveEvents(aviFileName);
+    if (strcmp(aviFileName, aviTempName)) saveThumb(aviFileName); // not for dashcam ring segment
+    if (frameCnt) avgFrameLen = vidSize / frameCnt;
+    if (poolIdx >= 0) {
+      // replace used pool file
+      aviPool[poolIdx] = POOL_EMPTY;
+      if (aviPoolHandle != NULL) xTaskNotifyGive(aviPoolHandle);
+    }
     LOG_VRB("AVI close time %lu ms", millis() - hTime);
     cTime = millis() - cTime;
 #if INCLUDE_TELEM
     stopTelemetry(aviFileName);
 #endif
-    if (dashCamOn) forceRecord = true; // restart continuous recording
-    else {
-      // AVI stats
+    if (!recSess[REC_CONTINUOUS].triggered) {
+      // AVI stats, not for each continuous segment
       LOG_INF("******** AVI recording stats ********");
       LOG_ALT("Recorded %s", aviFileName);
       LOG_INF("AVI duration: %lu secs", vidDurationSecs);
-      LOG_INF("Number of frames: %u", frameCnt);
-      LOG_INF("Required FPS: %u", FPS);
+      LOG_INF("Number of frames: %lu, empty frames added: %lu", frameCnt, aviFrames - frameCnt);
+      LOG_INF("Required FPS: %u", aviFPS);
       LOG_INF("Actual FPS: %0.1f", actualFPS);
       LOG_INF("File size: %s", fmtSize(vidSize));
       if (frameCnt) {
@@ -369,7 +1601,9 @@ static bool closeAvi() {
         LOG_INF("Average frame buffering time: %lu ms", fTimeTot / frameCnt);
         LOG_INF("Average frame storage time: %lu ms", wTimeTot / frameCnt);
       }
-      LOG_INF("Average SD write speed: %lu kB/s", ((vidSize / wTimeTot) * 1000) / 1024);
+      LOG_INF("Average SD write speed: %lu kB/s, using %s with %zuKB writes", ((vidSize / std::max(wTimeTot, (uint32_t)1)) * 1000) / 1024,
+        aviRec.direct ? "FatFs" : "VFS", aviRec.buffLen / 1024);
+      LOG_INF("SD queue max depth: %u, frames spilled: %lu, dropped: %lu, skipped: %lu", sdQueueHigh, sdQueueSpills, sdQueueDrops, captureSkips);
       LOG_INF("File open / completion times: %lu ms / %lu ms", oTime, cTime);
       LOG_INF("Busy: %lu%%", std::min(100 * (wTimeTot + fTimeTot + dTimeTot + oTime + cTime) / vidDuration, (uint32_t)100));
       checkMemory();
@@ -400,29 +1634,113 @@ static bool closeAvi() {
     return true;
   } else {
     // delete too small files if exist
-    STORAGE.remove(AVITEMP);
+    if (poolIdx >= 0) aviPool[poolIdx] = POOL_READY; // reuse pool file as still preallocated
+    else if (dashIdx >= 0) dashIdx = -1; // ring segment recorded again
+    else STORAGE.remove(AVITEMP);
+    closeAviIndex();
     LOG_INF("Insufficient capture duration: %lu secs", vidDurationSecs);
     return false;
   }
 }
 
+static size_t findRecordedEnd(aviSource* src, size_t filePos, uint32_t tag) {
+  // file position after last tag chunk holding given recording tag, as a reused pool file
+  // or dashcam segment can hold valid chunks from an earlier recording beyond the new content
+  size_t endPos = filePos;
+  uint32_t chunkLen, chunkTag;
+  uint8_t chunkType;
+  while ((chunkType = nextAviChunk(src, filePos, &chunkLen)) != AVI_END) {
+    if (chunkType == AVI_JUNK) {
+      // follows each jpeg, whereas empty frames and audio are only kept if followed by a tagged jpeg
+      if (chunkLen != sizeof(tagChunk) || src->readAt(src->ctx, filePos + CHUNK_HDR, (uint8_t*)&chunkTag, sizeof(chunkTag)) != sizeof(chunkTag)
+        || chunkTag != tag) break;
+      endPos = filePos + chunkLen;
+    } else if (chunkType == AVI_INDEX) chunkLen += AVIX_HDR_LEN;
+    filePos += chunkLen;
+  }
+  return endPos;
+}
+
+static void recoverAvi() {
+  // complete recording interrupted by power loss or crash, using its index checkpoint
+  // only the chunks written after the checkpoint need to be scanned
+  aviRecovery rec;
+  if (!loadAviCheckpoint(&rec)) {
+    closeAviIndex();
+    return;
+  }
+  uint32_t rTime = millis();
+  aviRec.direct = false;
+  aviRec.file = STORAGE.open(rec.aviName, "r+");
+  if (!aviRec.file) {
+    LOG_WRN("Failed to open %s for recovery", rec.aviName);
+    closeAviIndex();
+    return;
+  }
+  aviSource src = {readAviFile, &aviRec.file, aviRec.file.size()};
+  size_t filePos = rec.filePos;
+  src.size = findRecordedEnd(&src, filePos, rec.tag);
+  uint32_t frames = rec.frames;
+  uint32_t scanned = 0;
+  uint32_t chunkLen;
+  uint8_t chunkType;
+  // scan until end of content of this recording
+  while (frames < maxFrames && (chunkType = nextAviChunk(&src, filePos, &chunkLen)) != AVI_END) {
+    if (chunkType == AVI_VIDEO) {
+      buildAviIdx(chunkLen - CHUNK_HDR);
+      frames++;
+      scanned++;
+    } else if (chunkType == AVI_AUDIO) {
+      buildAviIdx(chunkLen - CHUNK_HDR, false);
+      rec.audioBytes += chunkLen - CHUNK_HDR;
+    } else if (chunkType == AVI_JUNK) skipAviIdx(chunkLen);
+    else {
+      // next segment, after idx1 of first segment, whose header sizes are written on close
+      if (!startAviSegment(filePos)) break;
+      if (chunkType == AVI_INDEX) chunkLen += AVIX_HDR_LEN;
+    }
+    filePos += chunkLen;
+  }
+  aviSeek(&aviRec, filePos);
+  finalizeAviIndex(false, filePos);
+  size_t idxLen;
+  while ((idxLen = writeAviIndex(iSDbuffer, RAMSIZE)) > 0) aviWrite(&aviRec, iSDbuffer, idxLen);
+  size_t aviLen = aviPosition(&aviRec);
+  buildAviHdr(rec.FPS, rec.frameType, frames);
+  closeAviFile(&aviRec);
+  if (frames) {
+    truncateFile(rec.aviName, aviLen);
+    snprintf(aviFileName, FILE_NAME_LEN - 1, "%s_%s_%u_%lu%s_R.%s", rec.partName, 
+      frameData[rec.frameType].frameSizeStr, rec.FPS, frames / std::max(rec.FPS, (uint8_t)1), 
+      rec.audioBytes ? "_S" : "", AVI_EXT);
+    STORAGE.rename(rec.aviName, aviFileName);
+    LOG_WRN("Recovered interrupted recording %s, %lu frames of which %lu after checkpoint, in %lu ms", 
+      aviFileName, frames, scanned, millis() - rTime);
+  } else if (!strcmp(rec.aviName, AVITEMP)) STORAGE.remove(AVITEMP);
+  closeAviIndex();
+}
+
 static boolean processFrame() {
   // get camera frame
   static bool haveMotion = false;
+  static int capFrames = 0; // frames queued for current recording
+  static uint32_t capStartMs = 0; // capture time of first frame in recording
+  static uint8_t pendingEvent = EVT_NONE; // event to attach to next recorded frame
   bool res = true;
   uint32_t dTime = millis();
 
+  uint32_t lTime = micros();
   camera_fb_t* fb = esp_camera_fb_get();
-  if (fb == NULL || !fb->len || fb->len > maxFrameBuffSize) return false;
-  timeLapse(fb);
-
-  for (int i = 0; i < vidStreams; i++) {
-    if (!streamBufferSize[i] && streamBuffer[i] != NULL) {
-      memcpy(streamBuffer[i], fb->buf, fb->len);
-      streamBufferSize[i] = fb->len;
-      xSemaphoreGive(frameSemaphore[i]); // signal frame ready for stream
-    }
+  addLatency(LAT_FB_GET, lTime);
+  if (fb == NULL) return false;
+  frameRef* ref = (fb->len && fb->len <= maxFrameBuffSize) ? holdFrame(fb) : NULL;
+  if (ref == NULL) {
+    esp_camera_fb_return(fb);
+    return false;
   }
+  lTime = micros();
+  shareFrame(ref);
+  addLatency(LAT_STREAM, lTime);
   if (doKeepFrame) {
     keepFrame(fb);
     doKeepFrame = false;
@@ -432,8 +1750,10 @@ static boolean processFrame() {
   int reasonId = 0;
   bool prevMotion = haveMotion;
   if (doMonitor(doRecording ? isCapturing : dbgMotion ? false : true)) {
+    lTime = micros();
     if (useMotion && checkMotion(fb, isCapturing)) reasonId = 1; // check 1 in N frames
     if (!useMotion) checkMotion(fb, false, true); // calc light level only
+    addLatency(LAT_MOTION, lTime);
 #if INCLUDE_PERIPH
     if (pirUse && getPIRval()) reasonId = 2;
 #endif
@@ -459,14 +1779,17 @@ static boolean processFrame() {
 #endif
   }
 
-  // recording status
+  // recording status, from trigger of each session
+  triggerSessions(haveMotion);
+  lTime = micros();
+  timeLapse(ref);
+  addLatency(LAT_TIMELAPSE, lTime);
   bool prevCapture = isCapturing;
-  isCapturing = haveMotion | forceRecord;
+  bool continuous = recSess[REC_CONTINUOUS].triggered;
+  isCapturing = continuous || recSess[REC_EVENT].triggered;
   if (isCapturing && !prevCapture) {
-    // new movement has occurred or record button pressed, start recording
-    stopPlaying(); // terminate any playback
-    stopPlayback = true; // stop any subsequent playback
-    if (!dashCamOn) LOG_ALT("Capture started by %s%s%s%s", reasonId == 0 ? "Button" : "", reasonId == 1 ? "Camera " : "", reasonId == 2 ? "PIR" : "", reasonId == 3 ? "Accelerometer" : "");
+    // new movement has occurred, record button pressed, or continuous segment due, start recording
+    if (!continuous) LOG_ALT("Capture started by %s%s%s%s", reasonId == 0 ? "Button" : "", reasonId == 1 ? "Camera " : "", reasonId == 2 ? "PIR" : "", reasonId == 3 ? "Accelerometer" : "");
 #if INCLUDE_MQTT
     if (mqtt_active) {
       sprintf(jsonBuff, "{\"RECORD\":\"ON\", \"TIME\":\"%s\"}", esp_log_system_timestamp());
@@ -475,47 +1798,112 @@ static boolean processFrame() {
     }
 #endif
     wsAsyncSendJson("ustatus", "\"showRecord\":1");
-    openAvi();
-  }
+    capFrames = preRollCnt; // pre-roll frames also count towards frame limit
+    capStartMs = preRollCnt ? preRollIdx[preRollOldest].msecs : frameTime(fb);
+    // what started recording, or motion continuing into next continuous segment
+    if (!recSess[REC_EVENT].triggered) pendingEvent = EVT_NONE;
+    else pendingEvent = (reasonId || !haveMotion) ? reasonId : EVT_MOTION_ON;
+    preRollBusy = true;
+    aviFull = false;
+    queueSD(SD_OPEN);
+  } else if (isCapturing && haveMotion != prevMotion) pendingEvent = haveMotion ? EVT_MOTION_ON : EVT_MOTION_OFF;
+  else if (!isCapturing && preRollSecs && doRecording && !continuous && !preRollBusy) addPreRoll(fb);
 
   if (isCapturing) {
     // capture is ongoing
     showProgress();
-    if (frameCnt < frameLimit) {
+    if (capFrames < frameLimit) {
       dTimeTot += millis() - dTime;
-      saveFrame(fb);
-      if (frameCnt >= frameLimit) {
+      if (queueSD(SD_FRAME, ref, pendingEvent)) {
+        capFrames++;
+        pendingEvent = EVT_NONE;
+      }
+      // frame limit also applies to empty frames that will fill missed intervals
+      uint32_t capSlots = ((uint64_t)(frameTime(fb) - capStartMs) * FPS + 500) / 1000 + 1;
+      if (capFrames >= frameLimit || capSlots >= frameLimit || aviFull) {
         // stop saving frames for this avi as limit reached
         isCapturing = forceRecord = false;
-        if (!dashCamOn) {
+        if (!continuous) {
           logLine();
-          LOG_WRN("Auto closed recording after %u frames", frameLimit);
+          if (aviFull) LOG_WRN("Auto closed recording at max file size");
+          else LOG_WRN("Auto closed recording after %u frames", frameLimit);
         }
       }
     }
 #if INCLUDE_PERIPH
-    if (buzzerUse && frameCnt / FPS >= buzzerDuration) buzzerAlert(false); // switch off after given period
+    if (buzzerUse && capFrames / FPS >= buzzerDuration) buzzerAlert(false); // switch off after given period
 #endif
   }
 
-  esp_camera_fb_return(fb);
+  releaseFrame(ref);
   if (!isCapturing && prevCapture) {
     // finish recording (normal or forced)
-    closeAvi();
-    wsAsyncSendJson("ustatus", "\"showRecord\":0");
-    stopPlayback = false; // allow for playbacks
+    snapMotionThumb();
+    queueSD(SD_CLOSE);
   }
+  capBusyMs += millis() - dTime;
+  procFrames++;
   return res;
 }
 
+static void sdWriteTask(void* parameter) {
+  // woken by capture task when SD actions queued
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    uint32_t tail = sdTail;
+    while (tail != __atomic_load_n(&sdHead, __ATOMIC_ACQUIRE)) {
+      sdEntry* entry = &sdQueue[tail & (SD_QUEUE_LEN - 1)];
+      uint32_t bTime = millis();
+      switch (entry->action) {
+        case SD_OPEN:
+          openAvi();
+          savePreRoll();
+          break;
+        case SD_FRAME:
+          saveFrame(entry->spill != NULL ? entry->spill : entry->ref->fb->buf, entry->len, entry->msecs);
+          if (entry->event != EVT_NONE) addEvent(entry->event, entry->msecs);
+          break;
+        case SD_CLOSE:
+          closeAvi();
+          dropMotionThumb(); // if not used for thumbnail
+          wsAsyncSendJson("ustatus", "\"showRecord\":0");
+          break;
+        case SD_TL_OPEN:
+          openTimeLapse();
+          break;
+        case SD_TL_FRAME:
+          saveTimeLapse(entry->ref->fb);
+          break;
+        case SD_TL_CLOSE:
+          closeTimeLapse();
+          break;
+      }
+      if (entry->spill != NULL) {
+        free(entry->spill);
+        __atomic_sub_fetch(&spillBytes, entry->len, __ATOMIC_RELAXED);
+      }
+      releaseFrame(entry->ref); // return frame buffer to camera
+      sdBusyMs += millis() - bTime;
+      __atomic_store_n(&sdTail, ++tail, __ATOMIC_RELEASE);
+    }
+  }
+  vTaskDelete(NULL);
+}
+
 static void captureTask(void* parameter) {
   // woken by frame timer when time to capture frame
   uint32_t ulNotifiedValue;
   while (true) {
     ulNotifiedValue = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-    if (ulNotifiedValue > FB_CNT) ulNotifiedValue = FB_CNT; // prevent too big queue if FPS excessive
+    if (ulNotifiedValue > FB_CNT) {
+      // prevent too big queue if FPS excessive
+      captureSkips += ulNotifiedValue - FB_CNT;
+      ulNotifiedValue = FB_CNT;
+    }
     // may be more than one isr outstanding if the task delayed by SD write or jpeg decode
+    if (ulNotifiedValue > 1) coalescedFrames += ulNotifiedValue - 1;
     while (ulNotifiedValue-- > 0) processFrame();
+    governFrameRate();
   }
   vTaskDelete(NULL);
 }
@@ -526,7 +1914,7 @@ uint8_t setFPS(uint8_t val) {
     FPS = val;
     // change frame timer which drives the task
     controlFrameTimer(true);
-    saveFPS = FPS; // used to reset FPS after playback
+    saveFPS = govFPS = FPS;
   }
   return FPS;
 }
@@ -551,184 +1939,536 @@ static fnameStruct extractMeta(const char* fname) {
   return fnameMeta;
 }
 
-static void playbackFPS(const char* fname) {
+// Each playback session has its own file, read ahead ring and frame pacing, so that
+// several clients can review different recordings at once, up to playSessions.
+// The playback task reads ahead for every session into its ring of PLAY_SLOTS blocks,
+// and notifies the session streaming task as each block is filled. Frames are sent to the
+// browser straight from the ring, and each block is released to the playback task once sent.
+// All file access is by the playback task, so a seek for trick play is passed to it as a
+// new request, and any blocks read ahead for an earlier request are discarded.
+// A live session plays the motion capture in progress. It locates frames from the index
+// being built, and reads only content already written to SD.
+// Playbacks run alongside a recording, but a session is only admitted while the SD time
+// taken by the recording, and by each session at the rate it reads, is within SD_PLAY_BUDGET.
+
+#define PLAY_ALIGN 512 // SD sector size, so that reads after a seek are sector aligned
+#define PLAY_SLOT_LEN (CHUNK_HDR + PLAY_BLOCK) // slot starts with space for chunk header carried over
+#define SD_PLAY_BUDGET 80 // max % of SD time for recording and playbacks together
+
+enum playFill {FILL_IDLE, FILL_DONE, FILL_WAIT};
+
+struct playSlot {
+  size_t filePos; // file position of slot content
+  size_t len; // bytes read, 0 at end of recording
+  uint16_t start; // bytes before required content, as read started at sector boundary
+  uint8_t epoch; // request that read belongs to
+  bool notFound; // requested frame not in recording
+};
+
+struct playSession {
+  File file;
+  char fileName[FILE_NAME_LEN];
+  uint8_t* ring; // PLAY_SLOTS blocks, read ahead by playback task
+  playSlot slots[PLAY_SLOTS];
+  uint32_t filled; // slots filled by playback task
+  uint32_t consumed; // slots released by session
+  TaskHandle_t streamHandle; // task streaming session, notified when slot filled
+  bool reading; // playback task can read for session
+  aviSource src; // for index lookup
+  bool isOdml; // file has OpenDML segments
+  bool isLive; // playing motion capture in progress
+  uint8_t recFPS;
+  uint32_t recDuration;
+  uint32_t frameUs; // frame interval at recorded rate
+  uint32_t byteRate; // bytes per sec read at recorded rate, for SD budget
+  uint32_t frameDue; // micros() when next frame to be sent
+  int speed; // trick play speed multiple, negative for reverse
+  int frameIdx; // frame number being played
+  bool seekFrame; // next video chunk is frame frameIdx
+  bool completed; // playback reached end of recording
+  volatile bool stopping; // playback to be ended
+  bool inUse;
+  // read request, set by session
+  uint8_t reqEpoch; // incremented for each seek
+  size_t seekPos; // file position to read from, or 0 to locate frame seekNum
+  int seekNum;
+  // read state, for playback task
+  uint8_t fillEpoch; // request being read
+  bool readEnd; // end of recording reached for request
+  uint16_t readStart; // skip for first read of request
+  // stream state, for session
+  playSlot* slot; // slot being sent, NULL if none
+  size_t buffOffset; // in slot being sent
+  size_t remainingFrame; // bytes of jpeg still to send
+  size_t skipLen; // bytes of skipped chunk still to pass over
+  uint8_t carry[CHUNK_HDR]; // start of chunk header at end of previous slot
+  size_t carryLen;
+  // stats
+  uint32_t frameCnt, vidSize, sTime, hTime, rTimeTot, wTimeTot, fTimeTot, hTimeTot, tTimeTot;
+};
+
+static playSession playSess[MAX_PLAY_SESSIONS];
+static playSession* volatile readingNow = NULL; // session being read by playback task
+static portMUX_TYPE playMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void playbackMeta(playSession* ps) {
   // extract meta data from filename to commence playback
-  fnameStruct fnameMeta = extractMeta(fname);
-  recFPS = fnameMeta.recFPS;
-  if (recFPS < 1) recFPS = 1;
-  recDuration = fnameMeta.recDuration;
-  // temp change framerate to recorded framerate
-  FPS = recFPS;
-  controlFrameTimer(true); // set frametimer
+  fnameStruct fnameMeta = extractMeta(ps->fileName);
+  ps->recFPS = fnameMeta.recFPS;
+  if (ps->recFPS < 1) ps->recFPS = 1;
+  ps->recDuration = fnameMeta.recDuration;
+  ps->frameUs = OneMHz / ps->recFPS;
 }
 
-static void readSD() {
-  // read next cluster from SD for playback
-  uint32_t rTime = millis();
-  // read to interim dram before copying to psram
-  readLen = 0;
-  if (!stopPlayback) {
-    readLen = playbackFile.read(iSDbuffer + RAMSIZE + CHUNK_HDR, RAMSIZE);
-    LOG_VRB("SD read time %lu ms", millis() - rTime);
+static inline bool sessionRunning(playSession* ps) {
+  // whether playback session to continue, until ended by client or stopPlaying()
+  return !ps->stopping;
+}
+
+static inline uint8_t* slotBuff(playSession* ps, playSlot* slot) {
+  // ring block for given slot
+  return ps->ring + (slot - ps->slots) * PLAY_SLOT_LEN;
+}
+
+static size_t findPlayFrame(playSession* ps, uint32_t frameNum) {
+  // file position of chunk for given frame, from index being built if live
+  return ps->isLive ? findLiveFrame(frameNum, aviRec.writtenPos) : findAviFrame(&ps->src, frameNum);
+}
+
+/******************* read ahead ring ********************/
+
+static uint8_t fillSlot(playSession* ps) {
+  // playback task reads next block for session into its ring, if space
+  portENTER_CRITICAL(&playMux);
+  if (ps->reading) readingNow = ps; // session cannot close till read done
+  portEXIT_CRITICAL(&playMux);
+  if (readingNow != ps) return FILL_IDLE;
+  uint8_t res = FILL_IDLE;
+  uint8_t epoch = __atomic_load_n(&ps->reqEpoch, __ATOMIC_ACQUIRE);
+  // read ahead is wasted for trick play, as next frame usually elsewhere
+  uint32_t depth = ps->speed == 1 ? PLAY_SLOTS : 1;
+  uint32_t filled = ps->filled;
+  if (sessionRunning(ps) && filled - __atomic_load_n(&ps->consumed, __ATOMIC_ACQUIRE) < depth
+      && (epoch != ps->fillEpoch || !ps->readEnd)) {
+    uint32_t rTime = millis();
+    playSlot* slot = ps->slots + filled % PLAY_SLOTS;
+    *slot = {0, 0, 0, epoch, false};
+    if (epoch != ps->fillEpoch) {
+      // new request, start reading from sector holding required position
+      ps->fillEpoch = epoch;
+      ps->readEnd = false;
+      size_t seekPos = ps->seekPos ? ps->seekPos : ps->seekNum >= 0 ? findPlayFrame(ps, ps->seekNum) : 0;
+      if (seekPos) {
+        ps->file.seek(seekPos - seekPos % PLAY_ALIGN, SeekSet);
+        ps->readStart = seekPos % PLAY_ALIGN;
+      } else slot->notFound = true;
+    }
+    res = FILL_DONE;
+    if (!slot->notFound) {
+      size_t readLen = PLAY_BLOCK;
+      slot->filePos = ps->file.position();
+      if (ps->isLive) {
+        // only read once at least a cluster written by recording, or what remains once ended
+        bool recording = liveRec;
+        size_t writtenPos = aviRec.writtenPos;
+        readLen = std::min(writtenPos - std::min(slot->filePos, writtenPos), (size_t)PLAY_BLOCK);
+        if (recording && readLen < RAMSIZE) res = FILL_WAIT;
+      }
+      if (res == FILL_DONE && readLen) {
+        slot->len = ps->file.read(slotBuff(ps, slot) + CHUNK_HDR, readLen);
+        if (ps->isLive && slot->len < readLen) {
+          // file size is only updated on SD when recording flushed, so reopen for latest size
+          ps->file.close();
+          ps->file = STORAGE.open(ps->fileName, FILE_READ);
+          ps->file.seek(slot->filePos, SeekSet);
+          res = FILL_WAIT;
+        }
+      }
+      LOG_VRB("SD read time %lu ms", millis() - rTime);
+    }
+    if (res == FILL_DONE) {
+      slot->start = ps->readStart;
+      ps->readStart = 0;
+      if (slot->len <= slot->start) slot->len = 0;
+      ps->readEnd = !slot->len; // slot signals end of recording
+      __atomic_store_n(&ps->filled, filled + 1, __ATOMIC_RELEASE);
+      xTaskNotifyGive(ps->streamHandle);
+    }
+    ps->rTimeTot += millis() - rTime;
   }
-  wTimeTot += millis() - rTime;
-  xSemaphoreGive(readSemaphore); // signal that ready
-  delay(10);
+  readingNow = NULL;
+  return res;
 }
 
+static void releaseSlot(playSession* ps) {
+  // return oldest filled slot to playback task for reuse
+  __atomic_store_n(&ps->consumed, ps->consumed + 1, __ATOMIC_RELEASE);
+  xTaskNotifyGive(playbackHandle);
+}
 
-void openSDfile(const char* streamFile) {
-  // open selected file on SD for streaming
-  if (stopPlayback) LOG_WRN("Playback refused - capture in progress");
-  else {
-    stopPlaying(); // in case already running
-    strcpy(aviFileName, streamFile);
-    LOG_INF("Playing %s", aviFileName);
-    playbackFile = STORAGE.open(aviFileName, FILE_READ);
-    playbackFile.seek(AVI_HEADER_LEN, SeekSet); // skip over header
-    playbackFPS(aviFileName);
-    isPlaying = true; //playback status
-    doPlayback = true; // control playback
-    readSD(); // prime playback task
-  }
-}
-
-mjpegStruct getNextFrame(bool firstCall) {
-  // get next cluster on demand when ready for opened avi
-  mjpegStruct mjpegData = {0, 0, 0};
-  static bool remainingBuff;
-  static bool completedPlayback; // indicates that playback completed 
-  static size_t buffOffset;
-  static uint32_t hTimeTot;
-  static uint32_t tTimeTot;
-  static uint32_t hTime;
-  static size_t remainingFrame;
-  static size_t buffLen;
-  const uint32_t dcVal = 0x63643030; // value of 00dc marker
-  if (firstCall) {
-    sTime = millis();
-    hTime = millis();
-    remainingBuff = completedPlayback = false;
-    frameCnt = remainingFrame = vidSize = buffOffset = 0;
-    wTimeTot = fTimeTot = hTimeTot = tTimeTot = 1; // avoid divide by 0
-  }
-  LOG_VRB("http send time %lu ms", millis() - hTime);
-  hTimeTot += millis() - hTime;
+static void requestSeek(playSession* ps, size_t seekPos) {
+  // ask playback task to read from given position, or else from frame frameIdx
+  // blocks already read ahead are then discarded as from previous request
+  ps->seekPos = seekPos;
+  ps->seekNum = ps->frameIdx;
+  ps->seekFrame = true;
+  ps->slot = NULL;
+  ps->remainingFrame = ps->skipLen = ps->carryLen = 0;
+  __atomic_store_n(&ps->reqEpoch, (uint8_t)(ps->reqEpoch + 1), __ATOMIC_RELEASE);
+  xTaskNotifyGive(playbackHandle);
+}
+
+static playSlot* waitSlot(playSession* ps) {
+  // next slot filled for current request, or NULL if none ready within a frame interval
   uint32_t mTime = millis();
-  if (!stopPlayback) {
-    // continue sending out frames
-    if (!remainingBuff) {
-      // load more data from SD
-      mTime = millis();
-      // move final bytes to buffer start in case jpeg marker at end of buffer
-      memcpy(iSDbuffer, iSDbuffer + RAMSIZE, CHUNK_HDR);
-      xSemaphoreTake(readSemaphore, portMAX_DELAY); // wait for read from SD card completed
-      buffLen = readLen;
-      LOG_VRB("SD wait time %lu ms", millis() - mTime);
-      wTimeTot += millis() - mTime;
-      mTime = millis();
-      // overlap buffer by CHUNK_HDR to prevent jpeg marker being split between buffers
-      memcpy(iSDbuffer + CHUNK_HDR, iSDbuffer + RAMSIZE + CHUNK_HDR, buffLen); // load new cluster from double buffer
-      LOG_VRB("memcpy took %lu ms for %u bytes", millis() - mTime, buffLen);
-      fTimeTot += millis() - mTime;
-      remainingBuff = true;
-      if (buffOffset > RAMSIZE) buffOffset = 4; // special case, marker overlaps end of buffer
-      else buffOffset = frameCnt ? 0 : CHUNK_HDR; // only before 1st frame
-      xTaskNotifyGive(playbackHandle); // wake up task to get next cluster - sets readLen
-    }
-    mTime = millis();
-    if (!remainingFrame) {
-      // at start of jpeg frame marker
-      uint32_t inVal;
-      memcpy(&inVal, iSDbuffer + buffOffset, 4);
-      if (inVal != dcVal) {
-        // reached end of frames to stream
-        mjpegData.buffLen = buffOffset; // remainder of final jpeg
-        mjpegData.buffOffset = 0; // from start of buff
-        mjpegData.jpegSize = 0;
-        stopPlayback = completedPlayback = true;
-        return mjpegData;
-      } else {
-        // get jpeg frame size
-        uint32_t jpegSize;
-        memcpy(&jpegSize, iSDbuffer + buffOffset + 4, 4);
-        remainingFrame = jpegSize;
-        vidSize += jpegSize;
-        buffOffset += CHUNK_HDR; // skip over marker
-        mjpegData.jpegSize = jpegSize; // signal start of jpeg to webServer
-        mTime = millis();
-        // wait on playbackSemaphore for rate control
-        xSemaphoreTake(playbackSemaphore, portMAX_DELAY);
-        LOG_VRB("frame timer wait %lu ms", millis() - mTime);
-        tTimeTot += millis() - mTime;
-        frameCnt++;
-        showProgress();
+  playSlot* slot = NULL;
+  while (slot == NULL && sessionRunning(ps)) {
+    while (slot == NULL && __atomic_load_n(&ps->filled, __ATOMIC_ACQUIRE) != ps->consumed) {
+      slot = ps->slots + ps->consumed % PLAY_SLOTS;
+      if (slot->epoch != ps->reqEpoch) {
+        // read ahead before seek
+        releaseSlot(ps);
+        slot = NULL;
       }
-    } else mjpegData.jpegSize = 0; // within frame,
-    // determine amount of data to send to webServer
-    if (buffOffset > RAMSIZE) mjpegData.buffLen = 0; // special case
-    else mjpegData.buffLen = (remainingFrame > buffLen - buffOffset) ? buffLen - buffOffset : remainingFrame;
-    mjpegData.buffOffset = buffOffset; // from here
-    remainingFrame -= mjpegData.buffLen;
-    buffOffset += mjpegData.buffLen;
-    if (buffOffset >= buffLen) remainingBuff = false;
+    }
+    if (slot == NULL && !ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(std::max(ps->frameUs / 1000, (uint32_t)1)))) break;
+  }
+  LOG_VRB("SD wait time %lu ms", millis() - mTime);
+  ps->wTimeTot += millis() - mTime;
+  return slot;
+}
+
+static bool nextSlot(playSession* ps, size_t carryLen) {
+  // move on to next filled slot, carrying over start of a chunk header split between slots
+  if (ps->slot != NULL) {
+    memcpy(ps->carry, slotBuff(ps, ps->slot) + ps->buffOffset, carryLen);
+    ps->carryLen = carryLen;
+    releaseSlot(ps);
+    ps->slot = NULL;
+  }
+  playSlot* slot = waitSlot(ps);
+  if (slot == NULL) return false; // not read yet
+  if (!slot->len) {
+    releaseSlot(ps);
+    if (slot->notFound && ps->isLive && ps->speed > 0) {
+      // caught up with live recording, so continue at normal speed from last frame sent
+      ps->frameIdx -= ps->speed;
+      ps->speed = 1;
+      requestSeek(ps, 0);
+    } else ps->stopping = ps->completed = true; // passed start or end of recording
+    return false;
+  }
+  ps->slot = slot;
+  ps->buffOffset = CHUNK_HDR + slot->start - ps->carryLen;
+  memcpy(slotBuff(ps, slot) + ps->buffOffset, ps->carry, ps->carryLen);
+  ps->carryLen = 0;
+  return true;
+}
+
+static void paceFrame(playSession* ps) {
+  // wait until next frame due at recorded frame rate
+  int32_t waitUs = (int32_t)(ps->frameDue - micros());
+  if (waitUs > 0) delay((waitUs + 500) / 1000);
+  else if (waitUs < -(int32_t)ps->frameUs) ps->frameDue = micros(); // fallen behind, so resync
+  ps->frameDue += ps->frameUs;
+}
+
+/******************* playback sessions ********************/
+
+static playSession* claimSession() {
+  // reserve free playback session, within configured limit
+  playSession* ps = NULL;
+  int active = 0;
+  portENTER_CRITICAL(&playMux);
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) {
+    if (playSess[i].inUse) active++;
+    else if (ps == NULL) ps = &playSess[i];
+  }
+  if (active >= playSessions) ps = NULL;
+  if (ps != NULL) {
+    ps->inUse = true;
+    ps->byteRate = 0;
+  }
+  portEXIT_CRITICAL(&playMux);
+  return ps;
+}
+
+static int activeSessions() {
+  // number of playback sessions in use
+  int active = 0;
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) if (playSess[i].inUse) active++;
+  return active;
+}
+
+static bool withinSdBudget() {
+  // whether SD has time for sessions in use to read alongside any recording in progress,
+  // using SD write speed and time spent writing so far by recording
+  uint32_t elapsed = millis() - startTime;
+  if (!liveRec || !vidSize || !wTimeTot || !elapsed) return true; // not recording, or not yet measured
+  uint64_t busyPct = 100ULL * wTimeTot / elapsed;
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) 
+    if (playSess[i].inUse) busyPct += 100ULL * playSess[i].byteRate * wTimeTot / vidSize / 1000;
+  return busyPct <= SD_PLAY_BUDGET;
+}
+
+static uint8_t* allocRing() {
+  // ring in DMA capable internal RAM if enough spare, so SD driver reads straight into it,
+  // else in psram, where reads are copied via a bounce buffer
+  size_t ringLen = PLAY_SLOTS * PLAY_SLOT_LEN;
+  uint8_t* ring = NULL;
+  if (ESP.getFreeHeap() > ringLen + TLS_HEAP) ring = (uint8_t*)heap_caps_aligned_alloc(4, ringLen, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+  if (ring == NULL) ring = (uint8_t*)ps_malloc(ringLen);
+  else LOG_VRB("Playback ring in internal RAM");
+  return ring;
+}
+
+playSession* openSDfile(const char* streamFile, bool isLive) {
+  // open selected file on SD for streaming in a free playback session
+  // or if live, the motion capture in progress
+  if (isLive && !liveRec) {
+    LOG_WRN("Live playback refused - not recording");
+    return NULL;
+  }
+  playSession* ps = claimSession();
+  if (ps == NULL) {
+    LOG_WRN("Playback refused - %u playback sessions active", playSessions);
+    return NULL;
+  }
+  ps->ring = allocRing();
+  if (ps->ring == NULL) {
+    LOG_WRN("Playback refused - no memory for buffer");
+    ps->inUse = false;
+    return NULL;
+  }
+  ps->isLive = isLive;
+  strcpy(ps->fileName, isLive ? aviTempName : streamFile);
+  LOG_INF("Playing %s%s in session %d", isLive ? "live " : "", ps->fileName, (int)(ps - playSess));
+  ps->file = STORAGE.open(ps->fileName, FILE_READ);
+  // skip over header, or start at requested frame, time or event
+  ps->src = {readAviFile, &ps->file, ps->file.size()};
+  size_t moviPos = AVI_HEADER_LEN;
+  if (isLive) {
+    // header not yet written, so later segments assumed
+    ps->isOdml = true;
+    ps->recFPS = aviFPS;
+    ps->recDuration = 0;
+    ps->frameUs = OneMHz / ps->recFPS;
   } else {
-    // finished, close SD file used for streaming
-    playbackFile.close();
-    logLine();
-    if (!completedPlayback) LOG_INF("Force close playback");
-    uint32_t playDuration = (millis() - sTime) / 1000;
-    uint32_t totBusy = wTimeTot + fTimeTot + hTimeTot;
-    LOG_INF("******** AVI playback stats ********");
-    LOG_INF("Playback %s", aviFileName);
-    LOG_INF("Recorded FPS %u, duration %lu secs", recFPS, recDuration);
-    LOG_INF("Playback FPS %0.1f, duration %lu secs", (float)frameCnt / playDuration, playDuration);
-    LOG_INF("Number of frames: %u", frameCnt);
-    if (frameCnt) {
-      LOG_INF("Average SD read speed: %lu kB/s", ((vidSize / wTimeTot) * 1000) / 1024);
-      LOG_INF("Average frame SD read time: %lu ms", wTimeTot / frameCnt);
-      LOG_INF("Average frame processing time: %lu ms", fTimeTot / frameCnt);
-      LOG_INF("Average frame delay time: %lu ms", tTimeTot / frameCnt);
-      LOG_INF("Average http send time: %lu ms", hTimeTot / frameCnt);
-      LOG_INF("Busy: %lu%%", min(100 * totBusy / (totBusy + tTimeTot), (uint32_t)100));
+    moviPos = findAviMovi(&ps->src, &ps->isOdml);
+    playbackMeta(ps);
+  }
+  // live session reads at rate recording is written
+  uint32_t frameTotal = 0;
+  uint16_t width, height;
+  if (isLive) ps->byteRate = (uint64_t)vidSize * 1000 / std::max(millis() - startTime, (uint32_t)1);
+  else if (aviFrameInfo(&ps->src, &frameTotal, &width, &height) && frameTotal) 
+    ps->byteRate = (uint64_t)ps->src.size * ps->recFPS / frameTotal;
+  if (!withinSdBudget()) {
+    LOG_WRN("Playback refused - SD bandwidth needed by recording");
+    ps->file.close();
+    free(ps->ring);
+    ps->ring = NULL;
+    ps->inUse = false;
+    return NULL;
+  }
+  if (playSecs >= 0) playFrame = playSecs * ps->recFPS;
+  size_t framePos = playFrame >= 0 ? findPlayFrame(ps, playFrame) : 0;
+  size_t startPos = moviPos;
+  aviEvent event;
+  ps->frameIdx = 0;
+  if (framePos) {
+    LOG_INF("Playback from frame %d at %0.1f secs", playFrame, (float)playFrame / ps->recFPS);
+    startPos = framePos;
+    ps->frameIdx = playFrame;
+  } else if (playEvent >= 0 && !isLive && getEvent(ps->fileName, playEvent, &event)) {
+    LOG_INF("Playback from %s event at %0.1f secs", eventNames[event.type], (float)event.msecs / 1000);
+    startPos = event.offset;
+    ps->frameIdx = event.frameNum;
+  }
+  if (playFrame >= 0 && !framePos) LOG_WRN("Frame %d not found in %s", playFrame, ps->fileName);
+  playEvent = playFrame = playSecs = -1;
+  ps->speed = playSpeed;
+  playSpeed = 1;
+  if (ps->speed != 1) LOG_INF("Trick play at %dx", ps->speed);
+  ps->stopping = false;
+  ps->streamHandle = xTaskGetCurrentTaskHandle();
+  ps->filled = ps->consumed = 0;
+  ps->rTimeTot = 1; // avoid divide by 0
+  ps->fillEpoch = ps->reqEpoch;
+  requestSeek(ps, startPos);
+  ps->reading = true; // start read ahead
+  xTaskNotifyGive(playbackHandle);
+  return ps;
+}
+
+void setPlaySpeed(int speed) {
+  // trick play speed for active playback sessions, and next one started
+  playSpeed = constrain(speed, -MAX_PLAY_SPEED, MAX_PLAY_SPEED);
+  if (!playSpeed) playSpeed = 1;
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) if (playSess[i].inUse) playSess[i].speed = playSpeed;
+}
+
+void stopSession(playSession* ps) {
+  // end given playback session, eg when client disconnects
+  ps->stopping = true;
+}
+
+static void closeSession(playSession* ps) {
+  // stop read ahead, close SD file used for session, and report stats
+  portENTER_CRITICAL(&playMux);
+  ps->reading = false;
+  portEXIT_CRITICAL(&playMux);
+  while (readingNow == ps) delay(1); // wait for outstanding read
+  ps->file.close();
+  free(ps->ring);
+  ps->ring = NULL;
+  ps->slot = NULL;
+  ulTaskNotifyTake(pdTRUE, 0); // clear any notification from playback task, as task reused
+  logLine();
+  if (!ps->completed) LOG_INF("Force close playback");
+  uint32_t playDuration = std::max((millis() - ps->sTime) / 1000, (uint32_t)1);
+  uint32_t totBusy = ps->wTimeTot + ps->fTimeTot + ps->hTimeTot;
+  LOG_INF("******** AVI playback stats ********");
+  LOG_INF("Playback %s", ps->fileName);
+  LOG_INF("Recorded FPS %u, duration %lu secs", ps->recFPS, ps->recDuration);
+  LOG_INF("Playback FPS %0.1f, duration %lu secs", (float)ps->frameCnt / playDuration, playDuration);
+  LOG_INF("Number of frames: %lu", ps->frameCnt);
+  if (ps->frameCnt) {
+    LOG_INF("Average SD read speed: %lu kB/s", ((ps->vidSize / ps->rTimeTot) * 1000) / 1024);
+    LOG_INF("Average frame SD read time: %lu ms", ps->rTimeTot / ps->frameCnt);
+    LOG_INF("Average frame SD wait time: %lu ms", ps->wTimeTot / ps->frameCnt);
+    LOG_INF("Average frame processing time: %lu ms", ps->fTimeTot / ps->frameCnt);
+    LOG_INF("Average frame delay time: %lu ms", ps->tTimeTot / ps->frameCnt);
+    LOG_INF("Average http send time: %lu ms", ps->hTimeTot / ps->frameCnt);
+    LOG_INF("Busy: %lu%%", min(100 * totBusy / (totBusy + ps->tTimeTot), (uint32_t)100));
+  }
+  checkMemory();
+  LOG_INF("*************************************\n");
+  ps->inUse = false;
+}
+
+mjpegStruct getNextFrame(playSession* ps, bool firstCall) {
+  // get next part of frame for opened avi, sent straight from read ahead ring
+  // for trick play, each frame is located from the avi index and read directly, 
+  // so SD reads and frames sent stay at the recorded frame rate whatever the speed
+  mjpegStruct mjpegData = {0, 1, 0, NULL}; // nothing to send
+  if (firstCall) {
+    ps->sTime = ps->hTime = millis();
+    ps->frameDue = micros();
+    ps->completed = false;
+    ps->frameCnt = ps->vidSize = 0;
+    ps->wTimeTot = ps->fTimeTot = ps->hTimeTot = ps->tTimeTot = 1; // avoid divide by 0
+  }
+  LOG_VRB("http send time %lu ms", millis() - ps->hTime);
+  ps->hTimeTot += millis() - ps->hTime;
+  if (!sessionRunning(ps)) {
+    // finished, release session
+    closeSession(ps);
+    mjpegData.buffOffset = 0; // signal end of playback
+    return mjpegData;
+  }
+  if (!ps->remainingFrame && !ps->skipLen && ps->speed != 1 && !ps->seekFrame) {
+    // trick play, so move straight to next frame required at this speed
+    ps->frameIdx += ps->speed;
+    if (ps->frameIdx < 0) {
+      // passed start of recording
+      ps->stopping = ps->completed = true;
+      return mjpegData;
+    }
+    requestSeek(ps, 0);
+  }
+  // need whole chunk header, and some content, before chunk is processed
+  size_t needLen = ps->remainingFrame || ps->skipLen ? 0 : CHUNK_HDR;
+  size_t avail;
+  while ((avail = ps->slot == NULL ? 0 : CHUNK_HDR + ps->slot->len - ps->buffOffset) <= needLen) {
+    if (!nextSlot(ps, avail)) {
+      ps->hTime = millis();
+      return mjpegData;
     }
-    checkMemory();
-    LOG_INF("*************************************\n");
-    setFPS(saveFPS); // realign with browser
-    stopPlayback = isPlaying = false;
-    mjpegData.buffLen = mjpegData.buffOffset = 0; // signal end of jpeg
-  }
-  hTime = millis();
-  delay(1);
+  }
+  uint32_t mTime = millis();
+  uint8_t* buff = slotBuff(ps, ps->slot);
+  size_t slotEnd = CHUNK_HDR + ps->slot->len;
+  if (ps->skipLen) {
+    // pass over rest of skipped chunk in this slot
+    size_t skipLen = std::min(ps->skipLen, slotEnd - ps->buffOffset);
+    ps->buffOffset += skipLen;
+    ps->skipLen -= skipLen;
+  } else if (!ps->remainingFrame) {
+    // at start of chunk
+    uint32_t chunkLen;
+    uint8_t chunkType = parseAviChunk(buff + ps->buffOffset, ps->isOdml, &chunkLen);
+    if (chunkType == AVI_AUDIO || chunkType == AVI_JUNK || chunkType == AVI_INDEX || chunkType == AVI_SEGMENT) {
+      // skip over interleaved audio or recording tag, or idx1 and header of next OpenDML segment
+      ps->skipLen = chunkLen;
+    } else if (chunkType == AVI_END) {
+      // reached end of frames to stream
+      ps->stopping = ps->completed = true;
+    } else if (ps->isLive && ps->slot->filePos + ps->buffOffset - CHUNK_HDR + chunkLen > aviRec.writtenPos) {
+      // only start frame once recording has written all of it
+      if (!liveRec) ps->stopping = ps->completed = true;
+      else delay(ps->frameUs / 1000);
+    } else {
+      // get jpeg frame size
+      if (ps->seekFrame) ps->seekFrame = false;
+      else ps->frameIdx++;
+      uint32_t jpegSize;
+      memcpy(&jpegSize, buff + ps->buffOffset + 4, 4);
+      ps->remainingFrame = jpegSize;
+      ps->vidSize += jpegSize;
+      ps->buffOffset += CHUNK_HDR; // skip over marker
+      mjpegData.jpegSize = jpegSize; // signal start of jpeg to webServer
+      ps->fTimeTot += millis() - mTime;
+      mTime = millis();
+      // wait for rate control
+      paceFrame(ps);
+      LOG_VRB("frame timer wait %lu ms", millis() - mTime);
+      ps->tTimeTot += millis() - mTime;
+      ps->frameCnt++;
+      if (ps == playSess) showProgress();
+      // an empty frame sends nothing, so browser keeps showing previous frame for this interval
+    }
+  }
+  if (ps->remainingFrame) {
+    // send as much of jpeg as is in this slot, directly from ring
+    mjpegData.buff = buff;
+    mjpegData.buffOffset = ps->buffOffset;
+    mjpegData.buffLen = std::min(ps->remainingFrame, slotEnd - ps->buffOffset);
+    ps->remainingFrame -= mjpegData.buffLen;
+    ps->buffOffset += mjpegData.buffLen;
+  }
+  ps->hTime = millis();
   return mjpegData;
 }
 
 void stopPlaying() {
-  if (isPlaying) {
-    // force stop any currently running playback
-    stopPlayback = true;
-    // wait till stopped cleanly, but prevent infinite loop
-    uint32_t timeOut = millis();
-    while (doPlayback && millis() - timeOut < MAX_FRAME_WAIT) delay(10);
-    if (doPlayback) {
-      // not yet closed, so force close
-      logLine();
-      LOG_WRN("Force closed playback");
-      doPlayback = false; // stop webserver playback
-      setFPS(saveFPS);
-      xSemaphoreGive(playbackSemaphore);
-      xSemaphoreGive(readSemaphore);
-      delay(200);
-    }
-    stopPlayback = false;
-    isPlaying = false;
+  // stop all playback sessions, eg when recording starts
+  if (!activeSessions()) return;
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) if (playSess[i].inUse) playSess[i].stopping = true;
+  // wait till stopped cleanly, but prevent infinite loop
+  uint32_t timeOut = millis();
+  while (activeSessions() && millis() - timeOut < MAX_FRAME_WAIT) delay(10);
+  if (activeSessions()) {
+    logLine();
+    LOG_WRN("Playback sessions not yet closed");
   }
 }
 
 static void playbackTask(void* parameter) {
+  // fill read ahead rings, one block per session in turn while any has space
+  // woken when a session releases a block or makes a request, or to retry live read
   while (true) {
-    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-    readSD();
+    uint32_t waitMs = portMAX_DELAY;
+    bool anyFilled = true;
+    while (anyFilled) {
+      anyFilled = false;
+      for (int i = 0; i < MAX_PLAY_SESSIONS; i++) {
+        uint8_t res = fillSlot(playSess + i);
+        if (res == FILL_DONE) anyFilled = true;
+        else if (res == FILL_WAIT) waitMs = std::min(waitMs, std::max(playSess[i].frameUs / 1000, (uint32_t)1));
+      }
+    }
+    ulTaskNotifyTake(pdTRUE, waitMs == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(waitMs));
   }
   vTaskDelete(NULL);
 }
@@ -738,6 +2478,11 @@ static void playbackTask(void* parameter) {
 static bool startSDtasks() {
   // tasks to manage SD card operation
   xTaskCreateWithCaps(&playbackTask, "playbackTask", PLAYBACK_STACK_SIZE, NULL, PLAY_PRI, &playbackHandle, STACK_MEM);
+  xTaskCreateWithCaps(&sdWriteTask, "sdWriteTask", SDWRITE_STACK_SIZE, NULL, SDWRITE_PRI, &sdWriteHandle, STACK_MEM);
+  if ((fs::LittleFSFS*)&STORAGE != &LittleFS) {
+    xTaskCreateWithCaps(&aviPoolTask, "aviPoolTask", POOL_STACK_SIZE, NULL, POOL_PRI, &aviPoolHandle, STACK_MEM);
+    if (aviPoolHandle != NULL) xTaskNotifyGive(aviPoolHandle); // prepare initial pool files
+  }
   xTaskCreate(&captureTask, "captureTask", CAPTURE_STACK_SIZE, NULL, CAPTURE_PRI, &captureHandle);
   if (captureHandle == NULL) {
     // Usually insufficient memory
@@ -754,12 +2499,11 @@ static bool startSDtasks() {
 
 bool prepRecording() {
   // initialisation & prep for AVI capture
-  readSemaphore = xSemaphoreCreateBinary();
-  playbackSemaphore = xSemaphoreCreateBinary();
   aviMutex = xSemaphoreCreateMutex();
   motionSemaphore = xSemaphoreCreateBinary();
   for (int i = 0; i < vidStreams; i++) frameSemaphore[i] = xSemaphoreCreateBinary();
   reloadConfigs(); // apply camera config
+  recoverAvi(); // before pool task checks pool files
   if (!startSDtasks()) return false;
 #if INCLUDE_TINYML
   LOG_INF("%sUsing TinyML", mlUse ? "" : "Not ");
@@ -794,6 +2538,9 @@ bool prepRecording() {
 
 void appShutdown() {
   timeLapse(NULL, true);
+  // allow SD write task to complete queued actions
+  uint32_t timeOut = millis();
+  while (sdQueueDepth() && millis() - timeOut < MAX_FRAME_WAIT * 5) delay(10);
 }
 
 static void deleteTask(TaskHandle_t& thisTaskHandle) {
@@ -804,8 +2551,12 @@ static void deleteTask(TaskHandle_t& thisTaskHandle) {
 
 void endTasks() {
   for (int i = 0; i < numStreams; i++) deleteTask(sustainHandle[i]);
+  for (int i = MAX_STREAMS; i < MAX_SUSTAIN; i++) deleteTask(sustainHandle[i]);
+  deleteTask(subStreamHandle);
   deleteTask(captureHandle);
   deleteTask(playbackHandle);
+  deleteTask(sdWriteHandle);
+  deleteTask(aviPoolHandle);
 #if INCLUDE_TELEM
   deleteTask(telemetryHandle);
 #endif
@@ -909,7 +2660,7 @@ static esp_err_t changeXCLK(camera_config_t config) {
 bool prepCam() {
   // initialise camera depending on model and board
   if (FRAMESIZE_INVALID != sizeof(frameData) / sizeof(frameData[0]))
-    LOG_ERR("framesize_t entries %d != frameData entries %d", FRAMESIZE_INVALID, sizeof(frameData) / sizeof(frameData[0]));
+    LOG_ERR("framesize_t entries %d != frameData entries %zu", FRAMESIZE_INVALID, sizeof(frameData) / sizeof(frameData[0]));
   if (!camPower()) return false;
 #if INCLUDE_I2C
   if (shareI2C(SIOD_GPIO_NUM, SIOC_GPIO_NUM)) {
@@ -1058,16 +2809,7 @@ bool prepCam() {
       fb = NULL;
       res = true;
       LOG_INF("Camera model %s ready @ %uMHz", camModel, xclkMhz);
-      if (timeLapseOn) dashCamOn = 0;
-      if (dashCamOn) {
-        timeLapseOn = useMotion = false; // disable timeLapse and motion recording
-        frameLimit = FPS * dashCamOn * 60; // frameLimit is not changed if FPS later changed without restart
-        if (frameLimit > maxFrames) {
-          frameLimit = maxFrames;
-          LOG_WRN("Max continuous recording time interval is %d mins", frameLimit / FPS / 60);
-        } else LOG_INF("Do continuous recording at %d min intervals", dashCamOn);
-        forceRecord = true;
-      } else frameLimit = maxFrames;
+      prepRecSessions();
     }
   }
   debugMemory("prepCam");
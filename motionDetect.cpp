@@ -362,6 +362,48 @@ bool checkMotion(camera_fb_t* fb, bool motionStatus, bool lightLevelOnly) {
   return nightTime ? false : motionStatus;
 }
 
+// The motion bitmap is overwritten by checkMotion() on the capture task, so it is copied there
+// when a recording closes, and the copy handed to the SD task to encode once the avi is saved.
+static uint8_t* thumbRgb = NULL;
+static bool thumbSnapped = false; // thumbRgb owned by SD task until encoded or dropped
+
+void snapMotionThumb() {
+  // on capture task, copy latest motion bitmap for thumbnail of closing recording
+  size_t thumbLen = RESIZE_DIM_SQ * RGB888_BYTES;
+  if (__atomic_load_n(&thumbSnapped, __ATOMIC_ACQUIRE)) return; // previous copy not yet encoded
+  if (currBuff == NULL || fsizePtr > FRAMESIZE_SXGA) return; // no bitmap for this frame size
+  if (thumbRgb == NULL) thumbRgb = (uint8_t*)ps_malloc(thumbLen);
+  if (thumbRgb == NULL) return;
+  // grayscale bitmap expanded to rgb for encoder
+  for (size_t i = 0; i < RESIZE_DIM_SQ; i++) 
+    for (int j = 0; j < RGB888_BYTES; j++) thumbRgb[(i * RGB888_BYTES) + j] = currBuff[(i * colorDepth) + (colorDepth == RGB888_BYTES ? j : 0)];
+  __atomic_store_n(&thumbSnapped, true, __ATOMIC_RELEASE);
+}
+
+void dropMotionThumb() {
+  // on SD task, return bitmap copy to capture task if not used
+  __atomic_store_n(&thumbSnapped, false, __ATOMIC_RELEASE);
+}
+
+uint8_t* motionThumb(size_t* jpgLen) {
+  // encode motion bitmap copied at recording close as small jpeg, used as recording thumbnail
+  // called from SD task, so uses fmt2jpg() rather than encoder kept open by checkMotion()
+  static uint8_t* thumbJpeg = NULL;
+  size_t thumbLen = RESIZE_DIM_SQ * RGB888_BYTES;
+  *jpgLen = 0;
+  if (!__atomic_load_n(&thumbSnapped, __ATOMIC_ACQUIRE)) return NULL; // no copy for this recording
+  if (thumbJpeg == NULL) thumbJpeg = (uint8_t*)ps_malloc(thumbLen);
+  if (thumbJpeg == NULL) return NULL;
+  uint8_t* jpg_buf = NULL;
+  if (fmt2jpg(thumbRgb, thumbLen, RESIZE_DIM, RESIZE_DIM, PIXFORMAT_RGB888, JPEG_QUAL, &jpg_buf, jpgLen) && *jpgLen <= thumbLen)
+    memcpy(thumbJpeg, jpg_buf, *jpgLen);
+  else *jpgLen = 0;
+  free(jpg_buf);
+  dropMotionThumb();
+  if (!*jpgLen) LOG_WRN("Failed to encode thumbnail");
+  return thumbJpeg;
+}
+
 /*****************************************************************************************************/
 
 #if INCLUDE_NEW_JPG
@@ -0,0 +1,497 @@
+/*
+Remux recorded AVI to fragmented MP4 on the fly, for download
+
+Jpeg frames and pcm audio are copied unchanged from the avi chunks, so no re-encoding.
+Memory use is constant, as the file is output one fragment at a time:
+ init segment:
+  ftyp
+  moov, with a video track of jpeg samples, and an audio track of 16 bit pcm if recorded
+ per fragment, of up to one second of frames:
+  moof, with sample sizes and durations for each track
+  mdat, with the fragment jpegs followed by its pcm
+An empty avi frame extends the duration of the preceding jpeg sample.
+Sample details are obtained from the avi chunk headers, using the avi demux,
+so they are available for all OpenDML segments, not just those in idx1.
+Each remux holds its state in its own mp4Session, so concurrent downloads are independent.
+*/
+
+#include "appGlobals.h"
+
+#define MP4_FRAG_FRAMES 64 // max jpeg samples per fragment
+#define MP4_FRAG_AUDIO 16 // max pcm chunks per fragment
+#define MP4_HDR_LEN 2048 // largest of init segment and fragment header
+#define VID_TRACK 1
+#define AUD_TRACK 2
+
+struct mp4Sample {
+  size_t filePos; // avi position of content
+  uint32_t dataSize;
+  uint32_t duration; // in track timescale
+};
+
+struct mp4Session {
+  aviSource src;
+  size_t scanPos; // avi position of next chunk to be scanned
+  bool mp4Done;
+  // track details from avi header
+  uint32_t vidScale, vidRate; // frame duration is vidScale / vidRate secs
+  uint16_t vidWidth, vidHeight;
+  uint32_t audRate; // 0 if no audio
+  uint16_t audChannels;
+  uint32_t audStart; // in samples
+  // current fragment
+  mp4Sample vidSamples[MP4_FRAG_FRAMES];
+  mp4Sample audChunks[MP4_FRAG_AUDIO];
+  uint8_t vidCnt, audCnt;
+  uint32_t vidBytes, audBytes;
+  uint64_t vidTime, audTime; // decode time of fragment start
+  uint32_t fragSeq;
+  // output state
+  uint8_t mp4Hdr[MP4_HDR_LEN];
+  size_t hdrLen, hdrSent;
+  uint8_t copyIdx; // sample being copied to mdat, jpegs then pcm
+  size_t copyDone; // bytes of sample copied
+};
+
+/************** box construction **************/
+
+static void put32(mp4Session* mr, uint32_t val) {
+  // big endian
+  mr->mp4Hdr[mr->hdrLen++] = val >> 24;
+  mr->mp4Hdr[mr->hdrLen++] = val >> 16;
+  mr->mp4Hdr[mr->hdrLen++] = val >> 8;
+  mr->mp4Hdr[mr->hdrLen++] = val;
+}
+
+static void put16(mp4Session* mr, uint16_t val) {
+  mr->mp4Hdr[mr->hdrLen++] = val >> 8;
+  mr->mp4Hdr[mr->hdrLen++] = val;
+}
+
+static void put8(mp4Session* mr, uint8_t val) {
+  mr->mp4Hdr[mr->hdrLen++] = val;
+}
+
+static void put64(mp4Session* mr, uint64_t val) {
+  put32(mr, val >> 32);
+  put32(mr, (uint32_t)val);
+}
+
+static void putType(mp4Session* mr, const char* boxType) {
+  memcpy(mr->mp4Hdr + mr->hdrLen, boxType, 4);
+  mr->hdrLen += 4;
+}
+
+static void putZero(mp4Session* mr, size_t len) {
+  memset(mr->mp4Hdr + mr->hdrLen, 0, len);
+  mr->hdrLen += len;
+}
+
+static void patch32(mp4Session* mr, size_t pos, uint32_t val) {
+  // overwrite value at pos, once known
+  size_t savedLen = mr->hdrLen;
+  mr->hdrLen = pos;
+  put32(mr, val);
+  mr->hdrLen = savedLen;
+}
+
+static size_t openBox(mp4Session* mr, const char* boxType) {
+  // start box, returning its position for closeBox(mr)
+  size_t boxPos = mr->hdrLen;
+  put32(mr, 0);
+  putType(mr, boxType);
+  return boxPos;
+}
+
+static size_t openFullBox(mp4Session* mr, const char* boxType, uint8_t version, uint32_t flags) {
+  size_t boxPos = openBox(mr, boxType);
+  put32(mr, (uint32_t)version << 24 | flags);
+  return boxPos;
+}
+
+static void closeBox(mp4Session* mr, size_t boxPos) {
+  // box size now known
+  patch32(mr, boxPos, mr->hdrLen - boxPos);
+}
+
+static void putMatrix(mp4Session* mr) {
+  // unity transformation matrix
+  const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+  for (const auto& val : matrix) put32(mr, val);
+}
+
+/************** init segment **************/
+
+static void putTrack(mp4Session* mr, uint32_t trackId, bool isVid) {
+  // track with empty sample tables, as samples are described in fragments
+  size_t trak = openBox(mr, "trak");
+  size_t box = openFullBox(mr, "tkhd", 0, 3); // enabled, in movie
+  putZero(mr, 8); // creation & modification times
+  put32(mr, trackId);
+  putZero(mr, 4 + 4 + 8); // reserved, duration, reserved
+  putZero(mr, 4); // layer, alternate group
+  put16(mr, isVid ? 0 : 0x0100); // volume
+  putZero(mr, 2);
+  putMatrix(mr);
+  put32(mr, isVid ? (uint32_t)mr->vidWidth << 16 : 0);
+  put32(mr, isVid ? (uint32_t)mr->vidHeight << 16 : 0);
+  closeBox(mr, box);
+
+  size_t mdia = openBox(mr, "mdia");
+  box = openFullBox(mr, "mdhd", 0, 0);
+  putZero(mr, 8); // creation & modification times
+  put32(mr, isVid ? mr->vidRate : mr->audRate); // timescale
+  put32(mr, 0); // duration
+  put16(mr, 0x55C4); // language und
+  put16(mr, 0);
+  closeBox(mr, box);
+  box = openFullBox(mr, "hdlr", 0, 0);
+  put32(mr, 0);
+  putType(mr, isVid ? "vide" : "soun");
+  putZero(mr, 12);
+  const char* handlerName = isVid ? "VideoHandler" : "SoundHandler";
+  memcpy(mr->mp4Hdr + mr->hdrLen, handlerName, strlen(handlerName) + 1);
+  mr->hdrLen += strlen(handlerName) + 1;
+  closeBox(mr, box);
+
+  size_t minf = openBox(mr, "minf");
+  if (isVid) {
+    box = openFullBox(mr, "vmhd", 0, 1);
+    putZero(mr, 8); // graphics mode, opcolor
+  } else {
+    box = openFullBox(mr, "smhd", 0, 0);
+    putZero(mr, 4); // balance
+  }
+  closeBox(mr, box);
+  size_t dinf = openBox(mr, "dinf");
+  box = openFullBox(mr, "dref", 0, 0);
+  put32(mr, 1);
+  closeBox(mr, openFullBox(mr, "url ", 0, 1)); // media in same file
+  closeBox(mr, box);
+  closeBox(mr, dinf);
+
+  size_t stbl = openBox(mr, "stbl");
+  size_t stsd = openFullBox(mr, "stsd", 0, 0);
+  put32(mr, 1);
+  if (isVid) {
+    // jpeg as MPEG-4 visual sample entry
+    size_t entry = openBox(mr, "mp4v");
+    putZero(mr, 6);
+    put16(mr, 1); // data reference index
+    putZero(mr, 16);
+    put16(mr, mr->vidWidth);
+    put16(mr, mr->vidHeight);
+    put32(mr, 0x00480000); // 72 dpi
+    put32(mr, 0x00480000);
+    put32(mr, 0);
+    put16(mr, 1); // frame count
+    putZero(mr, 32); // compressor name
+    put16(mr, 0x0018); // depth
+    put16(mr, 0xFFFF);
+    box = openFullBox(mr, "esds", 0, 0);
+    put8(mr, 0x03); // ES descriptor
+    put8(mr, 21);
+    put16(mr, VID_TRACK);
+    put8(mr, 0);
+    put8(mr, 0x04); // decoder config descriptor
+    put8(mr, 13);
+    put8(mr, 0x6C); // object type jpeg
+    put8(mr, 0x11); // visual stream
+    putZero(mr, 3 + 4 + 4); // buffer size, max & avg bitrate
+    put8(mr, 0x06); // SL config descriptor
+    put8(mr, 1);
+    put8(mr, 0x02);
+    closeBox(mr, box);
+    closeBox(mr, entry);
+  } else {
+    // little endian 16 bit pcm
+    size_t entry = openBox(mr, "sowt");
+    putZero(mr, 6);
+    put16(mr, 1); // data reference index
+    putZero(mr, 8);
+    put16(mr, mr->audChannels);
+    put16(mr, 16); // sample size
+    putZero(mr, 4);
+    put32(mr, mr->audRate << 16);
+    closeBox(mr, entry);
+  }
+  closeBox(mr, stsd);
+  const char* emptyTables[4] = {"stts", "stsc", "stsz", "stco"};
+  for (const auto& table : emptyTables) {
+    box = openFullBox(mr, table, 0, 0);
+    if (!strcmp(table, "stsz")) put32(mr, 0); // sample size
+    put32(mr, 0); // entry count
+    closeBox(mr, box);
+  }
+  closeBox(mr, stbl);
+  closeBox(mr, minf);
+  closeBox(mr, mdia);
+  closeBox(mr, trak);
+}
+
+static void buildInitSegment(mp4Session* mr) {
+  // ftyp and moov boxes
+  mr->hdrLen = mr->hdrSent = 0;
+  size_t box = openBox(mr, "ftyp");
+  putType(mr, "isom");
+  put32(mr, 0x200);
+  putType(mr, "isom");
+  putType(mr, "iso5");
+  putType(mr, "mp41");
+  closeBox(mr, box);
+
+  size_t moov = openBox(mr, "moov");
+  box = openFullBox(mr, "mvhd", 0, 0);
+  putZero(mr, 8); // creation & modification times
+  put32(mr, 1000); // timescale
+  put32(mr, 0); // duration, from fragments
+  put32(mr, 0x00010000); // rate
+  put16(mr, 0x0100); // volume
+  putZero(mr, 10);
+  putMatrix(mr);
+  putZero(mr, 24);
+  put32(mr, mr->audRate ? AUD_TRACK + 1 : VID_TRACK + 1); // next track id
+  closeBox(mr, box);
+  putTrack(mr, VID_TRACK, true);
+  if (mr->audRate) putTrack(mr, AUD_TRACK, false);
+  size_t mvex = openBox(mr, "mvex");
+  for (uint32_t trackId = VID_TRACK; trackId <= (mr->audRate ? AUD_TRACK : VID_TRACK); trackId++) {
+    box = openFullBox(mr, "trex", 0, 0);
+    put32(mr, trackId);
+    put32(mr, 1); // sample description index
+    putZero(mr, 12); // default duration, size, flags
+    closeBox(mr, box);
+  }
+  closeBox(mr, mvex);
+  closeBox(mr, moov);
+}
+
+/************** fragments **************/
+
+static bool scanFragment(mp4Session* mr) {
+  // collect samples for next fragment from avi chunk headers
+  // fragment ends before a jpeg, so any following empty frames extend its last sample
+  mr->vidCnt = mr->audCnt = 0;
+  mr->vidBytes = mr->audBytes = 0;
+  uint32_t fragFrames = std::min(std::max(mr->vidRate / mr->vidScale, (uint32_t)1), (uint32_t)MP4_FRAG_FRAMES);
+  uint32_t chunkLen;
+  uint8_t chunkType;
+  while ((chunkType = nextAviChunk(&mr->src, mr->scanPos, &chunkLen)) != AVI_END) {
+    uint32_t dataSize = chunkLen - CHUNK_HDR;
+    if (chunkType == AVI_VIDEO) {
+      if (!dataSize) {
+        // empty frame repeats previous jpeg
+        if (mr->vidCnt) mr->vidSamples[mr->vidCnt - 1].duration += mr->vidScale;
+        else mr->vidTime += mr->vidScale; // before first jpeg
+      } else {
+        if (mr->vidCnt >= fragFrames || mr->audCnt >= MP4_FRAG_AUDIO) break;
+        mr->vidSamples[mr->vidCnt++] = {mr->scanPos + CHUNK_HDR, dataSize, mr->vidScale};
+        mr->vidBytes += dataSize;
+      }
+    } else if (chunkType == AVI_AUDIO) {
+      if (mr->audCnt >= MP4_FRAG_AUDIO) break;
+      if (mr->audRate && dataSize) {
+        mr->audChunks[mr->audCnt++] = {mr->scanPos + CHUNK_HDR, dataSize, dataSize / (mr->audChannels * 2)};
+        mr->audBytes += dataSize;
+      }
+    } // recording tags, idx1 and segment headers skipped
+    mr->scanPos += chunkLen;
+  }
+  return mr->vidCnt || mr->audCnt;
+}
+
+static void buildFragment(mp4Session* mr) {
+  // moof box for collected samples, and mdat header
+  mr->hdrLen = mr->hdrSent = 0;
+  size_t moof = openBox(mr, "moof");
+  size_t box = openFullBox(mr, "mfhd", 0, 0);
+  put32(mr, ++mr->fragSeq);
+  closeBox(mr, box);
+  size_t vidOffsetPos = 0, audOffsetPos = 0;
+  if (mr->vidCnt) {
+    size_t traf = openBox(mr, "traf");
+    box = openFullBox(mr, "tfhd", 0, 0x020000); // default base is moof
+    put32(mr, VID_TRACK);
+    closeBox(mr, box);
+    box = openFullBox(mr, "tfdt", 1, 0);
+    put64(mr, mr->vidTime);
+    closeBox(mr, box);
+    box = openFullBox(mr, "trun", 0, 0x000301); // data offset, sample durations and sizes
+    put32(mr, mr->vidCnt);
+    vidOffsetPos = mr->hdrLen;
+    put32(mr, 0);
+    for (uint8_t i = 0; i < mr->vidCnt; i++) {
+      put32(mr, mr->vidSamples[i].duration);
+      put32(mr, mr->vidSamples[i].dataSize);
+      mr->vidTime += mr->vidSamples[i].duration;
+    }
+    closeBox(mr, box);
+    closeBox(mr, traf);
+  }
+  if (mr->audCnt) {
+    // pcm as one run of fixed size samples
+    uint32_t sampleSize = mr->audChannels * 2;
+    size_t traf = openBox(mr, "traf");
+    box = openFullBox(mr, "tfhd", 0, 0x020018); // default base is moof, default duration and size
+    put32(mr, AUD_TRACK);
+    put32(mr, 1);
+    put32(mr, sampleSize);
+    closeBox(mr, box);
+    box = openFullBox(mr, "tfdt", 1, 0);
+    put64(mr, mr->audTime);
+    closeBox(mr, box);
+    box = openFullBox(mr, "trun", 0, 0x000001); // data offset
+    put32(mr, mr->audBytes / sampleSize);
+    audOffsetPos = mr->hdrLen;
+    put32(mr, 0);
+    closeBox(mr, box);
+    closeBox(mr, traf);
+    mr->audTime += mr->audBytes / sampleSize;
+  }
+  closeBox(mr, moof);
+  // data offsets from start of moof to content in mdat
+  size_t moofSize = mr->hdrLen - moof;
+  if (mr->vidCnt) patch32(mr, vidOffsetPos, moofSize + CHUNK_HDR);
+  if (mr->audCnt) patch32(mr, audOffsetPos, moofSize + CHUNK_HDR + mr->vidBytes);
+  put32(mr, CHUNK_HDR + mr->vidBytes + mr->audBytes);
+  putType(mr, "mdat");
+  mr->copyIdx = 0;
+  mr->copyDone = 0;
+}
+
+/************** remux **************/
+
+static bool readAviTracks(mp4Session* mr) {
+  // get track details from avi stream headers
+  uint8_t aviHdr[AVI_HEADER_LEN];
+  bool isOdml;
+  size_t moviPos = findAviMovi(&mr->src, &isOdml);
+  size_t aviHdrLen = mr->src.readAt(mr->src.ctx, 0, aviHdr, std::min(moviPos, sizeof(aviHdr)));
+  // walk chunks within hdrl, stepping into lists
+  size_t pos = 12;
+  uint32_t streams = 0, strhCnt = 0;
+  uint8_t strhType = 0; // 1 vids, 2 auds, for following strf
+  while (pos + CHUNK_HDR <= aviHdrLen) {
+    uint32_t chunkSize;
+    memcpy(&chunkSize, aviHdr + pos + 4, 4);
+    const uint8_t* chunkData = aviHdr + pos + CHUNK_HDR;
+    if (!memcmp(aviHdr + pos, "LIST", 4)) {
+      pos += 12;
+      continue;
+    }
+    if (pos + CHUNK_HDR + chunkSize > aviHdrLen) break;
+    if (!memcmp(aviHdr + pos, "avih", 4) && chunkSize >= 28) memcpy(&streams, chunkData + 24, 4);
+    else if (!memcmp(aviHdr + pos, "strh", 4) && chunkSize >= 36) {
+      // audio stream header is present but unused if no audio recorded
+      strhType = !memcmp(chunkData, "vids", 4) ? 1 : !memcmp(chunkData, "auds", 4) ? 2 : 0;
+      if (++strhCnt > streams) strhType = 0;
+      if (strhType == 1) {
+        memcpy(&mr->vidScale, chunkData + 20, 4);
+        memcpy(&mr->vidRate, chunkData + 24, 4);
+      } else if (strhType == 2) memcpy(&mr->audStart, chunkData + 28, 4);
+    } else if (!memcmp(aviHdr + pos, "strf", 4)) {
+      if (strhType == 1 && chunkSize >= 12) {
+        int32_t biWidth, biHeight;
+        memcpy(&biWidth, chunkData + 4, 4);
+        memcpy(&biHeight, chunkData + 8, 4);
+        mr->vidWidth = biWidth;
+        mr->vidHeight = abs(biHeight);
+      } else if (strhType == 2 && chunkSize >= 16) {
+        uint16_t formatTag, bitsPerSample;
+        memcpy(&formatTag, chunkData, 2);
+        memcpy(&mr->audChannels, chunkData + 2, 2);
+        memcpy(&mr->audRate, chunkData + 4, 4);
+        memcpy(&bitsPerSample, chunkData + 14, 2);
+        if (formatTag != 1 || bitsPerSample != 16 || !mr->audChannels) mr->audRate = 0; // only 16 bit pcm
+      }
+      strhType = 0;
+    }
+    pos += CHUNK_HDR + chunkSize + (chunkSize & 1);
+  }
+  mr->scanPos = moviPos;
+  return mr->vidScale && mr->vidRate;
+}
+
+mp4Session* openMp4Remux(const aviSource* src) {
+  // prepare remux of avi from given source, with state held for this remux only
+  // returns NULL if not a recognised avi, otherwise closeMp4Remux() when done
+  mp4Session* mr = psramFound() ? (mp4Session*)ps_malloc(sizeof(mp4Session)) : (mp4Session*)malloc(sizeof(mp4Session));
+  if (mr == NULL) return NULL;
+  memset(mr, 0, sizeof(mp4Session));
+  mr->src = *src;
+  if (!readAviTracks(mr)) {
+    free(mr);
+    return NULL;
+  }
+  mr->audTime = mr->audStart;
+  buildInitSegment(mr);
+  return mr;
+}
+
+void closeMp4Remux(mp4Session* mr) {
+  free(mr);
+}
+
+uint32_t mp4Fragments(const mp4Session* mr) {
+  // fragments output so far
+  return mr->fragSeq;
+}
+
+size_t remuxMp4(mp4Session* mr, uint8_t* clientBuf, size_t buffSize) {
+  // provide next part of mp4 into clientBuf, called repeatedly until returns 0
+  size_t buffLen = 0;
+  while (buffLen < buffSize && !mr->mp4Done) {
+    if (mr->hdrSent < mr->hdrLen) {
+      // init segment, or moof and mdat header
+      size_t partLen = std::min(mr->hdrLen - mr->hdrSent, buffSize - buffLen);
+      memcpy(clientBuf + buffLen, mr->mp4Hdr + mr->hdrSent, partLen);
+      mr->hdrSent += partLen;
+      buffLen += partLen;
+    } else if (mr->copyIdx < mr->vidCnt + mr->audCnt) {
+      // mdat content, read directly from avi
+      const mp4Sample* sample = mr->copyIdx < mr->vidCnt ? mr->vidSamples + mr->copyIdx : mr->audChunks + mr->copyIdx - mr->vidCnt;
+      size_t partLen = std::min(sample->dataSize - mr->copyDone, buffSize - buffLen);
+      size_t readLen = mr->src.readAt(mr->src.ctx, sample->filePos + mr->copyDone, clientBuf + buffLen, partLen);
+      if (readLen != partLen) {
+        LOG_WRN("Failed to read avi content at %zu for mp4", sample->filePos + mr->copyDone);
+        mr->mp4Done = true;
+      }
+      buffLen += readLen;
+      mr->copyDone += readLen;
+      if (mr->copyDone >= sample->dataSize) {
+        mr->copyIdx++;
+        mr->copyDone = 0;
+      }
+    } else if (scanFragment(mr)) buildFragment(mr);
+    else mr->mp4Done = true;
+  }
+  return buffLen;
+}
+
+esp_err_t sendMp4(File& df, httpd_req_t* req) {
+  // remux avi file and send to browser using chunked encoding
+  uint8_t* mp4Chunk = psramFound() ? (uint8_t*)ps_malloc(CHUNKSIZE) : (uint8_t*)malloc(CHUNKSIZE);
+  aviSource src = {readAviFile, &df, df.size()};
+  mp4Session* mr = mp4Chunk == NULL ? NULL : openMp4Remux(&src);
+  esp_err_t res = ESP_OK;
+  if (mr == NULL) {
+    LOG_WRN("Unable to remux %s as mp4", df.name());
+    res = ESP_FAIL;
+  } else {
+    uint32_t mTime = millis();
+    size_t mp4Len = 0, chunkLen;
+    while ((chunkLen = remuxMp4(mr, mp4Chunk, CHUNKSIZE))) {
+      res = httpd_resp_send_chunk(req, (char*)mp4Chunk, chunkLen);
+      if (res != ESP_OK) break;
+      mp4Len += chunkLen;
+    }
+    if (res == ESP_OK) LOG_INF("Remuxed %s as %lu mp4 fragments, %s in %lu ms",
+      df.name(), mp4Fragments(mr), fmtSize(mp4Len), millis() - mTime);
+    else LOG_WRN("Failed to send mp4 to browser: %s, err %s", df.name(), espErrMsg(res));
+    closeMp4Remux(mr);
+  }
+  free(mp4Chunk);
+  df.close();
+  httpd_resp_sendstr_chunk(req, NULL);
+  return res;
+}
@@ -83,16 +83,21 @@ RTSPServer::TransportType determineTransportType() {
 static void sendRTSPVideo(void* p) {
   // Send jpeg frames via RTSP at current frame rate
   uint8_t taskNum = 1;
-  streamBufferSize[taskNum] = 0;
   while (true) {
     if (frameSemaphore[taskNum] != NULL) {
-      if (xSemaphoreTake(frameSemaphore[taskNum], pdMS_TO_TICKS(MAX_FRAME_WAIT)) == pdTRUE) {
-        if (streamBufferSize[taskNum] && rtspServer.readyToSendFrame()) {
-          // use frame stored by processFrame()
-          rtspServer.sendRTSPFrame(streamBuffer[taskNum], streamBufferSize[taskNum], quality, frameData[fsizePtr].frameWidth, frameData[fsizePtr].frameHeight);
-        }
+      if (subStream && subStreamHandle != NULL) {
+        // reduced resolution substream
+        subFrame sub = waitSubFrame(MAX_FRAME_WAIT);
+        if (sub.buf != NULL && rtspServer.readyToSendFrame()) 
+          rtspServer.sendRTSPFrame(sub.buf, sub.len, quality, sub.width, sub.height);
+        free(sub.buf);
+      } else {
+        // use camera frame shared by processFrame()
+        frameRef* ref = waitStreamFrame(taskNum, MAX_FRAME_WAIT);
+        if (ref != NULL && rtspServer.readyToSendFrame()) 
+          rtspServer.sendRTSPFrame(ref->fb->buf, ref->fb->len, quality, ref->fb->width, ref->fb->height);
+        releaseFrame(ref);
       }
-      streamBufferSize[taskNum] = 0; 
     } else delay(100);
   }
   vTaskDelete(NULL);
@@ -1,9 +1,10 @@
 // streamServer handles streaming, playback, file downloads
 // each sustained activity uses a separate task if available
 // - web streaming, playback, file downloads use task 0
-// - video streaming uses task 1
+// - video streaming uses task 1, optionally as reduced resolution substream
 // - audio streaming uses task 2
 // - subtitle streaming uses task 3
+// - further concurrent playbacks use tasks from MAX_STREAMS, up to playSessions in total
 //
 // s60sc 2022 - 2025
 
@@ -20,26 +21,29 @@ static bool forcePlayback = false; // browser playback status
 bool streamVid = false;
 bool streamAud = false;
 bool streamSrt = false;
-static bool isStreaming[MAX_STREAMS] = {false};
-size_t streamBufferSize[MAX_STREAMS] = {0};
-byte* streamBuffer[MAX_STREAMS] = {NULL}; // buffer for stream frame
+bool mp4Remux = false;
+static bool isStreaming[MAX_SUSTAIN] = {false};
 static char variable[FILE_NAME_LEN]; 
 static char value[FILE_NAME_LEN];
 uint16_t sustainId = 0;
 uint8_t numStreams = 1;
 uint8_t vidStreams = 1;
 int srtInterval = 1; // subtitle interval in secs
+int subStream = 0; // video stream resolution: 0 full, 1 quarter, 2 eighth
+TaskHandle_t subStreamHandle = NULL;
 
 #ifndef AUXILIARY
 
-TaskHandle_t sustainHandle[MAX_STREAMS]; 
+TaskHandle_t sustainHandle[MAX_SUSTAIN]; 
 struct httpd_sustain_req_t {
   httpd_req_t* req = NULL;
   uint8_t taskNum; 
   char activity[16];
+  char fileName[IN_FILE_NAME_LEN]; // file selected when playback requested
+  bool isLive = false; // playback of recording in progress
   bool inUse = false; 
 };
-httpd_sustain_req_t sustainReq[MAX_STREAMS];
+httpd_sustain_req_t sustainReq[MAX_SUSTAIN];
 
 #if INCLUDE_RTSP
 static const bool includeRTSP = true;
@@ -47,58 +51,132 @@ static const bool includeRTSP = true;
 static const bool includeRTSP = false;
 #endif
 
-static void showPlayback(httpd_req_t* req) {
-  // output playback file to browser
+/**************** substream ************************/
+
+// Optional reduced resolution video stream for NVR (task 1) or RTSP video.
+// The substream task takes the camera frames shared with stream 1, decodes each directly 
+// at 1/4 or 1/8 scale, and re-encodes it, on the core not running the main loop.
+// Only one consumer uses stream 1, which requests each substream frame in turn.
+
+#define SUB_QUALITY 60 // jpeg quality % for substream
+#if CONFIG_FREERTOS_UNICORE
+#define SUBSTREAM_CORE tskNO_AFFINITY
+#else
+#define SUBSTREAM_CORE (ARDUINO_RUNNING_CORE ? 0 : 1)
+#endif
+
+static SemaphoreHandle_t subSemaphore = NULL;
+static subFrame subLatest = {NULL, 0, 0, 0}; // latest substream frame not yet collected
+static portMUX_TYPE subMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void subStreamTask(void* parameter) {
+  // woken by stream consumer requesting next substream frame
+  uint8_t* rgbBuf = NULL;
+  size_t rgbBufLen = 0;
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    frameRef* ref = waitStreamFrame(1, MAX_FRAME_WAIT);
+    if (ref == NULL) continue;
+    uint8_t scale = subStream == 2 ? 8 : 4;
+    subFrame thisFrame = {NULL, 0, (uint16_t)(ref->fb->width / scale), (uint16_t)(ref->fb->height / scale)};
+    size_t rgbLen = thisFrame.width * thisFrame.height * RGB888_BYTES;
+    if (rgbLen > rgbBufLen) {
+      // frame size increased
+      free(rgbBuf);
+      rgbBuf = (uint8_t*)ps_malloc(rgbLen);
+      rgbBufLen = rgbBuf == NULL ? 0 : rgbLen;
+    }
+    bool decoded = rgbBufLen && jpg2rgb888(ref->fb->buf, ref->fb->len, rgbBuf, scale == 8 ? JPG_SCALE_8X : JPG_SCALE_4X);
+    releaseFrame(ref); // camera frame no longer needed
+    if (!decoded) LOG_WRN("Failed to decode substream frame");
+    else if (fmt2jpg(rgbBuf, rgbLen, thisFrame.width, thisFrame.height, PIXFORMAT_RGB888, SUB_QUALITY, &thisFrame.buf, &thisFrame.len)) {
+      // replace any uncollected frame
+      portENTER_CRITICAL(&subMux);
+      uint8_t* staleBuf = subLatest.buf;
+      subLatest = thisFrame;
+      portEXIT_CRITICAL(&subMux);
+      free(staleBuf);
+      xSemaphoreGive(subSemaphore);
+    } else LOG_WRN("Failed to encode substream frame");
+  }
+  vTaskDelete(NULL);
+}
+
+subFrame waitSubFrame(uint32_t waitMs) {
+  // request and wait for next substream frame, caller must free returned buf
+  subFrame thisFrame = {NULL, 0, 0, 0};
+  if (subStreamHandle == NULL) return thisFrame;
+  xTaskNotifyGive(subStreamHandle);
+  if (xSemaphoreTake(subSemaphore, pdMS_TO_TICKS(waitMs)) == pdTRUE) {
+    portENTER_CRITICAL(&subMux);
+    thisFrame = subLatest;
+    subLatest.buf = NULL;
+    portEXIT_CRITICAL(&subMux);
+  }
+  return thisFrame;
+}
+
+static void showPlayback(httpd_req_t* req, uint8_t taskNum) {
+  // output playback file to browser, several playback tasks can run concurrently
   esp_err_t res = ESP_OK; 
-  stopPlaying();
+  bool isPlayback = false;
+  bool isLive = sustainReq[taskNum].isLive;
+  const char* playName = sustainReq[taskNum].fileName;
   forcePlayback = true;
-  if (STORAGE.exists(inFileName)) {
-    if (stopPlayback) LOG_WRN("Playback refused - capture in progress");
-    else {
-      LOG_INF("Playback enabled (SD file selected)");
-      doPlayback = true;
-    }
-  } else LOG_WRN("File %s doesn't exist when Playback requested", inFileName);
+  if (isLive) isPlayback = true; // recording in progress checked when session opened
+  else if (STORAGE.exists(playName)) {
+    LOG_INF("Playback enabled (SD file selected)");
+    isPlayback = true;
+  } else LOG_WRN("File %s doesn't exist when Playback requested", playName);
 
-  if (doPlayback) {
+  if (isPlayback) {
     // playback mjpeg from SD
     mjpegStruct mjpegData;
-    // output header for playback request
-    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
-    char hdrBuf[HDR_BUF_LEN];
-    openSDfile(inFileName);
-    mjpegData = getNextFrame(true);
-    while (doPlayback) {
-      size_t jpgLen = mjpegData.buffLen;
-      size_t buffOffset = mjpegData.buffOffset;
-      if (!jpgLen && !buffOffset) {
-        // complete mjpeg playback streaming
-        res = httpd_resp_sendstr_chunk(req, JPEG_BOUNDARY);
-        doPlayback = false; 
-      } else {
-        if (jpgLen) {
-          if (mjpegData.jpegSize) { // start of frame
-            // send mjpeg header 
-            if (res == ESP_OK) res = httpd_resp_sendstr_chunk(req, JPEG_BOUNDARY);
-            snprintf(hdrBuf, HDR_BUF_LEN-1, JPEG_TYPE, mjpegData.jpegSize);
-            if (res == ESP_OK) res = httpd_resp_sendstr_chunk(req, hdrBuf);   
-          } 
-          // send buffer 
-          if (res == ESP_OK) res = httpd_resp_send_chunk(req, (const char*)iSDbuffer+buffOffset, jpgLen);
-        }
-        if (res == ESP_OK) mjpegData = getNextFrame(); 
-        else {
-          // when browser closes playback get send error
-          LOG_VRB("Playback aborted due to error: %s", espErrMsg(res));
-          stopPlaying();
+    playSession* ps = openSDfile(playName, isLive);
+    if (ps == NULL) {
+      isPlayback = false;
+      httpd_resp_set_status(req, "503 Playback unavailable");
+      httpd_resp_sendstr(req, NULL);
+    } else {
+      // output header for playback request
+      httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+      httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
+      char hdrBuf[HDR_BUF_LEN];
+      isStreaming[taskNum] = true;
+      mjpegData = getNextFrame(ps, true);
+      while (isPlayback) {
+        size_t jpgLen = mjpegData.buffLen;
+        size_t buffOffset = mjpegData.buffOffset;
+        if (!jpgLen && !buffOffset) {
+          // complete mjpeg playback streaming
+          if (res == ESP_OK) res = httpd_resp_sendstr_chunk(req, JPEG_BOUNDARY);
+          isPlayback = false; 
+        } else {
+          if (jpgLen && res == ESP_OK) {
+            if (mjpegData.jpegSize) { // start of frame
+              // send mjpeg header 
+              res = httpd_resp_sendstr_chunk(req, JPEG_BOUNDARY);
+              snprintf(hdrBuf, HDR_BUF_LEN-1, JPEG_TYPE, mjpegData.jpegSize);
+              if (res == ESP_OK) res = httpd_resp_sendstr_chunk(req, hdrBuf);   
+            } 
+            // send buffer 
+            if (res == ESP_OK) res = httpd_resp_send_chunk(req, (const char*)mjpegData.buff + buffOffset, jpgLen);
+          }
+          if (res != ESP_OK || !isStreaming[taskNum]) {
+            // when browser closes playback get send error
+            if (res != ESP_OK) LOG_VRB("Playback aborted due to error: %s", espErrMsg(res));
+            stopSession(ps);
+          }
+          // continue until session signals end, so that it is closed cleanly
+          mjpegData = getNextFrame(ps); 
         }
       }
+      isStreaming[taskNum] = false;
+      if (res == ESP_OK) httpd_resp_sendstr_chunk(req, NULL);
     }
-    if (res == ESP_OK) httpd_resp_sendstr_chunk(req, NULL);
     sustainId = currEpoch;
   } 
-  if (!doPlayback && forcePlayback) {
+  if (!isPlayback && forcePlayback) {
     // switch off playback on browser
     forcePlayback = false;
     wsAsyncSendJson("ustatus", "\"forcePlayback\":0");
@@ -114,7 +192,6 @@ static void showStream(httpd_req_t* req, uint8_t taskNum) {
   uint32_t frameCnt = 0;
   uint32_t mjpegLen = 0;
   isStreaming[taskNum] = true;
-  streamBufferSize[taskNum] = 0;
   if (!taskNum) motionJpegLen = 0;
   // output header for streaming request
   httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
@@ -122,11 +199,8 @@ static void showStream(httpd_req_t* req, uint8_t taskNum) {
   char hdrBuf[HDR_BUF_LEN];
   while (isStreaming[taskNum]) {
     // stream from camera at current frame rate
-    if (xSemaphoreTake(frameSemaphore[taskNum], pdMS_TO_TICKS(MAX_FRAME_WAIT)) == pdFAIL) {
-      // failed to take semaphore, allow retry
-      streamBufferSize[taskNum] = 0;
-      continue;
-    }
+    frameRef* ref = NULL;
+    subFrame sub = {NULL, 0, 0, 0};
     if (dbgMotion && !taskNum) {
       // motion tracking stream on task 0 only, wait for new move mapping image
       if (xSemaphoreTake(motionSemaphore, pdMS_TO_TICKS(MAX_FRAME_WAIT)) == pdFAIL) continue;
@@ -134,12 +208,18 @@ static void showStream(httpd_req_t* req, uint8_t taskNum) {
       jpgLen = motionJpegLen;
       if (!jpgLen) continue;
       jpgBuf = motionJpeg;
+    } else if (taskNum == 1 && subStream && subStreamHandle != NULL) {
+      // reduced resolution NVR stream
+      sub = waitSubFrame(MAX_FRAME_WAIT);
+      if (sub.buf == NULL) continue; // allow retry
+      jpgLen = sub.len;
+      jpgBuf = sub.buf;
     } else {
-      // live stream 
-      if (!streamBufferSize[taskNum]) continue;
-      jpgLen = streamBufferSize[taskNum];
-      // use frame stored by processFrame()
-      jpgBuf = streamBuffer[taskNum];
+      // live stream, use camera frame shared by processFrame()
+      ref = waitStreamFrame(taskNum, MAX_FRAME_WAIT);
+      if (ref == NULL) continue; // allow retry
+      jpgLen = ref->fb->len;
+      jpgBuf = ref->fb->buf;
     }
     if (res == ESP_OK) {
       // send next frame in stream
@@ -149,8 +229,10 @@ static void showStream(httpd_req_t* req, uint8_t taskNum) {
       if (res == ESP_OK) res = httpd_resp_send_chunk(req, (const char*)jpgBuf, jpgLen);
       frameCnt++;
     }
+    releaseFrame(ref);
+    free(sub.buf);
     mjpegLen += jpgLen;
-    jpgLen = streamBufferSize[taskNum] = 0;
+    jpgLen = 0;
     if (dbgMotion && !taskNum) motionJpegLen = 0;
     if (res != ESP_OK) {
       // get send error when browser closes stream 
@@ -158,6 +240,7 @@ static void showStream(httpd_req_t* req, uint8_t taskNum) {
       isStreaming[taskNum] = false;
     }     
   }
+  endStreamFrames(taskNum);
   if (res == ESP_OK) httpd_resp_sendstr_chunk(req, NULL);
   uint32_t mjpegTime = millis() - startTime;
   float mjpegTimeF = float(mjpegTime) / 1000; // secs
@@ -231,6 +314,14 @@ static void srtStream(httpd_req_t* req, uint8_t taskNum) {
   LOG_INF("SRT: sent %d subtitles", srtSeqNo);
 }
 
+static uint8_t freePlaybackTask() {
+  // use task 0 for playback if free, else a free additional playback task
+  if (!sustainReq[0].inUse) return 0;
+  for (int i = MAX_STREAMS; i < MAX_SUSTAIN; i++) 
+    if (sustainHandle[i] != NULL && !sustainReq[i].inUse) return i;
+  return 0;
+}
+
 void stopSustainTask(int taskId) {
   isStreaming[taskId] = false;
 }
@@ -242,12 +333,13 @@ static void sustainTask(void* p) {
     uint8_t i = *(uint8_t*)p; // identify task number
     if (i == 0) {
       if (!strcmp(sustainReq[i].activity, "download")) fileHandler(sustainReq[i].req, true); 
-      else if (!strcmp(sustainReq[i].activity, "playback")) showPlayback(sustainReq[i].req);
+      else if (!strcmp(sustainReq[i].activity, "playback")) showPlayback(sustainReq[i].req, i);
       else if (!strcmp(sustainReq[i].activity, "stream")) showStream(sustainReq[i].req, i);
     } 
     else if (i == 1) showStream(sustainReq[i].req, i);
     else if (i == 2) audioStream(sustainReq[i].req, i);
     else if (i == 3) srtStream(sustainReq[i].req, i);
+    else showPlayback(sustainReq[i].req, i); // additional playback task
     // cleanup as request now complete on return
     if (httpd_req_async_handler_complete(sustainReq[i].req) != ESP_OK) LOG_ERR("Failed to free req for sustain task: %i", i);
     sustainReq[i].inUse = false; 
@@ -264,21 +356,24 @@ void startSustainTasks() {
     LOG_WRN("numStreams %d exceeds MAX_STREAMS %d", numStreams, MAX_STREAMS);
     numStreams = MAX_STREAMS;
   }
-  if (maxFrameBuffSize * (vidStreams + 1) > ESP.getFreePsram()) {
-    LOG_WRN("Insufficient PSRAM for NVR streams");
-    vidStreams = 1;
-    streamVid = streamAud = streamSrt = false;
+  // stream frames are shared from camera frame buffers so no stream buffers needed
+  if (subStream && vidStreams > 1 && psramFound()) {
+    subSemaphore = xSemaphoreCreateBinary();
+    xTaskCreatePinnedToCoreWithCaps(subStreamTask, "subStreamTask", SUBSTREAM_STACK_SIZE, NULL, SUBSTREAM_PRI, &subStreamHandle, SUBSTREAM_CORE, STACK_MEM);
   }
-  for (int i = 0; i < vidStreams; i++)
-    if (streamBuffer[i] == NULL) streamBuffer[i] = (byte*)ps_malloc(maxFrameBuffSize); 
 
   for (int i = 0; i < numStreams; i++) {
     sustainReq[i].taskNum = i; // so task knows its number
     if (includeRTSP && i > 0) continue; // as RTSP tasks created in rtsp.cpp
     xTaskCreateWithCaps(sustainTask, "sustainTask", SUSTAIN_STACK_SIZE, &sustainReq[i].taskNum, SUSTAIN_PRI, &sustainHandle[i], STACK_MEM); 
   }
+  // playback tasks for concurrent sessions, in addition to task 0
+  for (int i = MAX_STREAMS; i < MAX_STREAMS + playSessions - 1; i++) {
+    sustainReq[i].taskNum = i;
+    xTaskCreateWithCaps(sustainTask, "playbackSustain", SUSTAIN_STACK_SIZE, &sustainReq[i].taskNum, SUSTAIN_PRI, &sustainHandle[i], STACK_MEM); 
+  }
   
-  LOG_INF("Started %d sustain tasks", numStreams);
+  LOG_INF("Started %d sustain tasks", numStreams + playSessions - 1);
   debugMemory("startSustainTasks");
 }
 
@@ -293,22 +388,21 @@ esp_err_t appSpecificSustainHandler(httpd_req_t* req) {
       // remote streaming eg video uses task 1, audio task 2, srt task 3
       uint8_t taskNum = 99;
       if (!strcmp(variable, "download")) taskNum = 0;
-      else if (!strcmp(variable, "playback")) taskNum = 0;
+      else if (!strcmp(variable, "playback")) taskNum = freePlaybackTask();
       else if (!strcmp(variable, "stream")) taskNum = 0;
       else if (!strcmp(variable, "video")) taskNum = 1;
       else if (!strcmp(variable, "audio")) taskNum = 2;
       else if (!strcmp(variable, "srt")) taskNum = 3;
       // http(s) streams not available if RTSP being used
       if (includeRTSP && taskNum > 0) taskNum = 99;
-      if (taskNum < numStreams) {
-        if (taskNum == 0) {
+      if (taskNum < numStreams || (taskNum >= MAX_STREAMS && taskNum < MAX_SUSTAIN)) {
+        if (taskNum == 0 || taskNum >= MAX_STREAMS) {
           if (req->method == HTTP_HEAD) { 
             // task check request from app web page
             if (sustainReq[taskNum].inUse) {
               // task not free, try stopping it for new stream
               if (!strcmp(variable, "stream")) {
                 isStreaming[taskNum] = false;
-                if (!taskNum) doPlayback = false; // only for task 0
                 delay(END_WAIT + 100);
               }
             } 
@@ -344,6 +438,10 @@ esp_err_t appSpecificSustainHandler(httpd_req_t* req) {
             return res;
           }
           sustainReq[i].req = copy;
+          // download as mp4 if requested with value mp4
+          if (!i) mp4Remux = !strcmp(variable, "download") && !strcmp(value, MP4_EXT);
+          strncpy(sustainReq[i].fileName, inFileName, sizeof(sustainReq[i].fileName) - 1);
+          sustainReq[i].isLive = !strcmp(value, "live");
           strncpy(sustainReq[i].activity, variable, sizeof(sustainReq[i].activity) - 1); 
           // activate relevant task
           xTaskNotifyGive(sustainHandle[i]);
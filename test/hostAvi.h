@@ -0,0 +1,142 @@
+// Independent checks of avi structure, for tests recording through mjpeg2sd.cpp
+// The RIFF structure is walked independently of avi.cpp, then the header,
+// idx1, OpenDML super and standard indexes are checked against the chunks found,
+// as is the demux used for playback.
+
+#pragma once
+
+#include "hostRecord.h"
+
+struct aviChunk {
+  size_t pos; // file position of chunk header
+  uint32_t size;
+  size_t moviPos; // file position of movi marker of its segment
+};
+
+struct aviLayout {
+  std::vector<aviChunk> vid;
+  std::vector<size_t> riffPos; // each RIFF, then AVIX segments
+  std::vector<size_t> moviPos;
+  size_t idx1Pos = 0;
+  bool valid = true;
+};
+
+static void walkList(const std::vector<uint8_t>& avi, size_t pos, size_t end, size_t moviPos, aviLayout& layout) {
+  // collect chunks within list, recursing into RIFF and LIST
+  while (pos + CHUNK_HDR <= end) {
+    uint32_t size = rd32(avi, pos + 4);
+    if (isTag(avi, pos, "RIFF") || isTag(avi, pos, "LIST")) {
+      if (isTag(avi, pos, "RIFF")) layout.riffPos.push_back(pos);
+      bool isMovi = isTag(avi, pos + 8, "movi");
+      if (isMovi) layout.moviPos.push_back(pos + 8);
+      walkList(avi, pos + 12, pos + CHUNK_HDR + size, isMovi ? pos + 8 : moviPos, layout);
+    } else if (isTag(avi, pos, "idx1")) layout.idx1Pos = pos;
+    else if (isTag(avi, pos, "00dc") && moviPos) layout.vid.push_back({pos, size, moviPos});
+    pos += CHUNK_HDR + size + (size & 1);
+  }
+  if (pos != end) {
+    printf("List ends at %zu, expected %zu\n", pos, end);
+    layout.valid = false;
+  }
+}
+
+static uint8_t checkAvi(const char* aviName) {
+  // check structure of avi against frames recorded, returning number of RIFF segments
+  std::vector<uint8_t>& avi = hostFileData(aviName);
+  aviLayout layout;
+  walkList(avi, 0, avi.size(), 0, layout);
+  CHECK(layout.valid);
+  CHECK(isTag(avi, 8, "AVI "));
+  uint32_t frames = recChunks.size();
+  uint8_t segs = layout.riffPos.size();
+  CHECK(segs >= 1);
+  CHECK_EQ(layout.moviPos.size(), segs);
+  CHECK_EQ(layout.vid.size(), frames);
+  if (!layout.valid || layout.vid.size() != frames || layout.moviPos.size() != segs) return 0;
+
+  // header
+  CHECK_EQ(rd32(avi, 0x20), 100000); // usecs per frame
+  CHECK_EQ(rd32(avi, 0x8C), frames); // strh length
+  CHECK_EQ(rd32(avi, 0x1CE), frames); // dmlh total frames
+  CHECK_EQ(rd16(avi, 0x40), 640);
+  CHECK_EQ(rd16(avi, 0x44), 480);
+  CHECK_EQ(layout.moviPos[0], AVI_HEADER_LEN - 4);
+  uint32_t firstFrames = 0;
+  for (auto& chunk : layout.vid) if (chunk.moviPos == layout.moviPos[0]) firstFrames++;
+  CHECK_EQ(rd32(avi, 0x30), firstFrames); // avih frames, first RIFF only
+  for (uint8_t seg = 1; seg < segs; seg++) {
+    CHECK(isTag(avi, layout.riffPos[seg] + 8, "AVIX"));
+    CHECK_EQ(layout.moviPos[seg], layout.riffPos[seg] + 20);
+  }
+
+  // chunk content, each jpeg followed by chunk holding recording tag
+  for (uint32_t i = 0; i < frames; i++) {
+    CHECK_EQ(layout.vid[i].size, recChunks[i].size());
+    if (layout.vid[i].size == recChunks[i].size())
+      CHECK(!memcmp(avi.data() + layout.vid[i].pos + CHUNK_HDR, recChunks[i].data(), recChunks[i].size()));
+    if (!layout.vid[i].size) continue;
+    size_t tagPos = layout.vid[i].pos + CHUNK_HDR + layout.vid[i].size;
+    CHECK(isTag(avi, tagPos, "JUNK"));
+    CHECK_EQ(rd32(avi, tagPos + 4), sizeof(recTag));
+    CHECK_EQ(rd32(avi, tagPos + CHUNK_HDR), recTag);
+  }
+
+  // idx1 in first RIFF, with entries for its frames relative to its movi marker
+  CHECK(layout.idx1Pos > 0);
+  CHECK(layout.idx1Pos < layout.riffPos[0] + CHUNK_HDR + rd32(avi, 4));
+  CHECK_EQ(rd32(avi, layout.idx1Pos + 4), firstFrames * 16);
+  for (uint32_t i = 0; i < firstFrames; i++) {
+    size_t entry = layout.idx1Pos + CHUNK_HDR + i * 16;
+    CHECK(isTag(avi, entry, "00dc"));
+    CHECK_EQ(rd32(avi, entry + 4), 0);
+    CHECK_EQ(rd32(avi, entry + 8), layout.vid[i].pos - layout.moviPos[0]);
+    CHECK_EQ(rd32(avi, entry + 12), layout.vid[i].size);
+  }
+
+  // super index with standard index per segment, locating content rather than marker
+  CHECK(isTag(avi, 0xCC, "indx"));
+  CHECK_EQ(rd32(avi, 0xD8), segs);
+  uint32_t frameNum = 0;
+  for (uint8_t seg = 0; seg < segs; seg++) {
+    size_t superEntry = 0xEC + seg * 16;
+    size_t ixPos = rd64(avi, superEntry);
+    uint32_t entries = rd32(avi, superEntry + 12);
+    CHECK(isTag(avi, ixPos, "ix00"));
+    CHECK_EQ(rd32(avi, ixPos + 4) + CHUNK_HDR, rd32(avi, superEntry + 8));
+    CHECK_EQ(rd16(avi, ixPos + 8), 2); // longs per entry
+    CHECK_EQ(avi[ixPos + 11], 1); // index of chunks
+    CHECK_EQ(rd32(avi, ixPos + 12), entries);
+    CHECK(isTag(avi, ixPos + 16, "00dc"));
+    CHECK_EQ(rd64(avi, ixPos + 20), layout.moviPos[seg]);
+    for (uint32_t i = 0; i < entries && frameNum < frames; i++, frameNum++) {
+      size_t entry = ixPos + 32 + i * 8;
+      CHECK_EQ(layout.moviPos[seg] + rd32(avi, entry) - CHUNK_HDR, layout.vid[frameNum].pos);
+      CHECK_EQ(rd32(avi, entry + 4), layout.vid[frameNum].size);
+      CHECK_EQ(layout.vid[frameNum].moviPos, layout.moviPos[seg]);
+    }
+  }
+  CHECK_EQ(frameNum, frames);
+
+  // demux as used by playback
+  aviSource src = {readVector, &avi, avi.size()};
+  for (uint32_t i = 0; i < frames; i++) CHECK_EQ(findAviFrame(&src, i), layout.vid[i].pos);
+  CHECK_EQ(findAviFrame(&src, frames), 0);
+  uint32_t frameTotal = 0;
+  uint16_t width = 0, height = 0;
+  CHECK(aviFrameInfo(&src, &frameTotal, &width, &height));
+  CHECK_EQ(frameTotal, frames);
+  CHECK_EQ(width, 640);
+  CHECK_EQ(height, 480);
+  bool isOdml = false;
+  size_t filePos = findAviMovi(&src, &isOdml);
+  CHECK_EQ(filePos, AVI_HEADER_LEN);
+  CHECK_EQ(isOdml, segs > 1);
+  uint32_t chunkLen, vidChunks = 0;
+  uint8_t chunkType;
+  while ((chunkType = nextAviChunk(&src, filePos, &chunkLen)) != AVI_END) {
+    if (chunkType == AVI_VIDEO && vidChunks < frames) CHECK_EQ(filePos, layout.vid[vidChunks++].pos);
+    filePos += chunkLen;
+  }
+  CHECK_EQ(vidChunks, frames);
+  return segs;
+}
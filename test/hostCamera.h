@@ -0,0 +1,49 @@
+// Fake camera frame buffers for tests including mjpeg2sd.cpp, which uses FB_CNT buffers
+// Each buffer must be returned to the camera exactly once for each time it is got.
+
+#pragma once
+
+#include "hostTest.h"
+#include <atomic>
+
+#define CAM_BUFF_LEN (1024 * 320) // largest test frame
+
+static camera_fb_t camFb[FB_CNT];
+static std::vector<uint8_t> camBuff[FB_CNT];
+static std::atomic<int> fbUsers[FB_CNT]; // 1 while held from camera
+static std::atomic<int> fbErrors(0);
+
+void esp_camera_fb_return(camera_fb_t* fb) {
+  // camera buffer returned, must have been in use
+  if (--fbUsers[fb - camFb] != 0) fbErrors++;
+}
+
+static camera_fb_t* cameraGet() {
+  // next free camera buffer, or NULL if all in use
+  for (int i = 0; i < FB_CNT; i++) {
+    int expected = 0;
+    if (fbUsers[i].compare_exchange_strong(expected, 1)) return &camFb[i];
+  }
+  return NULL;
+}
+
+static camera_fb_t* cameraCapture(const std::vector<uint8_t>& jpeg, uint32_t frameMs) {
+  // wait for free camera buffer, then fill it with given frame
+  camera_fb_t* fb;
+  for (uint32_t waitMs = millis(); (fb = cameraGet()) == NULL && millis() - waitMs < 5000; ) delay(1);
+  if (fb == NULL) return NULL;
+  std::vector<uint8_t>& buff = camBuff[fb - camFb];
+  buff.assign(CAM_BUFF_LEN, 0);
+  memcpy(buff.data(), jpeg.data(), std::min(jpeg.size(), buff.size()));
+  fb->buf = buff.data();
+  fb->len = jpeg.size();
+  fb->timestamp.tv_sec = frameMs / 1000;
+  fb->timestamp.tv_usec = frameMs % 1000 * 1000;
+  return fb;
+}
+
+static int fbInUse() {
+  int inUse = 0;
+  for (auto& users : fbUsers) inUse += users;
+  return inUse;
+}
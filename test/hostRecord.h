@@ -0,0 +1,54 @@
+// Records an avi through the motion capture writer in mjpeg2sd.cpp,
+// which the test includes ahead of this file so its static functions are reachable
+
+#pragma once
+
+#include "hostTest.h"
+
+static std::vector<std::vector<uint8_t>> recChunks; // expected content of each video chunk, empty if missed frame
+
+static size_t testJpegLen(uint32_t frameNum) {
+  // varied lengths so that each filler size occurs
+  return 900 + (frameNum * 37) % 700;
+}
+
+static void openRecording() {
+  // start recording at nominal 10 fps
+  FPS = 10;
+  fsizePtr = FRAMESIZE_VGA;
+  minSeconds = 0;
+  frameLimit = maxFrames;
+  if (aviMutex == NULL) aviMutex = xSemaphoreCreateMutex();
+  recChunks.clear();
+  aviFull = false; // as reset by processFrame
+  openAvi();
+  delay(5); // closeAvi reports rates over the recording duration
+}
+
+static void recordFrame(uint32_t frameNum, size_t jpegLen) {
+  // save frame captured in given frame interval, or miss the interval if no length
+  if (!jpegLen) {
+    recChunks.push_back({});
+    return;
+  }
+  std::vector<uint8_t> jpeg = makeJpeg(frameNum, jpegLen);
+  jpeg.resize(jpegLen + 3); // avi filler read beyond jpeg, as from camera buffer
+  saveFrame(jpeg.data(), jpegLen, frameNum * 100);
+  // chunk holds jpeg then filler, recording tag is in its own chunk
+  jpeg.resize(jpegLen + ((4 - (jpegLen & 3)) & 3));
+  recChunks.push_back(jpeg);
+}
+
+static const char* closeRecording() {
+  // complete recording, returning name of avi
+  closeAvi();
+  recChunks.resize(aviFrames); // none recorded beyond max file size
+  return aviFileName;
+}
+
+static const char* recordAvi(uint32_t frameCnt, uint32_t missedFrame = UINT32_MAX, size_t (*jpegLen)(uint32_t) = testJpegLen) {
+  // record frames, with a missed capture interval if required
+  openRecording();
+  for (uint32_t i = 0; i < frameCnt; i++) recordFrame(i, i == missedFrame ? 0 : jpegLen(i));
+  return closeRecording();
+}
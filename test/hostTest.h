@@ -0,0 +1,106 @@
+// Checks and helpers shared by the host tests
+//
+// Each test is a single executable that runs its cases in turn, reporting failed
+// checks, and exits with non zero status if any failed. Exit is immediate, as app
+// tasks started by a test are still running.
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+static int testFails = 0;
+static int testChecks = 0;
+
+#define CHECK(cond) do { \
+  testChecks++; \
+  if (!(cond)) { \
+    printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    testFails++; \
+  } \
+} while (0)
+
+#define CHECK_EQ(got, want) do { \
+  testChecks++; \
+  unsigned long long _got = (unsigned long long)(got), _want = (unsigned long long)(want); \
+  if (_got != _want) { \
+    printf("FAIL %s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #got, _got, _want); \
+    testFails++; \
+  } \
+} while (0)
+
+static inline void testCase(const char* name) {
+  printf("---- %s\n", name);
+  fflush(stdout);
+}
+
+static inline int testEnd() {
+  // report and exit without waiting for app tasks
+  printf("%d checks, %d failed\n", testChecks, testFails);
+  fflush(stdout);
+  _exit(testFails ? 1 : 0);
+}
+
+// benchmarks report host rates, to compare approaches and builds rather than as board figures
+
+static inline double benchSecs(std::chrono::steady_clock::time_point startTime) {
+  // seconds elapsed since benchmark started
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+static inline double benchRate(const char* name, double count, double secs, const char* unit) {
+  // report and return rate of given benchmark
+  double rate = secs > 0 ? count / secs : 0;
+  printf("bench %s: %.1f %s/sec\n", name, rate, unit);
+  fflush(stdout);
+  return rate;
+}
+
+static inline uint32_t rd16(const std::vector<uint8_t>& data, size_t pos) {
+  return pos + 2 <= data.size() ? data[pos] | data[pos + 1] << 8 : 0;
+}
+
+static inline uint32_t rd32(const std::vector<uint8_t>& data, size_t pos) {
+  uint32_t val = 0;
+  if (pos + 4 <= data.size()) memcpy(&val, data.data() + pos, 4);
+  return val;
+}
+
+static inline uint64_t rd64(const std::vector<uint8_t>& data, size_t pos) {
+  uint64_t val = 0;
+  if (pos + 8 <= data.size()) memcpy(&val, data.data() + pos, 8);
+  return val;
+}
+
+static inline uint32_t rdBE32(const std::vector<uint8_t>& data, size_t pos) {
+  // big endian, as used by mp4
+  if (pos + 4 > data.size()) return 0;
+  return (uint32_t)data[pos] << 24 | data[pos + 1] << 16 | data[pos + 2] << 8 | data[pos + 3];
+}
+
+static inline bool isTag(const std::vector<uint8_t>& data, size_t pos, const char* tag) {
+  return pos + 4 <= data.size() && !memcmp(data.data() + pos, tag, 4);
+}
+
+static std::vector<uint8_t> makeJpeg(uint32_t frameNum, size_t jpegLen) {
+  // jpeg shaped content, distinct for each frame
+  std::vector<uint8_t> jpeg(jpegLen);
+  for (size_t i = 0; i < jpegLen; i++) jpeg[i] = (uint8_t)(frameNum * 7 + i);
+  jpeg[0] = 0xFF;
+  jpeg[1] = 0xD8;
+  jpeg[jpegLen - 2] = 0xFF;
+  jpeg[jpegLen - 1] = 0xD9;
+  return jpeg;
+}
+
+static size_t readVector(void* ctx, size_t filePos, uint8_t* buff, size_t len) {
+  // aviSource read from in memory content, with ctx as std::vector*
+  std::vector<uint8_t>* data = (std::vector<uint8_t>*)ctx;
+  if (filePos >= data->size()) return 0;
+  len = std::min(len, data->size() - filePos);
+  memcpy(buff, data->data() + filePos, len);
+  return len;
+}
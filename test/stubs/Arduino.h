@@ -0,0 +1,276 @@
+// Host build stand in for the Arduino core, declaring only what the app headers
+// and the sources under test refer to. Storage is held in memory by hostCore.cpp.
+//
+// Only used by the host tests in test/, never by the sketch build.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <climits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// glibc declares its own timezone, which the app uses as a config string
+#define timezone app_timezone
+
+typedef uint8_t byte;
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_TIMEOUT 0x107
+
+/******************** FreeRTOS ********************/
+
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* TimerHandle_t;
+typedef void* esp_ping_handle_t;
+typedef unsigned int UBaseType_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+typedef void (*TaskFunction_t)(void*);
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configMAX_PRIORITIES 25
+#define tskNO_AFFINITY INT_MAX
+struct portMUX_TYPE { int owner; };
+#define portMUX_INITIALIZER_UNLOCKED {0}
+void portENTER_CRITICAL(portMUX_TYPE* mux);
+void portEXIT_CRITICAL(portMUX_TYPE* mux);
+#define portENTER_CRITICAL_ISR portENTER_CRITICAL
+#define portEXIT_CRITICAL_ISR portEXIT_CRITICAL
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateBinary();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* woken);
+#define portYIELD_FROM_ISR(...)
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle);
+BaseType_t xTaskCreateWithCaps(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle, UBaseType_t caps);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle, BaseType_t core);
+BaseType_t xTaskCreatePinnedToCoreWithCaps(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle, BaseType_t core, UBaseType_t caps);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+void vTaskSuspend(TaskHandle_t task);
+void vTaskResume(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+TickType_t xTaskGetTickCount();
+
+/******************** esp-idf ********************/
+
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_8BIT (1 << 2)
+void* ps_malloc(size_t len);
+void* ps_calloc(size_t cnt, size_t len);
+void* ps_realloc(void* ptr, size_t len);
+void* heap_caps_malloc(size_t len, uint32_t caps);
+void* heap_caps_aligned_alloc(size_t align, size_t len, uint32_t caps);
+void heap_caps_free(void* ptr);
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+void heap_caps_malloc_extmem_enable(size_t limit);
+bool psramFound();
+uint32_t esp_random();
+int64_t esp_timer_get_time();
+const char* esp_log_system_timestamp();
+const char* esp_err_to_name(esp_err_t err);
+const char* pathToFileName(const char* path);
+void esp_log_level_set(const char* tag, int level);
+typedef enum {ESP_SLEEP_WAKEUP_UNDEFINED} esp_sleep_wakeup_cause_t;
+#define LOG_COLOR_W "" // from esp_log.h
+typedef enum {ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE} esp_log_level_t;
+
+/******************** Arduino ********************/
+
+typedef bool boolean;
+using std::min;
+using std::max;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define HIGH 1
+#define LOW 0
+#define INPUT 1
+#define OUTPUT 3
+#define INPUT_PULLUP 5
+#define IRAM_ATTR
+#define ARDUINO_ISR_ATTR
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+char* itoa(int val, char* s, int radix);
+
+struct hw_timer_t;
+hw_timer_t* timerBegin(uint32_t frequency);
+void timerEnd(hw_timer_t* timer);
+void timerAttachInterrupt(hw_timer_t* timer, void (*userFunc)(void));
+void timerDetachInterrupt(hw_timer_t* timer);
+void timerAlarm(hw_timer_t* timer, uint64_t alarmValue, bool autoreload, uint64_t reloadCount);
+void ledc_stop(int mode, int channel, uint32_t idleLevel);
+
+class String : public std::string {
+ public:
+  String() {}
+  String(const char* s) : std::string(s ? s : "") {}
+  String(const std::string& s) : std::string(s) {}
+  String(int val) : std::string(std::to_string(val)) {}
+  const char* c_str() const { return std::string::c_str(); }
+};
+
+class EspClass {
+ public:
+  size_t getFreeHeap();
+  size_t getFreePsram();
+  size_t getPsramSize();
+  size_t getMaxAllocHeap();
+  size_t getMaxAllocPsram();
+  uint32_t getCpuFreqMHz();
+  uint32_t getSketchSize();
+  uint32_t getFreeSketchSpace();
+  void restart();
+};
+extern EspClass ESP;
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) { return write(&c, 1); }
+  virtual size_t write(const uint8_t* buf, size_t len) { return len; }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual size_t readBytes(uint8_t* buf, size_t len) { return 0; }
+};
+
+class Client : public Stream {
+ public:
+  virtual int connect(const char* host, uint16_t port) { return 0; }
+  virtual uint8_t connected() { return 0; }
+  virtual void stop() {}
+  operator bool() { return connected(); }
+};
+
+class NetworkClient : public Client {};
+class NetworkClientSecure : public NetworkClient {};
+typedef NetworkClient WiFiClient;
+typedef NetworkClientSecure WiFiClientSecure;
+
+/******************** file system ********************/
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+enum SeekMode {SeekSet, SeekCur, SeekEnd};
+
+typedef enum {CARD_NONE, CARD_MMC, CARD_SD, CARD_SDHC, CARD_UNKNOWN} sdcard_type_t;
+#define BOARD_MAX_SDMMC_FREQ 40000
+
+namespace fs {
+
+struct memFile; // file content held in memory
+
+class File : public Stream {
+ public:
+  File() {}
+  File(memFile* mf, const std::string& path, const char* mode);
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buf, size_t len) override;
+  int available() override;
+  int read() override;
+  size_t read(uint8_t* buf, size_t len);
+  size_t readBytes(uint8_t* buf, size_t len) override { return read(buf, len); }
+  bool seek(uint32_t pos, SeekMode mode = SeekSet);
+  size_t position() const { return pos; }
+  size_t size() const;
+  void flush() {}
+  void close();
+  time_t getLastWrite() { return 0; }
+  const char* path() const { return filePath.c_str(); }
+  const char* name() const;
+  bool isDirectory() const { return isDir; }
+  File openNextFile(const char* mode = FILE_READ);
+  operator bool() const { return mf != NULL || isDir; }
+
+ private:
+  memFile* mf = NULL;
+  std::string filePath;
+  size_t pos = 0;
+  bool isDir = false;
+  size_t dirIdx = 0;
+  friend class FS;
+};
+
+class FS {
+ public:
+  File open(const char* path, const char* mode = FILE_READ, bool create = false);
+  File open(const String& path, const char* mode = FILE_READ) { return open(path.c_str(), mode); }
+  bool exists(const char* path);
+  bool exists(const String& path) { return exists(path.c_str()); }
+  bool remove(const char* path);
+  bool rename(const char* pathFrom, const char* pathTo);
+  bool mkdir(const char* path);
+  bool rmdir(const char* path);
+  uint64_t totalBytes();
+  uint64_t usedBytes();
+};
+
+class SDMMCFS : public FS {
+ public:
+  bool setPins(int clk, int cmd, int d0);
+  bool setPins(int clk, int cmd, int d0, int d1, int d2, int d3);
+  bool begin(const char* mountpoint = "/sdcard", bool mode1bit = false, bool formatOnFail = false, int freq = 0, uint8_t maxFiles = 5);
+  void end();
+  sdcard_type_t cardType();
+  uint64_t cardSize();
+};
+class LittleFSFS : public FS {
+ public:
+  bool begin(bool formatOnFail = false, const char* basePath = "/littlefs", uint8_t maxOpenFiles = 10, const char* partitionLabel = "spiffs");
+  void end();
+  bool format();
+};
+
+} // namespace fs
+
+using fs::File;
+using fs::FS;
+extern fs::SDMMCFS SD_MMC;
+extern fs::LittleFSFS LittleFS;
+
+// test access to in memory file content
+std::vector<uint8_t>& hostFileData(const char* path);
+void hostFilesClear();
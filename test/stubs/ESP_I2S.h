@@ -0,0 +1,19 @@
+#pragma once
+#include "Arduino.h"
+
+typedef enum {I2S_NUM_0, I2S_NUM_1} i2s_port_t;
+typedef enum {I2S_MODE_STD, I2S_MODE_PDM_RX} i2s_mode_t;
+typedef enum {I2S_DATA_BIT_WIDTH_16BIT = 16} i2s_data_bit_width_t;
+typedef enum {I2S_SLOT_MODE_MONO = 1} i2s_slot_mode_t;
+typedef enum {I2S_STD_SLOT_LEFT = 1} i2s_std_slot_mask_t;
+
+// no mic or amp on host, tests supply audio samples directly
+class I2SClass {
+  public:
+    void setPins(int bclk, int ws, int dout, int din, int mclk) {}
+    void setPinsPdmRx(int clk, int din) {}
+    bool begin(i2s_mode_t mode, uint32_t rate, i2s_data_bit_width_t bits, i2s_slot_mode_t ch, int8_t slot) { return false; }
+    bool end() { return true; }
+    size_t readBytes(char* buffer, size_t size) { return 0; }
+    size_t write(const uint8_t* buffer, size_t size) { return 0; }
+};
@@ -0,0 +1,17 @@
+#pragma once
+#include "Arduino.h"
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+#define U_FLASH 0
+#define U_SPIFFS 100
+
+class UpdateClass {
+ public:
+  bool begin(size_t size, int command);
+  size_t write(uint8_t* data, size_t len);
+  void onProgress(void (*fn)(size_t, size_t));
+  bool end(bool evenIfRemaining);
+  bool hasError();
+  const char* errorString();
+};
+extern UpdateClass Update;
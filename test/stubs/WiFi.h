@@ -0,0 +1,13 @@
+#pragma once
+#include "Arduino.h"
+
+typedef enum {WL_IDLE_STATUS, WL_NO_SSID_AVAIL, WL_SCAN_COMPLETED, WL_CONNECTED} wl_status_t;
+
+class WiFiClass {
+ public:
+  wl_status_t status();
+  int16_t scanNetworks();
+  String SSID(uint8_t i);
+  int32_t RSSI(uint8_t i);
+};
+extern WiFiClass WiFi;
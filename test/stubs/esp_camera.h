@@ -0,0 +1,103 @@
+#pragma once
+#include "Arduino.h"
+
+typedef enum {PIXFORMAT_RGB565, PIXFORMAT_YUV422, PIXFORMAT_YUV420, PIXFORMAT_GRAYSCALE, PIXFORMAT_JPEG,
+  PIXFORMAT_RGB888, PIXFORMAT_RAW, PIXFORMAT_RGB444, PIXFORMAT_RGB555} pixformat_t;
+typedef enum {FRAMESIZE_96X96, FRAMESIZE_QQVGA, FRAMESIZE_128X128, FRAMESIZE_QCIF, FRAMESIZE_HQVGA,
+  FRAMESIZE_240X240, FRAMESIZE_QVGA, FRAMESIZE_320X320, FRAMESIZE_CIF, FRAMESIZE_HVGA, FRAMESIZE_VGA,
+  FRAMESIZE_SVGA, FRAMESIZE_XGA, FRAMESIZE_HD, FRAMESIZE_SXGA, FRAMESIZE_UXGA, FRAMESIZE_FHD, FRAMESIZE_P_HD,
+  FRAMESIZE_P_3MP, FRAMESIZE_QXGA, FRAMESIZE_QHD, FRAMESIZE_WQXGA, FRAMESIZE_P_FHD, FRAMESIZE_QSXGA,
+  FRAMESIZE_5MP, FRAMESIZE_INVALID} framesize_t;
+typedef enum {JPG_SCALE_NONE, JPG_SCALE_2X, JPG_SCALE_4X, JPG_SCALE_8X, JPG_SCALE_MAX = JPG_SCALE_8X} jpg_scale_t;
+typedef enum {CAMERA_GRAB_WHEN_EMPTY, CAMERA_GRAB_LATEST} camera_grab_mode_t;
+typedef enum {CAMERA_FB_IN_PSRAM, CAMERA_FB_IN_DRAM} camera_fb_location_t;
+
+typedef struct {
+  uint8_t* buf;
+  size_t len;
+  size_t width;
+  size_t height;
+  pixformat_t format;
+  struct timeval timestamp;
+} camera_fb_t;
+
+typedef struct {
+  uint16_t PID;
+} sensor_id_t;
+
+typedef struct {
+  framesize_t framesize;
+  int quality;
+} camera_status_t;
+
+typedef struct _sensor sensor_t;
+struct _sensor {
+  sensor_id_t id;
+  camera_status_t status;
+  int (*set_framesize)(sensor_t* sensor, framesize_t framesize);
+  int (*set_quality)(sensor_t* sensor, int quality);
+  int (*set_brightness)(sensor_t* sensor, int level);
+  int (*set_saturation)(sensor_t* sensor, int level);
+  int (*set_vflip)(sensor_t* sensor, int enable);
+  int (*set_hmirror)(sensor_t* sensor, int enable);
+};
+#define OV2640_PID 0x26
+#define OV3660_PID 0x3660
+#define OV5640_PID 0x5640
+#define MEGA_CCM_PID 0x039E
+typedef enum {LEDC_TIMER_0, LEDC_TIMER_1} ledc_timer_t;
+typedef enum {LEDC_CHANNEL_0, LEDC_CHANNEL_1} ledc_channel_t;
+typedef enum {LEDC_LOW_SPEED_MODE} ledc_mode_t;
+typedef enum {LEDC_TIMER_1_BIT = 1} ledc_timer_bit_t;
+typedef enum {LEDC_AUTO_CLK} ledc_clk_cfg_t;
+typedef enum {LEDC_INTR_DISABLE} ledc_intr_type_t;
+typedef struct {
+  ledc_mode_t speed_mode;
+  ledc_timer_bit_t duty_resolution;
+  ledc_timer_t timer_num;
+  uint32_t freq_hz;
+  ledc_clk_cfg_t clk_cfg;
+} ledc_timer_config_t;
+typedef struct {
+  int gpio_num;
+  ledc_mode_t speed_mode;
+  ledc_channel_t channel;
+  ledc_intr_type_t intr_type;
+  ledc_timer_t timer_sel;
+  uint32_t duty;
+  int hpoint;
+} ledc_channel_config_t;
+esp_err_t ledc_timer_config(const ledc_timer_config_t* config);
+esp_err_t ledc_channel_config(const ledc_channel_config_t* config);
+
+typedef struct {
+  int pin_pwdn;
+  int pin_reset;
+  int pin_xclk;
+  int pin_sccb_sda;
+  int pin_sccb_scl;
+  int pin_d7, pin_d6, pin_d5, pin_d4, pin_d3, pin_d2, pin_d1, pin_d0;
+  int pin_vsync;
+  int pin_href;
+  int pin_pclk;
+  int xclk_freq_hz;
+  ledc_timer_t ledc_timer;
+  ledc_channel_t ledc_channel;
+  pixformat_t pixel_format;
+  framesize_t frame_size;
+  int jpeg_quality;
+  size_t fb_count;
+  camera_fb_location_t fb_location;
+  camera_grab_mode_t grab_mode;
+  int sccb_i2c_port;
+} camera_config_t;
+
+esp_err_t esp_camera_init(const camera_config_t* config);
+esp_err_t esp_camera_deinit();
+
+camera_fb_t* esp_camera_fb_get();
+void esp_camera_fb_return(camera_fb_t* fb);
+sensor_t* esp_camera_sensor_get();
+bool fmt2jpg(uint8_t* src, size_t srcLen, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t** out, size_t* outLen);
+bool jpg2rgb888(const uint8_t* src, size_t srcLen, uint8_t* out, jpg_scale_t scale);
+bool fmt2rgb888(const uint8_t* src, size_t srcLen, pixformat_t format, uint8_t* rgbBuf);
@@ -0,0 +1,90 @@
+#pragma once
+#include "Arduino.h"
+#include <map>
+
+// request state is kept by the host tests, so handlers can be driven directly
+typedef void* httpd_handle_t;
+struct hostHttp {
+  std::map<std::string, std::string> reqHdrs;
+  std::string status = "200 OK";
+  std::map<std::string, std::string> respHdrs;
+  std::vector<uint8_t> body;
+  bool ended = false; // final chunk sent
+};
+typedef struct httpd_req {
+  httpd_handle_t handle;
+  int method;
+  char uri[512];
+  size_t content_len;
+  void* user_ctx;
+  void* aux; // hostHttp, if response to be checked
+} httpd_req_t;
+typedef esp_err_t (*httpd_uri_func)(httpd_req_t* req);
+typedef struct {
+  const char* uri;
+  int method;
+  httpd_uri_func handler;
+  void* user_ctx;
+  bool is_websocket;
+  bool handle_ws_control_frames;
+  const char* supported_subprotocol;
+} httpd_uri_t;
+enum http_method {HTTP_DELETE, HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_PUT, HTTP_CONNECT, HTTP_OPTIONS, HTTP_TRACE,
+  HTTP_COPY, HTTP_LOCK, HTTP_MKCOL, HTTP_MOVE, HTTP_PROPFIND, HTTP_PROPPATCH, HTTP_SEARCH, HTTP_UNLOCK, HTTP_BIND,
+  HTTP_REBIND, HTTP_UNBIND, HTTP_ACL, HTTP_REPORT, HTTP_MKACTIVITY, HTTP_CHECKOUT, HTTP_MERGE, HTTP_MSEARCH,
+  HTTP_NOTIFY, HTTP_SUBSCRIBE, HTTP_UNSUBSCRIBE, HTTP_PATCH, HTTP_PURGE, HTTP_MKCALENDAR, HTTP_LINK, HTTP_UNLINK};
+#define HTTPD_RESP_USE_STRLEN -1
+#define HTTPD_200 "200 OK"
+#define HTTPD_400 "400 Bad Request"
+#define HTTPD_404 "404 Not Found"
+#define HTTPD_500 "500 Internal Server Error"
+typedef enum {HTTPD_500_INTERNAL_SERVER_ERROR, HTTPD_400_BAD_REQUEST, HTTPD_404_NOT_FOUND} httpd_err_code_t;
+typedef enum {HTTPD_WS_TYPE_CONTINUE, HTTPD_WS_TYPE_TEXT, HTTPD_WS_TYPE_BINARY, HTTPD_WS_TYPE_CLOSE = 0x8} httpd_ws_type_t;
+typedef enum {HTTPD_WS_CLIENT_INVALID, HTTPD_WS_CLIENT_HTTP, HTTPD_WS_CLIENT_WEBSOCKET} httpd_ws_client_info_t;
+#define HTTPD_SOCK_ERR_FAIL -1
+#define HTTPD_SOCK_ERR_INVALID -2
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+typedef esp_err_t (*httpd_err_handler_func_t)(httpd_req_t* req, httpd_err_code_t error);
+typedef struct {
+  unsigned task_priority;
+  size_t stack_size;
+  uint16_t server_port;
+  uint16_t max_open_sockets;
+  uint16_t max_uri_handlers;
+  bool lru_purge_enable;
+} httpd_config_t;
+#define HTTPD_DEFAULT_CONFIG() {5, 4096, 80, 7, 8, false}
+typedef struct {
+  bool final;
+  bool fragmented;
+  httpd_ws_type_t type;
+  uint8_t* payload;
+  size_t len;
+} httpd_ws_frame_t;
+
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len);
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len);
+esp_err_t httpd_resp_sendstr(httpd_req_t* req, const char* str);
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t* req, const char* str);
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type);
+esp_err_t httpd_resp_set_status(httpd_req_t* req, const char* status);
+esp_err_t httpd_resp_set_hdr(httpd_req_t* req, const char* field, const char* value);
+esp_err_t httpd_resp_send_err(httpd_req_t* req, httpd_err_code_t error, const char* msg);
+esp_err_t httpd_resp_send_404(httpd_req_t* req);
+esp_err_t httpd_resp_send_500(httpd_req_t* req);
+size_t httpd_req_get_hdr_value_len(httpd_req_t* req, const char* field);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* req, const char* field, char* val, size_t valSize);
+size_t httpd_req_get_url_query_len(httpd_req_t* req);
+esp_err_t httpd_req_get_url_query_str(httpd_req_t* req, char* buf, size_t bufLen);
+esp_err_t httpd_query_key_value(const char* qry, const char* key, char* val, size_t valSize);
+int httpd_req_recv(httpd_req_t* req, char* buf, size_t bufLen);
+int httpd_req_to_sockfd(httpd_req_t* req);
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t* frame);
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd);
+int httpd_socket_send(httpd_handle_t hd, int sockfd, const char* buf, size_t bufLen, int flags);
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd);
+esp_err_t httpd_ws_recv_frame(httpd_req_t* req, httpd_ws_frame_t* pkt, size_t maxLen);
+esp_err_t httpd_start(httpd_handle_t* handle, const httpd_config_t* config);
+esp_err_t httpd_stop(httpd_handle_t handle);
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uriHandler);
+esp_err_t httpd_register_err_handler(httpd_handle_t handle, httpd_err_code_t error, httpd_err_handler_func_t handler);
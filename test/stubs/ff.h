@@ -0,0 +1,41 @@
+#pragma once
+#include "Arduino.h"
+
+// FatFs declarations used for direct SD writes and card geometry
+typedef uint8_t BYTE;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef uint64_t FSIZE_t;
+typedef enum {FR_OK, FR_DISK_ERR, FR_INT_ERR, FR_NOT_READY, FR_NO_FILE} FRESULT;
+typedef struct {
+  uint16_t csize;
+  uint16_t ssize;
+} FATFS;
+typedef struct {
+  FSIZE_t fptr;
+} FIL;
+#define FA_READ 0x01
+#define FA_WRITE 0x02
+#define FA_OPEN_EXISTING 0x00
+#define FA_CREATE_ALWAYS 0x08
+#define FF_MAX_SS 512
+#define FF_MIN_SS 512
+#define f_tell(fp) ((fp)->fptr)
+
+FRESULT f_open(FIL* fp, const char* path, uint8_t mode);
+FRESULT f_write(FIL* fp, const void* buf, UINT len, UINT* written);
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs);
+FRESULT f_sync(FIL* fp);
+FRESULT f_close(FIL* fp);
+typedef struct {
+  uint8_t fmt;
+  uint8_t n_fat;
+  UINT align;
+  UINT n_root;
+  DWORD au_size;
+} MKFS_PARM;
+#define FM_ANY 0x07
+FRESULT f_mkfs(const char* path, const MKFS_PARM* opt, void* work, UINT len);
+void* ff_memalloc(UINT size);
+void ff_memfree(void* mblock);
+FRESULT f_getfree(const char* path, DWORD* clusters, FATFS** fs);
@@ -0,0 +1,81 @@
+// Host stand ins for app functions outside the sources under test
+//
+// Only used by the host tests in test/, never by the sketch build.
+
+#include "appGlobals.h"
+#include "ff.h"
+
+bool dbgVerbose = false;
+
+/******************** utils.cpp ********************/
+
+bool timeSynchronized = false;
+
+void dateFormat(char* inBuff, size_t inBuffLen, bool isFolder) {
+  // construct filename from date/time
+  time_t currEpoch = time(NULL);
+  if (isFolder) strftime(inBuff, inBuffLen, "/%Y%m%d", localtime(&currEpoch));
+  else strftime(inBuff, inBuffLen, "/%Y%m%d/%Y%m%d_%H%M%S", localtime(&currEpoch));
+}
+
+bool changeExtension(char* fileName, const char* newExt) {
+  // replace original file extension with supplied extension (buffer must be large enough)
+  size_t inNamePtr = strlen(fileName);
+  while (inNamePtr > 0 && fileName[inNamePtr] != '.') inNamePtr--;
+  inNamePtr++;
+  size_t extLen = strlen(newExt);
+  memcpy(fileName + inNamePtr, newExt, extLen);
+  fileName[inNamePtr + extLen] = 0;
+  return (inNamePtr > 1) ? true : false;
+}
+
+char* fmtSize(uint64_t sizeVal) {
+  static char returnStr[20];
+  snprintf(returnStr, sizeof(returnStr), "%llu bytes", (unsigned long long)sizeVal);
+  return returnStr;
+}
+
+void replaceChar(char* s, char c, char r) {
+  // replace specified character in string
+  for (; *s; s++) if (*s == c) *s = r;
+}
+
+void showProgress(const char* marker) {}
+
+const char* espErrMsg(esp_err_t errCode) {
+  return esp_err_to_name(errCode);
+}
+
+/******************** streamServer.cpp ********************/
+
+uint8_t vidStreams = 1;
+bool mp4Remux = false;
+
+/******************** utilsLog.cpp ********************/
+
+void logLine() {}
+
+void checkMemory(const char* source) {}
+
+void flush_log(bool andClose) {}
+
+/******************** motionDetect.cpp ********************/
+
+void dropMotionThumb() {}
+
+uint8_t* motionThumb(size_t* jpgLen) {
+  // no motion bitmap on host
+  *jpgLen = 0;
+  return NULL;
+}
+
+/******************** FatFs ********************/
+
+// direct write path is not available on host, so recordings use the file system
+
+FRESULT f_open(FIL* fp, const char* path, BYTE mode) { return FR_INT_ERR; }
+FRESULT f_close(FIL* fp) { return FR_INT_ERR; }
+FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw) { return FR_INT_ERR; }
+FRESULT f_lseek(FIL* fp, FSIZE_t ofs) { return FR_INT_ERR; }
+FRESULT f_sync(FIL* fp) { return FR_INT_ERR; }
+FRESULT f_getfree(const char* path, DWORD* nclst, FATFS** fatfs) { return FR_INT_ERR; }
@@ -0,0 +1,527 @@
+// Host implementation of the Arduino core and FreeRTOS calls declared in stubs/Arduino.h
+// Tasks run as threads, notifications and semaphores use condition variables,
+// and the file system is a map of paths to in memory content.
+//
+// Only used by the host tests in test/, never by the sketch build.
+
+#include "Arduino.h"
+#include "esp_http_server.h"
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+static const size_t HOST_MEG = 1024 * 1024;
+static const size_t PS_REDZONE = 16; // bytes past each psram allocation
+
+/******************** time ********************/
+
+static const auto startClock = std::chrono::steady_clock::now();
+
+uint32_t millis() {
+  // ms since start of test
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startClock).count();
+}
+
+uint32_t micros() {
+  // us since start of test
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startClock).count();
+}
+
+int64_t esp_timer_get_time() {
+  return micros();
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void vTaskDelay(TickType_t ticks) {
+  delay(ticks);
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+TickType_t xTaskGetTickCount() {
+  return millis();
+}
+
+/******************** tasks ********************/
+
+struct hostSync {
+  // counting semaphore, also used for task notifications
+  std::mutex mtx;
+  std::condition_variable cv;
+  uint32_t count = 0;
+  uint32_t maxCount = UINT32_MAX;
+};
+
+struct hostTask {
+  hostSync notify;
+};
+
+static thread_local hostTask* thisTask = NULL;
+
+static bool takeSync(hostSync* sync, TickType_t wait, bool clearAll, uint32_t* taken = NULL) {
+  // wait for count to be non zero, then decrement or clear it
+  std::unique_lock<std::mutex> lock(sync->mtx);
+  auto ready = [sync] { return sync->count > 0; };
+  if (wait == portMAX_DELAY) sync->cv.wait(lock, ready);
+  else if (!sync->cv.wait_for(lock, std::chrono::milliseconds(wait), ready)) return false;
+  if (taken != NULL) *taken = clearAll ? sync->count : 1;
+  sync->count = clearAll ? 0 : sync->count - 1;
+  return true;
+}
+
+static void giveSync(hostSync* sync) {
+  {
+    std::lock_guard<std::mutex> lock(sync->mtx);
+    if (sync->count < sync->maxCount) sync->count++;
+  }
+  sync->cv.notify_all();
+}
+
+static hostTask* currentTask() {
+  // main test thread gets a task on first use
+  if (thisTask == NULL) thisTask = new hostTask;
+  return thisTask;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle) {
+  // task runs until process exits, as tasks in the app do not return
+  hostTask* task = new hostTask;
+  if (handle != NULL) *handle = task;
+  std::thread([task, fn, param] {
+    thisTask = task;
+    fn(param);
+  }).detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreateWithCaps(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle, UBaseType_t caps) {
+  return xTaskCreate(fn, name, stack, param, pri, handle);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle, BaseType_t core) {
+  return xTaskCreate(fn, name, stack, param, pri, handle);
+}
+
+BaseType_t xTaskCreatePinnedToCoreWithCaps(TaskFunction_t fn, const char* name, uint32_t stack, void* param, UBaseType_t pri, TaskHandle_t* handle, BaseType_t core, UBaseType_t caps) {
+  return xTaskCreate(fn, name, stack, param, pri, handle);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  // only called by a task on itself as it ends, so just park the thread
+  if (task == NULL) while (true) delay(1000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return currentTask();
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  return 1024;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+  uint32_t taken = 0;
+  takeSync(&currentTask()->notify, wait, clear == pdTRUE, &taken);
+  return taken;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  if (task != NULL) giveSync(&((hostTask*)task)->notify);
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* woken) {
+  xTaskNotifyGive(task);
+}
+
+/******************** semaphores ********************/
+
+// critical sections exclude all other tasks, whichever mux is given
+static std::recursive_mutex criticalMtx;
+
+void portENTER_CRITICAL(portMUX_TYPE* mux) {
+  criticalMtx.lock();
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE* mux) {
+  criticalMtx.unlock();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  hostSync* sync = new hostSync;
+  sync->count = sync->maxCount = 1;
+  return sync;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  hostSync* sync = new hostSync;
+  sync->maxCount = 1;
+  return sync;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait) {
+  return takeSync((hostSync*)sem, wait, false) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  giveSync((hostSync*)sem);
+  return pdTRUE;
+}
+
+/******************** logging ********************/
+
+// LOG_SEND takes a buffer from logFreePool then sends it on logQueue,
+// so the host queue hands out a buffer then prints it when sent back
+QueueHandle_t logFreePool = (QueueHandle_t)"logFreePool";
+QueueHandle_t logQueue = (QueueHandle_t)"logQueue";
+static std::mutex logMtx;
+static thread_local char logBuff[256];
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait) {
+  if (queue != logFreePool) return pdFALSE;
+  *(char**)item = logBuff;
+  return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait) {
+  if (queue == logQueue) {
+    std::lock_guard<std::mutex> lock(logMtx);
+    fputs(*(char* const*)item, stdout);
+  }
+  return pdTRUE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t itemSize) {
+  return NULL;
+}
+
+void logIncrementDropCount() {}
+
+const char* esp_log_system_timestamp() {
+  static thread_local char stamp[16];
+  uint32_t ms = millis();
+  snprintf(stamp, sizeof(stamp), "%02lu:%02lu.%03lu", (unsigned long)(ms / 60000), (unsigned long)(ms / 1000 % 60), (unsigned long)(ms % 1000));
+  return stamp;
+}
+
+const char* pathToFileName(const char* path) {
+  const char* name = strrchr(path, '/');
+  return name == NULL ? path : name + 1;
+}
+
+const char* esp_err_to_name(esp_err_t err) {
+  return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+char* itoa(int val, char* s, int radix) {
+  // only decimal used by app
+  sprintf(s, "%d", val);
+  return s;
+}
+
+/******************** memory ********************/
+
+void* ps_malloc(size_t len) {
+  // bytes just past allocation hold a pattern, so that content read beyond it shows up in output
+  uint8_t* ptr = (uint8_t*)malloc(len + PS_REDZONE);
+  if (ptr != NULL) memset(ptr + len, 0xA5, PS_REDZONE);
+  return ptr;
+}
+
+void* ps_calloc(size_t cnt, size_t len) {
+  return calloc(cnt, len);
+}
+
+void* ps_realloc(void* ptr, size_t len) {
+  return realloc(ptr, len);
+}
+
+void* heap_caps_malloc(size_t len, uint32_t caps) {
+  return malloc(len);
+}
+
+void* heap_caps_aligned_alloc(size_t align, size_t len, uint32_t caps) {
+  return aligned_alloc(align, (len + align - 1) / align * align);
+}
+
+void heap_caps_free(void* ptr) {
+  free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  return 4 * HOST_MEG;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return HOST_MEG;
+}
+
+void heap_caps_malloc_extmem_enable(size_t limit) {}
+
+bool psramFound() {
+  return true;
+}
+
+uint32_t esp_random() {
+  static uint32_t seed = 0x12345678;
+  seed = seed * 1664525 + 1013904223;
+  return seed;
+}
+
+EspClass ESP;
+size_t EspClass::getFreeHeap() { return 256 * 1024; }
+size_t EspClass::getFreePsram() { return 4 * HOST_MEG; }
+size_t EspClass::getPsramSize() { return 8 * HOST_MEG; }
+size_t EspClass::getMaxAllocHeap() { return 128 * 1024; }
+size_t EspClass::getMaxAllocPsram() { return 4 * HOST_MEG; }
+uint32_t EspClass::getCpuFreqMHz() { return 240; }
+uint32_t EspClass::getSketchSize() { return HOST_MEG; }
+uint32_t EspClass::getFreeSketchSpace() { return HOST_MEG; }
+void EspClass::restart() { exit(1); }
+
+/******************** file system ********************/
+
+namespace fs {
+
+struct memFile {
+  std::vector<uint8_t> data;
+};
+
+static std::mutex fsMtx; // content map shared by tasks, each file only used by one task at a time
+static std::map<std::string, memFile*> memFiles;
+static std::map<std::string, bool> memDirs;
+
+static std::string parentDir(const std::string& path) {
+  size_t slash = path.rfind('/');
+  return slash == 0 || slash == std::string::npos ? "/" : path.substr(0, slash);
+}
+
+File::File(memFile* mf, const std::string& path, const char* mode) : mf(mf), filePath(path) {
+  if (mode[0] == 'a') pos = mf->data.size();
+}
+
+size_t File::write(const uint8_t* buf, size_t len) {
+  if (mf == NULL) return 0;
+  if (pos + len > mf->data.size()) mf->data.resize(pos + len);
+  memcpy(mf->data.data() + pos, buf, len);
+  pos += len;
+  return len;
+}
+
+int File::available() {
+  return mf == NULL ? 0 : (int)(mf->data.size() - std::min(pos, mf->data.size()));
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) ? c : -1;
+}
+
+size_t File::read(uint8_t* buf, size_t len) {
+  if (mf == NULL || pos >= mf->data.size()) return 0;
+  len = std::min(len, mf->data.size() - pos);
+  memcpy(buf, mf->data.data() + pos, len);
+  pos += len;
+  return len;
+}
+
+bool File::seek(uint32_t newPos, SeekMode mode) {
+  if (mf == NULL) return false;
+  if (mode == SeekCur) newPos += pos;
+  else if (mode == SeekEnd) newPos += mf->data.size();
+  pos = newPos;
+  return true;
+}
+
+size_t File::size() const {
+  return mf == NULL ? 0 : mf->data.size();
+}
+
+void File::close() {
+  mf = NULL;
+  isDir = false;
+}
+
+const char* File::name() const {
+  const char* slash = strrchr(filePath.c_str(), '/');
+  return slash == NULL ? filePath.c_str() : slash + 1;
+}
+
+File File::openNextFile(const char* mode) {
+  // entries directly within this folder, files then folders, in path order
+  std::lock_guard<std::mutex> lock(fsMtx);
+  std::vector<std::string> entries;
+  for (auto& f : memFiles) if (parentDir(f.first) == filePath) entries.push_back(f.first);
+  for (auto& d : memDirs) if (d.first != "/" && parentDir(d.first) == filePath) entries.push_back(d.first);
+  File next;
+  if (!isDir || dirIdx >= entries.size()) return next;
+  next.filePath = entries[dirIdx++];
+  auto it = memFiles.find(next.filePath);
+  if (it != memFiles.end()) next.mf = it->second;
+  else next.isDir = true;
+  return next;
+}
+
+File FS::open(const char* path, const char* mode, bool create) {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  File file;
+  if (memDirs.count(path)) {
+    file.filePath = path;
+    file.isDir = true;
+    return file;
+  }
+  auto it = memFiles.find(path);
+  if (mode[0] == 'w' || mode[0] == 'a') {
+    if (it == memFiles.end()) it = memFiles.emplace(path, new memFile).first;
+    else if (mode[0] == 'w') it->second->data.clear();
+  } else if (it == memFiles.end()) return file;
+  return File(it->second, path, mode);
+}
+
+bool FS::exists(const char* path) {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  return memFiles.count(path) || memDirs.count(path);
+}
+
+bool FS::remove(const char* path) {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  auto it = memFiles.find(path);
+  if (it == memFiles.end()) return false;
+  delete it->second;
+  memFiles.erase(it);
+  return true;
+}
+
+bool FS::rename(const char* pathFrom, const char* pathTo) {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  auto it = memFiles.find(pathFrom);
+  if (it == memFiles.end()) return false;
+  memFile* mf = it->second;
+  memFiles.erase(it);
+  auto old = memFiles.find(pathTo);
+  if (old != memFiles.end()) {
+    delete old->second;
+    memFiles.erase(old);
+  }
+  memFiles[pathTo] = mf;
+  return true;
+}
+
+bool FS::mkdir(const char* path) {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  memDirs[path] = true;
+  return true;
+}
+
+bool FS::rmdir(const char* path) {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  return memDirs.erase(path) > 0;
+}
+
+uint64_t FS::totalBytes() {
+  return 16ULL * 1024 * HOST_MEG;
+}
+
+uint64_t FS::usedBytes() {
+  std::lock_guard<std::mutex> lock(fsMtx);
+  uint64_t used = 0;
+  for (auto& f : memFiles) used += f.second->data.size();
+  return used;
+}
+
+} // namespace fs
+
+fs::SDMMCFS SD_MMC;
+fs::LittleFSFS LittleFS;
+
+std::vector<uint8_t>& hostFileData(const char* path) {
+  // content of file, created empty if absent
+  std::lock_guard<std::mutex> lock(fs::fsMtx);
+  auto it = fs::memFiles.find(path);
+  if (it == fs::memFiles.end()) it = fs::memFiles.emplace(path, new fs::memFile).first;
+  return it->second->data;
+}
+
+void hostFilesClear() {
+  std::lock_guard<std::mutex> lock(fs::fsMtx);
+  for (auto& f : fs::memFiles) delete f.second;
+  fs::memFiles.clear();
+  fs::memDirs.clear();
+  fs::memDirs["/"] = true;
+}
+
+/******************** http server ********************/
+
+// responses are recorded in the hostHttp of the request, if it has one
+
+static hostHttp* reqHttp(httpd_req_t* req) {
+  return req == NULL ? NULL : (hostHttp*)req->aux;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t* req, const char* buf, ssize_t len) {
+  hostHttp* http = reqHttp(req);
+  if (len == HTTPD_RESP_USE_STRLEN) len = buf == NULL ? 0 : strlen(buf);
+  if (http == NULL) return ESP_OK;
+  if (http->ended) return ESP_FAIL; // response already complete
+  if (buf == NULL || !len) http->ended = true;
+  else http->body.insert(http->body.end(), (const uint8_t*)buf, (const uint8_t*)buf + len);
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t* req, const char* str) {
+  return httpd_resp_send_chunk(req, str, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_send(httpd_req_t* req, const char* buf, ssize_t len) {
+  esp_err_t res = buf == NULL ? ESP_OK : httpd_resp_send_chunk(req, buf, len);
+  return res == ESP_OK ? httpd_resp_send_chunk(req, NULL, 0) : res;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t* req, const char* str) {
+  return httpd_resp_send(req, str, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t* req, const char* status) {
+  hostHttp* http = reqHttp(req);
+  if (http != NULL) http->status = status;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t* req, const char* field, const char* value) {
+  hostHttp* http = reqHttp(req);
+  if (http != NULL) http->respHdrs[field] = value;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t* req, const char* type) {
+  return httpd_resp_set_hdr(req, "Content-Type", type);
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t* req) {
+  httpd_resp_set_status(req, HTTPD_404);
+  return httpd_resp_send(req, NULL, 0);
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* req, const char* field, char* val, size_t valSize) {
+  // value truncated to fit, as by esp-idf
+  hostHttp* http = reqHttp(req);
+  if (http == NULL || !http->reqHdrs.count(field)) return ESP_ERR_NOT_FOUND;
+  snprintf(val, valSize, "%s", http->reqHdrs[field].c_str());
+  return ESP_OK;
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd) {
+  // no browser connected
+  return HTTPD_WS_CLIENT_INVALID;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t* frame) {
+  return ESP_FAIL;
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include "Arduino.h"
+
+esp_err_t esp_vfs_fat_create_contiguous_file(const char* basePath, const char* fullPath, uint64_t size, bool alloc);
+size_t esp_vfs_fat_get_allocation_unit_size(size_t sectorSize, size_t requestedSize);
@@ -0,0 +1,168 @@
+// Audio ring of audio.cpp, from the audio task to the SD write task in mjpeg2sd.cpp
+// Audio is compiled in here, as when INCLUDE_AUDIO is set true in appGlobals.h.
+// Ring positions must wrap, a full ring must drop input rather than overwrite,
+// and the recording must interleave exactly the audio accepted, in order.
+
+#include "appGlobals.h"
+#undef INCLUDE_AUDIO
+#define INCLUDE_AUDIO true
+#include "../audio.cpp"
+#include "../mjpeg2sd.cpp"
+#include "hostRecord.h"
+#include <atomic>
+#include <thread>
+
+static std::vector<uint8_t> accepted; // audio accepted by ring, in order
+static uint32_t audioSeq = 0;
+
+static bool queueAudio(size_t audLen) {
+  // add audio to ring as audio task does, keeping it if accepted
+  std::vector<uint8_t> audio(audLen);
+  for (auto& audByte : audio) {
+    audByte = audioSeq * 7 + (audioSeq >> 9);
+    audioSeq++;
+  }
+  uint32_t drops = audDrops;
+  queueAudioRecord(audio.data(), audLen);
+  if (audDrops != drops) {
+    CHECK_EQ(audDrops - drops, audLen);
+    return false;
+  }
+  accepted.insert(accepted.end(), audio.begin(), audio.end());
+  return true;
+}
+
+static size_t takeAudio(std::vector<uint8_t>& taken, size_t audLen) {
+  // remove audio from ring as SD write task does, in parts if ring wraps
+  size_t takenLen = 0;
+  while (takenLen < audLen) {
+    size_t partLen = audLen - takenLen;
+    const uint8_t* audPart = peekAudioRecord(&partLen);
+    CHECK(partLen > 0);
+    CHECK(audPart >= audRing && audPart + partLen <= audRing + AUD_RING_LEN);
+    if (!partLen) break;
+    taken.insert(taken.end(), audPart, audPart + partLen);
+    releaseAudioRecord(partLen);
+    takenLen += partLen;
+  }
+  return takenLen;
+}
+
+static void startAudio(uint32_t ringPos) {
+  // start recording audio, with ring positions as given
+  micUse = true;
+  micGain = MIC_GAIN_CENTER;
+  if (audRing == NULL) audRing = (uint8_t*)ps_malloc(AUD_RING_LEN);
+  startAudioRecord();
+  CHECK(micRecording);
+  audHead = audTail = ringPos;
+  accepted.clear();
+}
+
+static void checkWrap() {
+  // ring positions and ring content continue through wraparound
+  startAudio(UINT32_MAX - 5000);
+  std::vector<uint8_t> taken;
+  for (uint32_t i = 0; i < 400; i++) {
+    CHECK(queueAudio(1000 + i % 37));
+    if (i % 3 == 2) takeAudio(taken, audioRecordLen());
+  }
+  takeAudio(taken, audioRecordLen());
+  CHECK(audHead < UINT32_MAX - 5000);
+  CHECK_EQ(audioRecordLen(), 0);
+  CHECK(accepted.size() > 3 * AUD_RING_LEN);
+  CHECK(taken == accepted);
+  finishAudioRecord(false);
+}
+
+static void checkFull() {
+  // full ring drops whole input, then accepts input as space freed
+  startAudio(AUD_RING_LEN - 3000);
+  uint32_t queued = 0;
+  while (queueAudio(4000)) queued++;
+  CHECK_EQ(queued, AUD_RING_LEN / 4000);
+  CHECK_EQ(audioRecordLen(), queued * 4000);
+  CHECK_EQ(audDrops, 4000);
+  CHECK(!queueAudio(4000));
+  CHECK(queueAudio(AUD_RING_LEN - queued * 4000)); // fills ring exactly
+  CHECK(!queueAudio(4));
+  std::vector<uint8_t> taken;
+  CHECK_EQ(takeAudio(taken, 4000), 4000);
+  CHECK(queueAudio(4000));
+  CHECK_EQ(audioRecordLen(), AUD_RING_LEN);
+  takeAudio(taken, audioRecordLen());
+  CHECK(taken == accepted);
+  finishAudioRecord(false);
+}
+
+static void checkRecording() {
+  // audio task fills ring while frames are saved, several times ring length in all
+  openRecording();
+  CHECK(micRecording);
+  accepted.clear();
+  std::atomic<bool> audioDone(false);
+  uint32_t dropped = 0;
+  std::thread audioTask([&] {
+    while (accepted.size() < 3 * AUD_RING_LEN) {
+      if (!queueAudio(sampleBytes)) dropped++;
+      std::this_thread::sleep_for(std::chrono::microseconds(300));
+    }
+    audioDone = true;
+  });
+  uint32_t frameNum = 0;
+  while (!audioDone) {
+    recordFrame(frameNum, testJpegLen(frameNum));
+    frameNum++;
+    delay(2);
+  }
+  audioTask.join();
+  // frames located for live playback while recording, searching index as audio interleaved
+  std::vector<size_t> livePos;
+  for (uint32_t i = 0; i < frameNum; i++) livePos.push_back(findLiveFrame(i, SIZE_MAX));
+  // final audio saved when recording closed
+  std::vector<uint8_t>& avi = hostFileData(closeRecording());
+  CHECK_EQ(audioRecordLen(), 0);
+  printf("frames %u, audio %zu, dropped %u\n", frameNum, accepted.size(), dropped);
+
+  // interleaved audio chunks hold accepted audio, frames still found by playback
+  aviSource src = {readVector, &avi, avi.size()};
+  bool isOdml = false;
+  size_t filePos = findAviMovi(&src, &isOdml);
+  CHECK(filePos > 0);
+  std::vector<uint8_t> aviAudio;
+  uint32_t chunkLen, audChunks = 0, vidChunks = 0;
+  uint8_t chunkType;
+  while ((chunkType = nextAviChunk(&src, filePos, &chunkLen)) != AVI_END) {
+    uint32_t chunkSize = rd32(avi, filePos + 4);
+    if (chunkType == AVI_AUDIO) {
+      CHECK_EQ(chunkSize & 3, 0);
+      aviAudio.insert(aviAudio.end(), avi.begin() + filePos + CHUNK_HDR, avi.begin() + filePos + CHUNK_HDR + chunkSize);
+      audChunks++;
+    } else if (chunkType == AVI_VIDEO) vidChunks++;
+    filePos += chunkLen;
+  }
+  CHECK(audChunks > 1);
+  CHECK(aviAudio == accepted);
+  CHECK_EQ(vidChunks, frameNum);
+  CHECK_EQ(recChunks.size(), frameNum);
+  for (uint32_t i = 0; i < frameNum && i < recChunks.size(); i++) {
+    size_t framePos = findAviFrame(&src, i);
+    CHECK_EQ(livePos[i], framePos);
+    CHECK(framePos > 0 && framePos + CHUNK_HDR + recChunks[i].size() <= avi.size());
+    if (framePos > 0 && framePos + CHUNK_HDR + recChunks[i].size() <= avi.size())
+      CHECK(!memcmp(avi.data() + framePos + CHUNK_HDR, recChunks[i].data(), recChunks[i].size()));
+  }
+}
+
+int main() {
+  testCase("ring wraparound");
+  checkWrap();
+
+  testCase("ring full");
+  checkFull();
+
+  testCase("audio interleaved in recording");
+  checkRecording();
+
+  return testEnd();
+}
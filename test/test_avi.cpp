@@ -0,0 +1,108 @@
+// Conformance of avi recordings written by mjpeg2sd.cpp and avi.cpp
+// Recordings of each shape are checked by hostAvi.h independently of avi.cpp,
+// as are the index spill, live playback lookups and crash recovery.
+
+#include "../mjpeg2sd.cpp"
+#include "hostAvi.h"
+
+static size_t smallJpegLen(uint32_t frameNum) {
+  // many frames per segment, so index spills within segments
+  return 60 + frameNum % 13;
+}
+
+static void checkSpill() {
+  // index entries beyond window are spilled to index file as recording proceeds
+  openRecording();
+  for (uint32_t i = 0; i < 300; i++) recordFrame(i, smallJpegLen(i));
+  // window of 256 entries spilled after header, when next entry added
+  std::vector<uint8_t>& idx = hostFileData(IDXTEMP);
+  CHECK(idx.size() > 256 * 16);
+  size_t idxBase = idx.size() - 256 * 16;
+  uint32_t offset = 4;
+  for (uint32_t i = 0; i < 256; i++) {
+    size_t entry = idxBase + i * 16;
+    CHECK(isTag(idx, entry, "00dc"));
+    CHECK_EQ(rd32(idx, entry + 8), offset);
+    CHECK_EQ(rd32(idx, entry + 12), recChunks[i].size());
+    offset += recChunks[i].size() + CHUNK_HDR + sizeof(tagChunk);
+  }
+  for (uint32_t i = 300; i < 1200; i++) recordFrame(i, smallJpegLen(i));
+  // then read back from index file to build avi indexes
+  CHECK_EQ(checkAvi(closeRecording()), 2);
+  CHECK_EQ(recChunks.size(), 1200);
+  CHECK(!STORAGE.exists(IDXTEMP));
+}
+
+static void checkLive() {
+  // frames of recording in progress located for live playback, recent ones from live ring
+  // and earlier ones from index, as found in completed recording
+  openRecording();
+  for (uint32_t i = 0; i < 1200; i++) recordFrame(i, smallJpegLen(i));
+  std::vector<size_t> livePos;
+  for (uint32_t i = 0; i < 1200; i++) livePos.push_back(findLiveFrame(i, SIZE_MAX));
+  CHECK_EQ(findLiveFrame(1200, SIZE_MAX), 0); // not yet recorded
+  CHECK_EQ(findLiveFrame(1199, livePos[1199]), 0); // not yet written
+  std::vector<uint8_t>& avi = hostFileData(closeRecording());
+  CHECK_EQ(findLiveFrame(0, SIZE_MAX), 0); // recording ended
+  aviSource src = {readVector, &avi, avi.size()};
+  for (uint32_t i = 0; i < 1200; i++) CHECK_EQ(livePos[i], findAviFrame(&src, i));
+}
+
+static void checkRecovery() {
+  // recording interrupted after a checkpoint, in a file beyond whose new content
+  // lie whole chunks of an earlier recording, as when a pool file is reused
+  std::vector<uint8_t> earlier = hostFileData(recordAvi(60));
+  openRecording();
+  CHECK(!aviRec.direct);
+  for (uint32_t i = 0; i < 20; i++) recordFrame(i, testJpegLen(i));
+  ckptMs = millis() - CHECKPOINT_MS - 1; // checkpoint at next buffer write
+  for (uint32_t i = 20; i < 40; i++) recordFrame(i, testJpegLen(i));
+  aviRec.file.close(); // power lost, with last buffer not written
+  std::vector<uint8_t>& avi = hostFileData(AVITEMP);
+  size_t written = avi.size();
+  CHECK(written > AVI_HEADER_LEN);
+  size_t earlierEnd = AVI_HEADER_LEN;
+  while (isTag(earlier, earlierEnd, "00dc") || isTag(earlier, earlierEnd, "JUNK")) earlierEnd += CHUNK_HDR + rd32(earlier, earlierEnd + 4);
+  avi.insert(avi.end(), earlier.begin() + AVI_HEADER_LEN, earlier.begin() + earlierEnd);
+
+  // only chunks of this recording recovered, up to last one written whole
+  recoverAvi();
+  CHECK(!STORAGE.exists(AVITEMP));
+  CHECK(!STORAGE.exists(IDXTEMP));
+  CHECK(strstr(aviFileName, "_R.") != NULL);
+  std::vector<uint8_t>& recovered = hostFileData(aviFileName);
+  uint32_t frames = rd32(recovered, 0x8C);
+  recovered.resize(CHUNK_HDR + rd32(recovered, 4)); // truncated after RIFF on SD, not by host storage
+  CHECK(recovered.size() > written);
+  CHECK(frames > 20 && frames < 40);
+  recChunks.resize(frames);
+  CHECK_EQ(checkAvi(aviFileName), 1);
+}
+
+int main() {
+  testCase("single segment");
+  CHECK_EQ(checkAvi(recordAvi(40)), 1);
+
+  testCase("missed capture interval");
+  CHECK_EQ(checkAvi(recordAvi(30, 12)), 1);
+  CHECK_EQ(recChunks[12].size(), 0);
+
+  testCase("OpenDML segments");
+  CHECK_EQ(checkAvi(recordAvi(150)), 3);
+
+  testCase("max file size");
+  CHECK_EQ(checkAvi(recordAvi(400)), 4);
+  CHECK(aviFull);
+  CHECK(recChunks.size() < 400);
+
+  testCase("index spill");
+  checkSpill();
+
+  testCase("live playback frames");
+  checkLive();
+
+  testCase("crash recovery with earlier content");
+  checkRecovery();
+
+  return testEnd();
+}
@@ -0,0 +1,138 @@
+// Throughput benchmarks of recording, playback and mp4 remux on host storage
+// Rates are printed for comparison between builds, with each run also checked
+// for complete output, using recordings at full size OpenDML segments.
+
+#include "../mjpeg2sd.cpp"
+#include "hostRecord.h"
+
+static const char* recordFrames(uint8_t frameSize, size_t jpegLen, uint32_t frameCnt) {
+  // recording of frames of around given length at given frame size
+  openRecording();
+  fsizePtr = frameSize;
+  for (uint32_t i = 0; i < frameCnt; i++) recordFrame(i, jpegLen + i % 7);
+  return closeRecording();
+}
+
+static size_t recordedBytes() {
+  // video chunk content of last recording
+  size_t recBytes = 0;
+  for (auto& recChunk : recChunks) recBytes += recChunk.size();
+  return recBytes;
+}
+
+static void benchPlay(const char* name, uint8_t frameSize, size_t jpegLen) {
+  // sustained frame rate of unpaced playback through read ahead ring, for given frame size
+  const char* aviName = recordFrames(frameSize, jpegLen, 200);
+  playFrame = -1;
+  playSpeed = 1;
+  playSession* ps = openSDfile(aviName, false);
+  CHECK(ps != NULL);
+  if (ps == NULL) return;
+  ps->frameUs = 1; // as fast as ring is filled
+  uint32_t frames = 0;
+  size_t sent = 0;
+  bool firstCall = true;
+  auto startTime = std::chrono::steady_clock::now();
+  while (true) {
+    mjpegStruct mjpegData = getNextFrame(ps, firstCall);
+    firstCall = false;
+    if (!mjpegData.buffOffset) break; // session closed
+    if (mjpegData.jpegSize) frames++;
+    sent += mjpegData.buffLen;
+  }
+  double secs = benchSecs(startTime);
+  double frameRate = benchRate(name, frames, secs, "frames");
+  benchRate(name, sent / 1024.0, secs, "kB");
+  CHECK_EQ(frames, 200);
+  CHECK_EQ(sent, recordedBytes());
+  CHECK(frameRate > FPS); // keeps up with recorded rate
+}
+
+static void benchMuxDemux() {
+  // frames written through avi muxer as recorded, then read back by scanning chunks,
+  // as by playback and download, and by index lookup, as by seek
+  const uint32_t frameCnt = 1000;
+  const size_t jpegLen = 80 * 1024;
+  std::vector<uint8_t> jpeg = makeJpeg(0, jpegLen);
+  jpeg.resize(jpegLen + 3); // filler read beyond jpeg
+  openRecording();
+  fsizePtr = FRAMESIZE_SVGA;
+  auto startTime = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < frameCnt; i++) saveFrame(jpeg.data(), jpegLen, i * 100);
+  std::vector<uint8_t>& avi = hostFileData(closeRecording());
+  double secs = benchSecs(startTime);
+  benchRate("avi mux", frameCnt, secs, "frames");
+  benchRate("avi mux", avi.size() / 1024.0, secs, "kB");
+
+  aviSource src = {readVector, &avi, avi.size()};
+  std::vector<uint8_t> frameBuf(jpegLen + CHUNK_HDR);
+  uint32_t scanned = 0;
+  size_t demuxed = 0;
+  startTime = std::chrono::steady_clock::now();
+  bool isOdml = false;
+  size_t filePos = findAviMovi(&src, &isOdml);
+  uint32_t chunkLen;
+  uint8_t chunkType;
+  while ((chunkType = nextAviChunk(&src, filePos, &chunkLen)) != AVI_END) {
+    if (chunkType == AVI_VIDEO) {
+      demuxed += readVector(&avi, filePos, frameBuf.data(), std::min((size_t)chunkLen, frameBuf.size()));
+      scanned++;
+    }
+    filePos += chunkLen;
+  }
+  secs = benchSecs(startTime);
+  benchRate("avi demux by scan", scanned, secs, "frames");
+  benchRate("avi demux by scan", demuxed / 1024.0, secs, "kB");
+  CHECK_EQ(scanned, frameCnt);
+  CHECK(!memcmp(frameBuf.data() + CHUNK_HDR, jpeg.data(), jpegLen));
+
+  uint32_t found = 0;
+  startTime = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < frameCnt; i++) {
+    size_t framePos = findAviFrame(&src, i);
+    if (framePos && readVector(&avi, framePos, frameBuf.data(), frameBuf.size()) == frameBuf.size()) found++;
+  }
+  benchRate("avi demux by index", found, benchSecs(startTime), "frames");
+  CHECK_EQ(found, frameCnt);
+}
+
+static void benchRemux() {
+  // mp4 remux of recording for download, against raw read of the avi as downloaded
+  std::vector<uint8_t>& avi = hostFileData(recordFrames(FRAMESIZE_SVGA, 80 * 1024, 300));
+  aviSource src = {readVector, &avi, avi.size()};
+  std::vector<uint8_t> buff(CHUNKSIZE);
+  size_t readLen = 0, chunkLen;
+  auto startTime = std::chrono::steady_clock::now();
+  while ((chunkLen = readVector(&avi, readLen, buff.data(), buff.size())) > 0) readLen += chunkLen;
+  double rawRate = benchRate("avi raw read", readLen / 1024.0, benchSecs(startTime), "kB");
+  CHECK_EQ(readLen, avi.size());
+
+  size_t remuxLen = 0;
+  startTime = std::chrono::steady_clock::now();
+  mp4Session* mr = openMp4Remux(&src);
+  CHECK(mr != NULL);
+  if (mr == NULL) return;
+  while ((chunkLen = remuxMp4(mr, buff.data(), buff.size())) > 0) remuxLen += chunkLen;
+  closeMp4Remux(mr);
+  double secs = benchSecs(startTime);
+  double remuxRate = benchRate("mp4 remux", remuxLen / 1024.0, secs, "kB");
+  benchRate("mp4 remux", recChunks.size(), secs, "frames");
+  printf("remux at %.0f%% of raw read rate\n", rawRate > 0 ? remuxRate * 100 / rawRate : 0);
+  CHECK(remuxLen > recordedBytes()); // all frames sent
+}
+
+int main() {
+  xTaskCreate(playbackTask, "playbackTask", 0, NULL, 1, &playbackHandle);
+
+  testCase("playback rate");
+  benchPlay("SVGA playback", FRAMESIZE_SVGA, 80 * 1024);
+  benchPlay("UXGA playback", FRAMESIZE_UXGA, 250 * 1024);
+
+  testCase("avi mux and demux rate");
+  benchMuxDemux();
+
+  testCase("mp4 remux rate");
+  benchRemux();
+
+  return testEnd();
+}
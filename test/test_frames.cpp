@@ -0,0 +1,169 @@
+// Reference counting of camera frames shared by mjpeg2sd.cpp with streams
+// Each camera frame buffer must be returned to the camera exactly once, when its
+// last user releases it, and streams must leave buffers free for the camera.
+// The benchmark compares frame rates of sharing by reference with copying to each stream.
+
+#include "../mjpeg2sd.cpp"
+#include "hostCamera.h"
+#include <thread>
+
+static void setStreams(uint8_t streams) {
+  vidStreams = streams;
+  for (int i = 0; i < streams; i++) if (frameSemaphore[i] == NULL) frameSemaphore[i] = xSemaphoreCreateBinary();
+}
+
+static void checkLastUser() {
+  // frame returned only when capture task and both streams have released it
+  setStreams(2);
+  frameRef* ref = holdFrame(cameraGet());
+  CHECK(ref != NULL);
+  CHECK_EQ(ref->refCnt, 1);
+  streamWait[0] = streamWait[1] = true;
+  shareFrame(ref);
+  CHECK_EQ(ref->refCnt, 3);
+  frameRef* ref0 = waitStreamFrame(0, 0);
+  frameRef* ref1 = waitStreamFrame(1, 0);
+  CHECK(ref0 == ref && ref1 == ref);
+  releaseFrame(ref);
+  releaseFrame(ref0);
+  CHECK_EQ(fbInUse(), 1);
+  releaseFrame(ref1);
+  CHECK_EQ(fbInUse(), 0);
+  CHECK_EQ(heldFrames, 0);
+  releaseFrame(ref); // no further return once released
+  CHECK_EQ(fbErrors, 0);
+  endStreamFrames(0);
+  endStreamFrames(1);
+}
+
+static void checkCameraReserve() {
+  // stream not given a new frame if it would leave only one buffer for camera
+  setStreams(1);
+  frameRef* refs[FB_CNT];
+  for (int i = 0; i < FB_CNT - 1; i++) refs[i] = holdFrame(cameraGet());
+  streamWait[0] = true;
+  shareFrame(refs[FB_CNT - 2]);
+  CHECK_EQ(refs[FB_CNT - 2]->refCnt, 1);
+  CHECK(waitStreamFrame(0, 0) == NULL);
+  // but all buffers can be held by capture
+  refs[FB_CNT - 1] = holdFrame(cameraGet());
+  CHECK(refs[FB_CNT - 1] != NULL);
+  CHECK(holdFrame(&camFb[0]) == NULL);
+  for (auto ref : refs) releaseFrame(ref);
+  CHECK_EQ(fbInUse(), 0);
+  endStreamFrames(0);
+}
+
+static void checkStreamEnd() {
+  // frame handed to stream but not collected is released when stream ends
+  setStreams(1);
+  frameRef* ref = holdFrame(cameraGet());
+  streamWait[0] = true;
+  shareFrame(ref);
+  releaseFrame(ref);
+  CHECK_EQ(fbInUse(), 1);
+  endStreamFrames(0);
+  CHECK_EQ(fbInUse(), 0);
+  CHECK(waitStreamFrame(0, 0) == NULL); // signal cleared
+  CHECK_EQ(fbErrors, 0);
+}
+
+static void checkConcurrent() {
+  // streams on their own tasks collect and release frames as capture proceeds
+  setStreams(3);
+  std::atomic<bool> running(true);
+  std::atomic<int> streamed[3] = {};
+  std::vector<std::thread> streams;
+  for (int i = 0; i < 3; i++) {
+    streams.emplace_back([&, i] {
+      while (running) {
+        frameRef* ref = waitStreamFrame(i, 5);
+        if (ref == NULL) continue;
+        if (fbUsers[ref->fb - camFb] != 1) fbErrors++;
+        streamed[i]++;
+        if (i) std::this_thread::sleep_for(std::chrono::microseconds(50 * i)); // slower streams
+        releaseFrame(ref);
+      }
+      endStreamFrames(i);
+    });
+  }
+  // until each stream has had frames, as stream threads may start late
+  int captured = 0;
+  auto allStreamed = [&] { return streamed[0] > 10 && streamed[1] > 10 && streamed[2] > 10; };
+  for (uint32_t ms = millis(); (captured < 20000 || !allStreamed()) && millis() - ms < 10000; ) {
+    camera_fb_t* fb = cameraGet();
+    if (fb == NULL) {
+      std::this_thread::yield();
+      continue;
+    }
+    frameRef* ref = holdFrame(fb);
+    if (ref == NULL) {
+      esp_camera_fb_return(fb);
+      continue;
+    }
+    shareFrame(ref);
+    releaseFrame(ref);
+    captured++;
+  }
+  running = false;
+  for (auto& stream : streams) stream.join();
+  printf("captured %d, streamed %d %d %d\n", captured, (int)streamed[0], (int)streamed[1], (int)streamed[2]);
+  CHECK(captured >= 20000);
+  CHECK(allStreamed());
+  CHECK_EQ(fbInUse(), 0);
+  CHECK_EQ(heldFrames, 0);
+  CHECK_EQ(fbErrors, 0);
+}
+
+static void benchFanOut() {
+  // frames per second handed to streams, copied into a buffer per stream as before
+  // frames were shared, against sharing by reference
+  const int streams = 3, frames = 3000;
+  setStreams(streams);
+  std::vector<uint8_t> jpeg = makeJpeg(0, 150 * 1024); // SVGA frame
+  camera_fb_t* fb = cameraGet();
+  fb->buf = jpeg.data();
+  fb->len = jpeg.size();
+  std::vector<std::vector<uint8_t>> streamBuffer(streams, std::vector<uint8_t>(CAM_BUFF_LEN));
+  auto startTime = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) {
+    fbUsers[fb - camFb] = 1; // as got from camera
+    for (auto& buff : streamBuffer) memcpy(buff.data(), fb->buf, fb->len);
+    esp_camera_fb_return(fb);
+  }
+  double copyRate = benchRate("frames copied to streams", frames, benchSecs(startTime), "frames");
+  startTime = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) {
+    fbUsers[fb - camFb] = 1;
+    frameRef* ref = holdFrame(fb);
+    for (int s = 0; s < streams; s++) streamWait[s] = true;
+    shareFrame(ref);
+    for (int s = 0; s < streams; s++) releaseFrame(waitStreamFrame(s, 0));
+    releaseFrame(ref);
+  }
+  double shareRate = benchRate("frames shared with streams", frames, benchSecs(startTime), "frames");
+  CHECK(shareRate > copyRate);
+  CHECK_EQ(fbInUse(), 0);
+  CHECK_EQ(heldFrames, 0);
+  CHECK_EQ(fbErrors, 0);
+  for (int s = 0; s < streams; s++) endStreamFrames(s);
+}
+
+int main() {
+  testCase("last user returns frame");
+  checkLastUser();
+
+  testCase("camera buffer reserve");
+  checkCameraReserve();
+
+  testCase("stream end releases frame");
+  checkStreamEnd();
+
+  testCase("concurrent streams");
+  checkConcurrent();
+
+  testCase("frame fan-out benchmark");
+  benchFanOut();
+
+  return testEnd();
+}
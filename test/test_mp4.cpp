@@ -0,0 +1,185 @@
+// Conformance of fragmented mp4 remuxed by mp4.cpp from avi recordings
+// The box structure is walked independently of mp4.cpp, and each fragment's
+// trun sample sizes, durations and data offset are checked against the avi chunks,
+// so that each sample located in mdat holds its jpeg.
+
+#include "../mjpeg2sd.cpp"
+#include "hostRecord.h"
+
+struct mp4Box {
+  size_t pos;
+  uint32_t size;
+};
+
+static std::vector<mp4Box> childBoxes(const std::vector<uint8_t>& mp4, size_t pos, size_t end, bool& valid) {
+  // boxes within range, which must be exactly filled
+  std::vector<mp4Box> boxes;
+  while (pos + 8 <= end) {
+    uint32_t size = rdBE32(mp4, pos);
+    if (size < 8 || pos + size > end) break;
+    boxes.push_back({pos, size});
+    pos += size;
+  }
+  if (pos != end) {
+    printf("Boxes end at %zu, expected %zu\n", pos, end);
+    valid = false;
+  }
+  return boxes;
+}
+
+static size_t findBox(const std::vector<uint8_t>& mp4, const std::vector<mp4Box>& boxes, const char* boxType) {
+  // position of first box of given type, or 0
+  for (auto& box : boxes) if (isTag(mp4, box.pos + 4, boxType)) return box.pos;
+  return 0;
+}
+
+static std::vector<uint8_t> remuxAvi(const char* aviName, size_t buffSize) {
+  // remux avi in pieces of given size, as when sent to browser
+  std::vector<uint8_t>& avi = hostFileData(aviName);
+  aviSource src = {readVector, &avi, avi.size()};
+  std::vector<uint8_t> mp4, buff(buffSize);
+  mp4Session* mr = openMp4Remux(&src);
+  CHECK(mr != NULL);
+  if (mr == NULL) return mp4;
+  size_t buffLen;
+  while ((buffLen = remuxMp4(mr, buff.data(), buffSize)) > 0) mp4.insert(mp4.end(), buff.begin(), buff.begin() + buffLen);
+  closeMp4Remux(mr);
+  return mp4;
+}
+
+static void checkMp4(const std::vector<uint8_t>& mp4) {
+  // check mp4 structure and samples against recorded avi chunks
+  bool valid = true;
+  std::vector<mp4Box> top = childBoxes(mp4, 0, mp4.size(), valid);
+  CHECK(valid);
+  CHECK(top.size() >= 4);
+  if (!valid || top.size() < 4) return;
+
+  // init segment
+  CHECK(isTag(mp4, 4, "ftyp"));
+  CHECK(isTag(mp4, 8, "isom"));
+  CHECK(isTag(mp4, top[1].pos + 4, "moov"));
+  std::vector<mp4Box> moov = childBoxes(mp4, top[1].pos + 8, top[1].pos + top[1].size, valid);
+  size_t mvhd = findBox(mp4, moov, "mvhd");
+  CHECK(mvhd > 0);
+  CHECK_EQ(rdBE32(mp4, mvhd + 104), 2); // next track id, only video
+  size_t trak = findBox(mp4, moov, "trak");
+  std::vector<mp4Box> trakBoxes = childBoxes(mp4, trak + 8, trak + rdBE32(mp4, trak), valid);
+  size_t tkhd = findBox(mp4, trakBoxes, "tkhd");
+  CHECK_EQ(rdBE32(mp4, tkhd + 20), 1); // track id
+  CHECK_EQ(rdBE32(mp4, tkhd + 84), 640 << 16);
+  CHECK_EQ(rdBE32(mp4, tkhd + 88), 480 << 16);
+  size_t mdia = findBox(mp4, trakBoxes, "mdia");
+  std::vector<mp4Box> mdiaBoxes = childBoxes(mp4, mdia + 8, mdia + rdBE32(mp4, mdia), valid);
+  size_t mdhd = findBox(mp4, mdiaBoxes, "mdhd");
+  uint32_t timescale = rdBE32(mp4, mdhd + 20);
+  CHECK_EQ(timescale, 10); // avi rate with scale 1
+  size_t mvex = findBox(mp4, moov, "mvex");
+  CHECK(mvex > 0);
+  CHECK(isTag(mp4, mvex + 12, "trex"));
+  CHECK(valid);
+
+  // fragments, each moof followed by its mdat
+  uint32_t chunkNum = 0; // next avi chunk expected
+  uint64_t decodeTime = 0;
+  uint32_t fragSeq = 0;
+  for (size_t i = 2; i < top.size(); i += 2) {
+    size_t moof = top[i].pos;
+    CHECK(isTag(mp4, moof + 4, "moof"));
+    CHECK(i + 1 < top.size() && isTag(mp4, top[i + 1].pos + 4, "mdat"));
+    if (i + 1 >= top.size()) break;
+    size_t mdat = top[i + 1].pos;
+    std::vector<mp4Box> moofBoxes = childBoxes(mp4, moof + 8, moof + top[i].size, valid);
+    size_t mfhd = findBox(mp4, moofBoxes, "mfhd");
+    CHECK_EQ(rdBE32(mp4, mfhd + 12), ++fragSeq);
+    size_t traf = findBox(mp4, moofBoxes, "traf");
+    std::vector<mp4Box> trafBoxes = childBoxes(mp4, traf + 8, traf + rdBE32(mp4, traf), valid);
+    size_t tfhd = findBox(mp4, trafBoxes, "tfhd");
+    CHECK_EQ(rdBE32(mp4, tfhd + 8), 0x020000); // default base is moof
+    CHECK_EQ(rdBE32(mp4, tfhd + 12), 1);
+    size_t tfdt = findBox(mp4, trafBoxes, "tfdt");
+    CHECK_EQ(mp4[tfdt + 8], 1); // version with 64 bit time
+    CHECK_EQ((uint64_t)rdBE32(mp4, tfdt + 12) << 32 | rdBE32(mp4, tfdt + 16), decodeTime);
+    size_t trun = findBox(mp4, trafBoxes, "trun");
+    CHECK_EQ(rdBE32(mp4, trun + 8), 0x000301); // data offset, durations and sizes
+    uint32_t samples = rdBE32(mp4, trun + 12);
+    CHECK(samples > 0 && samples <= 10); // up to one second per fragment
+    CHECK_EQ(rdBE32(mp4, trun), 20 + samples * 8);
+    // data offset from moof locates first sample at start of mdat content
+    size_t dataPos = moof + rdBE32(mp4, trun + 16);
+    CHECK_EQ(dataPos, mdat + 8);
+    uint32_t mdatLen = 0;
+    for (uint32_t s = 0; s < samples; s++) {
+      uint32_t duration = rdBE32(mp4, trun + 20 + s * 8);
+      uint32_t size = rdBE32(mp4, trun + 24 + s * 8);
+      while (chunkNum < recChunks.size() && recChunks[chunkNum].empty()) chunkNum++;
+      CHECK(chunkNum < recChunks.size());
+      if (chunkNum >= recChunks.size()) return;
+      // following empty avi frames extend duration of sample
+      uint32_t repeats = 1;
+      while (chunkNum + repeats < recChunks.size() && recChunks[chunkNum + repeats].empty()) repeats++;
+      CHECK_EQ(duration, repeats);
+      CHECK_EQ(size, recChunks[chunkNum].size());
+      if (size == recChunks[chunkNum].size() && dataPos + size <= mp4.size())
+        CHECK(!memcmp(mp4.data() + dataPos, recChunks[chunkNum].data(), size));
+      dataPos += size;
+      mdatLen += size;
+      decodeTime += duration;
+      chunkNum += repeats;
+    }
+    CHECK_EQ(top[i + 1].size, 8 + mdatLen);
+  }
+  CHECK_EQ(chunkNum, recChunks.size());
+  CHECK_EQ(decodeTime, recChunks.size());
+  CHECK(valid);
+}
+
+static void checkConcurrent() {
+  // remuxes in progress together each give the same mp4 as when done alone
+  std::string aviNames[2] = {recordAvi(25), recordAvi(150)};
+  std::vector<uint8_t> mp4Alone[2], mp4Together[2];
+  aviSource src[2];
+  mp4Session* mr[2];
+  for (int i = 0; i < 2; i++) {
+    mp4Alone[i] = remuxAvi(aviNames[i].c_str(), 4096);
+    std::vector<uint8_t>& avi = hostFileData(aviNames[i].c_str());
+    src[i] = {readVector, &avi, avi.size()};
+    mr[i] = openMp4Remux(&src[i]);
+    CHECK(mr[i] != NULL);
+    if (mr[i] == NULL) return;
+  }
+  std::vector<uint8_t> buff(3000);
+  bool active[2] = {true, true};
+  while (active[0] || active[1]) {
+    for (int i = 0; i < 2; i++) {
+      size_t buffLen = active[i] ? remuxMp4(mr[i], buff.data(), buff.size()) : 0;
+      mp4Together[i].insert(mp4Together[i].end(), buff.begin(), buff.begin() + buffLen);
+      active[i] = buffLen > 0;
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    CHECK(mp4Together[i] == mp4Alone[i]);
+    closeMp4Remux(mr[i]);
+  }
+  checkMp4(mp4Together[1]); // recChunks of last recording
+}
+
+int main() {
+  testCase("remux in small pieces");
+  const char* aviName = recordAvi(25);
+  checkMp4(remuxAvi(aviName, 1000));
+
+  testCase("remux in one piece");
+  checkMp4(remuxAvi(aviName, ONEMEG));
+
+  testCase("missed capture intervals extend sample");
+  checkMp4(remuxAvi(recordAvi(25, 9), 4096));
+
+  testCase("remux across OpenDML segments");
+  checkMp4(remuxAvi(recordAvi(150), 4096));
+
+  testCase("concurrent remuxes");
+  checkConcurrent();
+
+  return testEnd();
+}
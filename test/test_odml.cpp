@@ -0,0 +1,26 @@
+// Long OpenDML recording written by mjpeg2sd.cpp and avi.cpp, beyond the former
+// 16 bit frame count, then parsed back by the checks of hostAvi.h.
+// Labelled long in CTest, as it records and checks 100k frames.
+
+#include "../mjpeg2sd.cpp"
+#include "hostAvi.h"
+
+static const uint32_t LONG_FRAMES = 100000;
+
+static size_t tinyJpegLen(uint32_t frameNum) {
+  // small frames, so that whole recording is held by host storage
+  return 40 + frameNum % 29;
+}
+
+int main() {
+  testCase("100k frame round trip");
+  maxFrames = LONG_FRAMES + 1;
+  auto startTime = std::chrono::steady_clock::now();
+  const char* aviName = recordAvi(LONG_FRAMES, UINT32_MAX, tinyJpegLen);
+  benchRate("frames recorded", LONG_FRAMES, benchSecs(startTime), "frames");
+  CHECK(!aviFull);
+  CHECK_EQ(recChunks.size(), LONG_FRAMES);
+  CHECK_EQ(checkAvi(aviName), 3);
+
+  return testEnd();
+}
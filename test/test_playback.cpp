@@ -0,0 +1,190 @@
+// Playback of avi recordings through the read ahead ring of mjpeg2sd.cpp
+// The real playback task fills each session's ring while the session sends frames
+// straight from it, so every frame must arrive whole and in order as the ring wraps,
+// whether frames and chunk headers fall within a slot or across slots.
+
+#include "../mjpeg2sd.cpp"
+#include "hostRecord.h"
+#include <atomic>
+#include <thread>
+
+static size_t playJpegLen(uint32_t frameNum) {
+  // some frames larger than a ring slot
+  return frameNum % 50 == 20 ? PLAY_BLOCK + 3000 : testJpegLen(frameNum);
+}
+
+struct playResult {
+  std::vector<std::vector<uint8_t>> frames; // content of each frame sent
+  std::vector<size_t> slotPos; // file position of each slot sent from
+  uint32_t slotsFilled = 0;
+  bool completed = false;
+};
+
+static std::atomic<int> sessionsOpened(0);
+
+static playResult playAvi(const char* aviName, int startFrame = -1, int speed = 1) {
+  // play recording in a new session, collecting frames as they are sent to browser
+  playResult result;
+  playFrame = startFrame;
+  playSpeed = speed;
+  playSession* ps = openSDfile(aviName, false);
+  sessionsOpened++;
+  CHECK(ps != NULL);
+  if (ps == NULL) return result;
+  ps->frameUs = 1000; // much faster than recorded rate, to keep test short
+  playSlot* prevSlot = NULL;
+  bool firstCall = true;
+  while (true) {
+    mjpegStruct mjpegData = getNextFrame(ps, firstCall);
+    firstCall = false;
+    if (!mjpegData.buffOffset) break; // session closed
+    if (mjpegData.jpegSize) result.frames.push_back({});
+    if (ps->slot != NULL && ps->slot != prevSlot) {
+      result.slotPos.push_back(ps->slot->filePos);
+      prevSlot = ps->slot;
+    }
+    if (mjpegData.buffLen) {
+      CHECK(!result.frames.empty());
+      if (result.frames.empty()) break;
+      // sent from within current slot of ring
+      CHECK(mjpegData.buff == slotBuff(ps, ps->slot));
+      CHECK(mjpegData.buffOffset + mjpegData.buffLen <= CHUNK_HDR + ps->slot->len);
+      uint8_t* sendPtr = mjpegData.buff + mjpegData.buffOffset;
+      result.frames.back().insert(result.frames.back().end(), sendPtr, sendPtr + mjpegData.buffLen);
+    }
+    result.slotsFilled = ps->filled;
+    result.completed = ps->completed;
+  }
+  CHECK(!ps->inUse);
+  CHECK(ps->ring == NULL);
+  return result;
+}
+
+static void checkFrames(const playResult& result, int firstFrame, int speed) {
+  // frames sent are the recorded frames at given speed
+  uint32_t wantCnt = 0;
+  for (int i = firstFrame; i >= 0 && i < (int)recChunks.size(); i += speed) wantCnt++;
+  CHECK(result.completed);
+  CHECK_EQ(result.frames.size(), wantCnt);
+  for (uint32_t i = 0; i < result.frames.size() && i < wantCnt; i++) {
+    const std::vector<uint8_t>& recFrame = recChunks[firstFrame + i * speed];
+    if (result.frames[i] != recFrame) {
+      printf("Frame %d differs\n", firstFrame + i * speed);
+      CHECK(false);
+    }
+  }
+}
+
+static void checkPlay() {
+  // whole recording at normal speed, ring read ahead in consecutive blocks
+  playResult result = playAvi(recordAvi(120, UINT32_MAX, playJpegLen));
+  CHECK(!aviFull);
+  checkFrames(result, 0, 1);
+  CHECK(result.slotsFilled > PLAY_SLOTS * 2); // ring wrapped
+  for (size_t i = 1; i < result.slotPos.size(); i++) CHECK_EQ(result.slotPos[i], result.slotPos[i - 1] + PLAY_BLOCK);
+  CHECK_EQ(result.slotPos[0], AVI_HEADER_LEN - AVI_HEADER_LEN % PLAY_ALIGN);
+}
+
+static void checkStartFrame() {
+  // from given frame, with read aligned to sector before it
+  for (int startFrame : {1, 20, 21, 77, 119}) {
+    playResult result = playAvi(aviFileName, startFrame);
+    checkFrames(result, startFrame, 1);
+    std::vector<uint8_t>& avi = hostFileData(aviFileName);
+    aviSource src = {readVector, &avi, avi.size()};
+    size_t framePos = findAviFrame(&src, startFrame);
+    CHECK_EQ(result.slotPos[0], framePos - framePos % PLAY_ALIGN);
+  }
+}
+
+static void checkSplitHeader() {
+  // from frames where a later chunk header is split between slots, so is carried over
+  std::vector<uint8_t>& avi = hostFileData(aviFileName);
+  aviSource src = {readVector, &avi, avi.size()};
+  uint32_t splitPlays = 0;
+  for (int startFrame = 0; startFrame < (int)recChunks.size() && splitPlays < 3; startFrame++) {
+    size_t readPos = findAviFrame(&src, startFrame);
+    readPos -= readPos % PLAY_ALIGN;
+    bool isSplit = false;
+    for (int i = startFrame; i < (int)recChunks.size() && !isSplit; i++)
+      isSplit = (findAviFrame(&src, i) - readPos) % PLAY_BLOCK > PLAY_BLOCK - CHUNK_HDR;
+    if (!isSplit) continue;
+    checkFrames(playAvi(aviFileName, startFrame), startFrame, 1);
+    splitPlays++;
+  }
+  CHECK(splitPlays > 0); // recording has such frames
+}
+
+static void checkTrickPlay() {
+  // each frame located and read directly, forward and reverse
+  checkFrames(playAvi(aviFileName, -1, 3), 0, 3);
+  checkFrames(playAvi(aviFileName, 119, -2), 119, -2);
+  checkFrames(playAvi(aviFileName, 100, 7), 100, 7);
+}
+
+static void checkConcurrent() {
+  // sessions on their own tasks share the playback task, each with its own ring
+  playSessions = MAX_PLAY_SESSIONS;
+  playResult results[MAX_PLAY_SESSIONS];
+  int startFrames[MAX_PLAY_SESSIONS] = {0, 33, 90};
+  std::vector<std::thread> sessions;
+  sessionsOpened = 0;
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) {
+    // start settings are taken by openSDfile, so sessions are opened in turn
+    sessions.emplace_back([&, i] { results[i] = playAvi(aviFileName, startFrames[i]); });
+    while (sessionsOpened <= i) delay(1);
+  }
+  for (auto& session : sessions) session.join();
+  for (int i = 0; i < MAX_PLAY_SESSIONS; i++) checkFrames(results[i], startFrames[i], 1);
+  CHECK_EQ(activeSessions(), 0);
+  playSessions = 1;
+}
+
+static void checkWhileRecording() {
+  // playback continues alongside a recording, admitted while SD time is within budget
+  std::string playName = aviFileName;
+  std::vector<std::vector<uint8_t>> playChunks = recChunks;
+  openRecording();
+  for (uint32_t i = 0; i < 20; i++) recordFrame(i, testJpegLen(i));
+  std::swap(recChunks, playChunks);
+  // recording measured as writing at 1MB/s for 70% of the time
+  startTime = millis() - 10000;
+  wTimeTot = 7000;
+  vidSize = 7 * ONEMEG;
+  checkFrames(playAvi(playName.c_str()), 0, 1);
+  CHECK(liveRec);
+  // but not on slower SD, where reading the recording would take over 10% of the time
+  vidSize = 7000 * 100;
+  playFrame = -1;
+  CHECK(openSDfile(playName.c_str(), false) == NULL);
+  CHECK_EQ(activeSessions(), 0);
+  std::swap(recChunks, playChunks);
+  closeRecording();
+  // then admitted again
+  std::swap(recChunks, playChunks);
+  checkFrames(playAvi(playName.c_str()), 0, 1);
+}
+
+int main() {
+  xTaskCreate(playbackTask, "playbackTask", 0, NULL, 1, &playbackHandle);
+
+  testCase("play whole recording");
+  checkPlay();
+
+  testCase("play from frame");
+  checkStartFrame();
+
+  testCase("chunk header split between slots");
+  checkSplitHeader();
+
+  testCase("trick play");
+  checkTrickPlay();
+
+  testCase("concurrent sessions");
+  checkConcurrent();
+
+  testCase("playback while recording");
+  checkWhileRecording();
+
+  return testEnd();
+}
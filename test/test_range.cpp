@@ -0,0 +1,178 @@
+// Byte range downloads by utilsFS.cpp, as served by fileHandler() in webServer.cpp
+// The Range header is parsed for a single range within the file, and a partial
+// response must state that range and send exactly its bytes, otherwise the whole file is sent.
+// Seeking playback to a frame must cost the same index reads however long the recording.
+
+#include "../utilsFS.cpp"
+#include "../webServer.cpp"
+#include "../mjpeg2sd.cpp"
+#include "hostRecord.h"
+
+static const size_t FILE_LEN = CHUNKSIZE * 3 + 123; // several chunks sent
+static const char* DOWNLOAD_FILE = "/range.bin";
+
+static bool parseRange(const char* rangeHdr, size_t fileSize, size_t* rangeStart, size_t* rangeLen) {
+  // byte range from request with given Range header, if any
+  hostHttp http;
+  if (rangeHdr != NULL) http.reqHdrs["Range"] = rangeHdr;
+  httpd_req_t req = {};
+  req.aux = &http;
+  return getByteRange(&req, fileSize, rangeStart, rangeLen);
+}
+
+static void checkRange(const char* rangeHdr, size_t wantStart, size_t wantLen) {
+  // range accepted and bounded by file
+  size_t rangeStart = 0, rangeLen = 0;
+  bool valid = parseRange(rangeHdr, 5000, &rangeStart, &rangeLen);
+  if (!valid) printf("Range not accepted: %s\n", rangeHdr);
+  CHECK(valid);
+  CHECK_EQ(rangeStart, wantStart);
+  CHECK_EQ(rangeLen, wantLen);
+}
+
+static void checkNoRange(const char* rangeHdr, size_t fileSize = 5000) {
+  // whole file to be sent instead
+  size_t rangeStart = 0, rangeLen = 0;
+  bool valid = parseRange(rangeHdr, fileSize, &rangeStart, &rangeLen);
+  if (valid) printf("Range accepted: %s\n", rangeHdr ? rangeHdr : "none");
+  CHECK(!valid);
+}
+
+static void checkParse() {
+  // single ranges in each form, limited to file
+  checkRange("bytes=1000-1999", 1000, 1000);
+  checkRange("bytes=0-0", 0, 1);
+  checkRange("bytes=1000-", 1000, 4000);
+  checkRange("bytes=4999-", 4999, 1);
+  checkRange("bytes=4000-9999", 4000, 1000);
+  checkRange("bytes=-500", 4500, 500);
+  checkRange("bytes=-5000", 0, 5000);
+  checkRange("bytes=-6000", 0, 5000);
+  // otherwise whole file
+  checkNoRange(NULL);
+  checkNoRange("bytes=5000-");
+  checkNoRange("bytes=5000-5999");
+  checkNoRange("bytes=2000-1999");
+  checkNoRange("bytes=-0");
+  checkNoRange("bytes=0-99,200-299");
+  checkNoRange("items=0-99");
+  checkNoRange("bytes=100");
+  checkNoRange("bytes=0-", 0);
+}
+
+static std::vector<uint8_t> download(const char* fileName, const char* rangeHdr, hostHttp& http) {
+  // request file download with given Range header, returning file content
+  std::vector<uint8_t>& content = hostFileData(fileName);
+  strcpy(inFileName, fileName);
+  if (rangeHdr != NULL) http.reqHdrs["Range"] = rangeHdr;
+  httpd_req_t req = {};
+  req.aux = &http;
+  CHECK_EQ(fileHandler(&req, true), ESP_OK);
+  CHECK(http.ended);
+  CHECK(http.respHdrs["Content-Length"] == std::to_string(http.body.size()));
+  return content;
+}
+
+static void checkPartial(const char* rangeHdr, size_t rangeStart, size_t rangeLen) {
+  // partial content response holding only requested bytes
+  hostHttp http;
+  std::vector<uint8_t> content = download(DOWNLOAD_FILE, rangeHdr, http);
+  CHECK(http.status == "206 Partial Content");
+  char contentRange[40];
+  snprintf(contentRange, sizeof(contentRange), "bytes %zu-%zu/%zu", rangeStart, rangeStart + rangeLen - 1, FILE_LEN);
+  CHECK(http.respHdrs["Content-Range"] == contentRange);
+  CHECK(http.respHdrs["Accept-Ranges"] == "bytes");
+  CHECK_EQ(http.body.size(), rangeLen);
+  CHECK(std::equal(http.body.begin(), http.body.end(), content.begin() + rangeStart));
+}
+
+static void checkWhole(const char* fileName, const char* rangeHdr, bool rangesAccepted) {
+  // whole file response, ranges only advertised if they could be requested
+  hostHttp http;
+  std::vector<uint8_t> content = download(fileName, rangeHdr, http);
+  CHECK(http.status == "200 OK");
+  CHECK(!http.respHdrs.count("Content-Range"));
+  CHECK_EQ(http.respHdrs.count("Accept-Ranges"), rangesAccepted);
+  if (rangesAccepted) CHECK(http.body == content);
+  else CHECK(http.body.size() > content.size()); // packed with ancillary files
+}
+
+static void checkDownload() {
+  // ranges of file served, crossing and ending within send chunks
+  std::vector<uint8_t>& content = hostFileData(DOWNLOAD_FILE);
+  content.resize(FILE_LEN);
+  for (size_t i = 0; i < FILE_LEN; i++) content[i] = i * 13 + (i >> 8);
+  checkPartial("bytes=100-199", 100, 100);
+  checkPartial("bytes=1000-", 1000, FILE_LEN - 1000);
+  checkPartial("bytes=12000-99999", 12000, FILE_LEN - 12000);
+  std::string chunksHdr = "bytes=" + std::to_string(CHUNKSIZE - 10) + "-" + std::to_string(CHUNKSIZE * 2 + 9);
+  checkPartial(chunksHdr.c_str(), CHUNKSIZE - 10, CHUNKSIZE + 20);
+  checkPartial("bytes=-123", FILE_LEN - 123, 123);
+  checkPartial("bytes=0-", 0, FILE_LEN);
+  checkWhole(DOWNLOAD_FILE, NULL, true);
+  checkWhole(DOWNLOAD_FILE, "bytes=99999-", true);
+}
+
+static void checkPacked() {
+  // recording with ancillary files is sent as a tarball, so ranges not offered
+  hostFileData("/rec.avi").assign(3000, 1);
+  hostFileData("/rec.csv").assign(200, 2);
+  checkWhole("/rec.avi", "bytes=100-199", false);
+}
+
+static size_t seekReads, seekBytes;
+
+static size_t countedRead(void* ctx, size_t filePos, uint8_t* buff, size_t len) {
+  // aviSource read from in memory content, counting reads made by seek
+  size_t readLen = readVector(ctx, filePos, buff, len);
+  seekReads++;
+  seekBytes += readLen;
+  return readLen;
+}
+
+static size_t seekFrame(std::vector<uint8_t>& avi, uint32_t frameNum) {
+  // locate frame as playback seek does, counting reads
+  aviSource src = {countedRead, &avi, avi.size()};
+  seekReads = seekBytes = 0;
+  return findAviFrame(&src, frameNum);
+}
+
+static void checkSeekCost() {
+  // frame at same point in recording 100 times longer found with same reads and bytes read
+  std::vector<uint8_t> shortAvi = hostFileData(recordAvi(200));
+  std::vector<uint8_t>& longAvi = hostFileData(recordAvi(20000));
+  CHECK(longAvi.size() > shortAvi.size() * 90);
+  for (uint32_t percent : {0, 40, 99}) {
+    size_t framePos = seekFrame(shortAvi, 2 * percent);
+    CHECK(framePos > 0);
+    size_t shortReads = seekReads, shortBytes = seekBytes;
+    uint32_t frameNum = 200 * percent;
+    framePos = seekFrame(longAvi, frameNum);
+    printf("seek to %u%%: %zu reads of %zu bytes, then %zu reads of %zu bytes\n", percent, shortReads, shortBytes, seekReads, seekBytes);
+    CHECK_EQ(seekReads, shortReads);
+    CHECK_EQ(seekBytes, shortBytes);
+    // frame found is the one recorded
+    const std::vector<uint8_t>& recFrame = recChunks[frameNum];
+    CHECK(framePos > 0 && framePos + CHUNK_HDR + recFrame.size() <= longAvi.size());
+    if (framePos > 0 && framePos + CHUNK_HDR + recFrame.size() <= longAvi.size())
+      CHECK(!memcmp(longAvi.data() + framePos + CHUNK_HDR, recFrame.data(), recFrame.size()));
+  }
+}
+
+int main() {
+  if (chunk == NULL) chunk = (byte*)malloc(CHUNKSIZE); // as allocated by startWebServer()
+
+  testCase("range header parsing");
+  checkParse();
+
+  testCase("partial content download");
+  checkDownload();
+
+  testCase("ranges not offered for tarball");
+  checkPacked();
+
+  testCase("seek cost independent of recording length");
+  checkSeekCost();
+
+  return testEnd();
+}
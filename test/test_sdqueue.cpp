@@ -0,0 +1,153 @@
+// SD write queue of mjpeg2sd.cpp, from capture to the SD write task
+// Frames are queued as processFrame() does, to the real SD write task on its own thread.
+// Queue indexes must wrap, a stalled writer must cause frames to be copied to psram
+// then dropped, never blocking capture, and the recording must hold every queued frame.
+// Recording sessions feeding the queue must each follow their own trigger, so they run together.
+
+#include "../mjpeg2sd.cpp"
+#include "hostCamera.h"
+
+static std::vector<std::vector<uint8_t>> queued; // jpeg of each frame accepted by queue
+
+static void startQueue() {
+  // new recording
+  FPS = 10;
+  fsizePtr = FRAMESIZE_VGA;
+  minSeconds = 0;
+  aviFull = false;
+  queued.clear();
+  CHECK(queueSD(SD_OPEN));
+}
+
+static bool queueFrame(uint32_t frameNum, size_t jpegLen) {
+  // capture frame and queue it, then release capture reference as processFrame does
+  // frames are timed by acceptance, so that dropped frames do not add empty frames
+  std::vector<uint8_t> jpeg = makeJpeg(frameNum, jpegLen);
+  camera_fb_t* fb = cameraCapture(jpeg, queued.size() * 100);
+  CHECK(fb != NULL);
+  if (fb == NULL) return false;
+  frameRef* ref = holdFrame(fb);
+  bool queuedOk = queueSD(SD_FRAME, ref);
+  releaseFrame(ref);
+  if (queuedOk) queued.push_back(jpeg);
+  return queuedOk;
+}
+
+static bool waitDrained() {
+  // wait for SD write task to empty queue
+  for (uint32_t waitMs = millis(); millis() - waitMs < 5000; delay(1))
+    if (sdTail == sdHead) return true;
+  return false;
+}
+
+static void checkRecording() {
+  // close recording, then check it holds each queued frame in order
+  delay(5); // closeAvi reports rates over the recording duration
+  CHECK(queueSD(SD_CLOSE));
+  CHECK(waitDrained());
+  std::vector<uint8_t>& avi = hostFileData(aviFileName);
+  aviSource src = {readVector, &avi, avi.size()};
+  uint32_t frameCnt = 0;
+  uint16_t width, height;
+  CHECK(aviFrameInfo(&src, &frameCnt, &width, &height));
+  CHECK_EQ(frameCnt, queued.size());
+  for (uint32_t i = 0; i < frameCnt && i < queued.size(); i++) {
+    size_t framePos = findAviFrame(&src, i);
+    CHECK(framePos > 0);
+    size_t jpegLen = queued[i].size();
+    CHECK(rd32(avi, framePos + 4) >= jpegLen);
+    CHECK(framePos + CHUNK_HDR + jpegLen <= avi.size() && !memcmp(avi.data() + framePos + CHUNK_HDR, queued[i].data(), jpegLen));
+    // filler to word boundary is zero, whether frame was queued from camera buffer or psram copy
+    size_t fillPos = framePos + CHUNK_HDR + jpegLen;
+    for (size_t j = fillPos; j < fillPos + ((4 - (jpegLen & 3)) & 3) && j < avi.size(); j++) CHECK_EQ(avi[j], 0);
+  }
+  // all camera buffers and psram copies released
+  CHECK_EQ(fbInUse(), 0);
+  CHECK_EQ(heldFrames, 0);
+  CHECK_EQ(spillBytes, 0);
+  CHECK_EQ(fbErrors, 0);
+}
+
+static void checkWrap() {
+  // queue indexes continue through 32 bit wraparound
+  sdHead = sdTail = UINT32_MAX - 40;
+  startQueue();
+  uint32_t dropped = 0;
+  for (uint32_t i = 0; i < 200; i++) {
+    if (!queueFrame(i, 1000 + i)) dropped++;
+    if (i % 8 == 7) waitDrained(); // as if captured at frame rate
+  }
+  CHECK(sdHead < UINT32_MAX - 40);
+  CHECK_EQ(queued.size() + dropped, 200);
+  CHECK(queued.size() > 100);
+  checkRecording();
+}
+
+static void checkStall(size_t jpegLen, uint32_t wantQueued) {
+  // writer stalled, so queue takes 2 camera buffers, then copies to psram until queue or psram
+  // is full, then takes last camera buffer, then drops
+  xSemaphoreTake(aviMutex, portMAX_DELAY); // stalls writer as it opens avi
+  startQueue();
+  uint32_t dropped = 0;
+  for (uint32_t i = 0; i < 60; i++) {
+    uint32_t capMs = millis();
+    if (!queueFrame(i, jpegLen)) dropped++;
+    CHECK(millis() - capMs < 100); // capture not blocked
+    CHECK(spillBytes <= SD_SPILL_MAX);
+  }
+  CHECK_EQ(queued.size(), wantQueued);
+  CHECK_EQ(dropped, 60 - wantQueued);
+  CHECK(fbInUse() < FB_CNT); // camera can still capture
+  CHECK_EQ(spillBytes, (queued.size() - fbInUse()) * jpegLen);
+  xSemaphoreGive(aviMutex);
+  checkRecording();
+}
+
+static void checkSessions() {
+  // continuous, event and time lapse sessions run together, each on its own trigger
+  FPS = 10;
+  dashCamOn = 1;
+  timeLapseOn = timeSynchronized = doRecording = true;
+  prepRecSessions();
+  CHECK_EQ(frameLimit, FPS * 60); // continuous segment length
+  CHECK(useMotion);
+  triggerSessions(true);
+  for (auto& rs : recSess) CHECK(rs.triggered);
+  // motion ends while continuous and time lapse recording carry on
+  triggerSessions(false);
+  CHECK(recSess[REC_CONTINUOUS].triggered);
+  CHECK(!recSess[REC_EVENT].triggered);
+  CHECK(recSess[REC_TIMELAPSE].triggered);
+  // continuous recording stopped, motion still triggers event recording
+  dashCamOn = 0;
+  triggerSessions(true);
+  CHECK(!recSess[REC_CONTINUOUS].triggered);
+  CHECK(recSess[REC_EVENT].triggered);
+  prepRecSessions();
+  CHECK_EQ(frameLimit, maxFrames);
+  timeLapseOn = false;
+  triggerSessions(false);
+  for (auto& rs : recSess) CHECK(!rs.triggered);
+}
+
+int main() {
+  if (aviMutex == NULL) aviMutex = xSemaphoreCreateMutex();
+  xTaskCreate(sdWriteTask, "sdWriteTask", 0, NULL, 1, &sdWriteHandle);
+
+  testCase("queue wraparound");
+  checkWrap();
+
+  testCase("stalled writer, queue full");
+  checkStall(1000, SD_QUEUE_LEN - 1); // open takes one place
+
+  testCase("stalled writer, frames not word length");
+  checkStall(1001, SD_QUEUE_LEN - 1);
+
+  testCase("stalled writer, psram full");
+  checkStall(300000, 2 + SD_SPILL_MAX / 300000 + 1);
+
+  testCase("recording sessions together");
+  checkSessions();
+
+  return testEnd();
+}
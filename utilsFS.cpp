@@ -158,15 +158,25 @@ bool startStorage() {
   return res;
 }
 
+static bool inDashDir(const char* path) {
+  // dashcam ring folder is managed by the app, so not listed or deleted
+#ifdef ISCAM
+  if (*path == '/') path++;
+  size_t dirLen = strlen(DASH_DIR) - 1;
+  return !strncmp(path, DASH_DIR + 1, dirLen) && (path[dirLen] == 0 || path[dirLen] == '/');
+#else
+  return false;
+#endif
+}
+
 static void getOldestDir(char* oldestDir) {
   // get oldest folder by its date name
   File root = STORAGE.open("/");
   File file = root.openNextFile();
-  if (file) strcpy(oldestDir, file.path()); // initialise oldestDir
   while (file) {
     if (file.isDirectory() && strstr(file.name(), "System") == NULL // ignore Sys Vol Info
-        && strstr(DATA_DIR, file.name()) == NULL) { // ignore data folder
-      if (strcmp(oldestDir, file.path()) > 0) strcpy(oldestDir, file.path()); 
+        && strstr(DATA_DIR, file.name()) == NULL && !inDashDir(file.name())) { // ignore data and dashcam folders
+      if (!*oldestDir || strcmp(oldestDir, file.path()) > 0) strcpy(oldestDir, file.path()); 
     }
     file = root.openNextFile();
   }
@@ -185,12 +195,16 @@ bool checkFreeStorage() {
   bool res = false;
   size_t freeSize = (size_t)((STORAGE.totalBytes() - STORAGE.usedBytes()) / ONEMEG);
   if (!sdFreeSpaceMode && freeSize < sdMinCardFreeSpace) 
-    LOG_WRN("Space left %uMB is less than minimum %uMB", freeSize, sdMinCardFreeSpace);
+    LOG_WRN("Space left %zuMB is less than minimum %uMB", freeSize, sdMinCardFreeSpace);
   else {
     // delete to make space
     while (freeSize < sdMinCardFreeSpace) {
       char oldestDir[FILE_NAME_LEN] = {0};
       getOldestDir(oldestDir);
+      if (!*oldestDir) {
+        LOG_WRN("No folder available to delete");
+        break;
+      }
       LOG_WRN("Deleting oldest folder: %s %s", oldestDir, sdFreeSpaceMode == 2 ? "after uploading" : "");
 #if INCLUDE_FTP_HFS
       if (sdFreeSpaceMode == 2) fsStartTransfer(oldestDir); // transfer and then delete oldest folder
@@ -204,6 +218,41 @@ bool checkFreeStorage() {
   return res;
 } 
 
+bool preallocFile(const char* fileName, size_t fileSize) {
+  // create file with contiguous clusters allocated up front, SD card only
+  // avoids cluster allocation and fragmentation when file later written
+  if (thisFS != SDMMC) return false;
+  char fullPath[FILE_NAME_LEN];
+  snprintf(fullPath, sizeof(fullPath), "%s%s", fsPaths[thisFS], fileName);
+  if (STORAGE.exists(fileName)) STORAGE.remove(fileName);
+  esp_err_t res = esp_vfs_fat_create_contiguous_file(fsPaths[thisFS], fullPath, fileSize, true);
+  if (res != ESP_OK) LOG_WRN("Failed to preallocate %s for %s: %s", fileName, fmtSize(fileSize), espErrMsg(res));
+  return res == ESP_OK;
+}
+
+bool truncateFile(const char* fileName, size_t fileSize) {
+  // truncate closed file to given size, releasing unused clusters
+  if (thisFS == TBD) return false;
+  char fullPath[FILE_NAME_LEN];
+  snprintf(fullPath, sizeof(fullPath), "%s%s", fsPaths[thisFS], fileName);
+  if (truncate(fullPath, fileSize) == 0) return true;
+  LOG_WRN("Failed to truncate %s to %s", fileName, fmtSize(fileSize));
+  return false;
+}
+
+size_t sdClusterSize() {
+  // allocation unit size of mounted SD card, 0 if not SD card
+  if (thisFS != SDMMC) return 0;
+  FATFS* fs;
+  DWORD freeClusters;
+  if (f_getfree("0:", &freeClusters, &fs) != FR_OK) return 0;
+#if FF_MAX_SS != FF_MIN_SS
+  return (size_t)fs->csize * fs->ssize;
+#else
+  return (size_t)fs->csize * FF_MAX_SS;
+#endif
+}
+
 void setFolderName(const char* fname, char* fileName) {
   // set current or previous folder 
   char partName[FILE_NAME_LEN];
@@ -256,13 +305,13 @@ bool listDir(const char* fname, char* jsonBuff, size_t jsonBuffLen, const char*
     File file = root.openNextFile();
     if (psramFound()) heap_caps_malloc_extmem_enable(MIN_RAM); // small number to force vector into psram
     while (file) {
-      if (returnDirs && file.isDirectory() && strstr(DATA_DIR, file.name()) == NULL) {  
-        // build folder list, ignore data folder
+      if (returnDirs && file.isDirectory() && strstr(DATA_DIR, file.name()) == NULL && !inDashDir(file.name())) {  
+        // build folder list, ignore data and dashcam folders
         sprintf(partJson, "\"%s\":\"%s\",", file.path(), file.name());
         fileVec.push_back(std::string(partJson));
         noEntries = false;
       }
-      if (!returnDirs && !file.isDirectory()) {
+      if (!returnDirs && !file.isDirectory() && !inDashDir(file.path())) {
         // build file list
         if (strstr(file.name(), extension) != NULL) {
           sprintf(partJson, "\"%s\":\"%s %s\",", file.path(), file.name(), fmtSize(file.size()));
@@ -286,7 +335,7 @@ bool listDir(const char* fname, char* jsonBuff, size_t jsonBuffLen, const char*
         strcpy(jsonBuff + buffLen, fileInfo.c_str());
         buffLen += infoLen;
       } else {
-        LOG_WRN("Too many folders/files to list %u+%u in %u bytes", buffLen, infoLen, jsonBuffLen);
+        LOG_WRN("Too many folders/files to list %zu+%zu in %zu bytes", buffLen, infoLen, jsonBuffLen);
         break;
       }
     }
@@ -298,13 +347,17 @@ bool listDir(const char* fname, char* jsonBuff, size_t jsonBuffLen, const char*
 
 static void deleteOthers(const char* baseFile) {
 #ifdef ISCAM
-  // delete corresponding csv and srt files if exist
+  // delete corresponding csv, srt, evt and spr files if exist
   char otherDeleteName[FILE_NAME_LEN];
   strcpy(otherDeleteName, baseFile);
   changeExtension(otherDeleteName, CSV_EXT);
   if (STORAGE.remove(otherDeleteName)) LOG_INF("File %s deleted", otherDeleteName);
   changeExtension(otherDeleteName, SRT_EXT);
   if (STORAGE.remove(otherDeleteName)) LOG_INF("File %s deleted", otherDeleteName);
+  changeExtension(otherDeleteName, EVT_EXT);
+  if (STORAGE.remove(otherDeleteName)) LOG_INF("File %s deleted", otherDeleteName);
+  changeExtension(otherDeleteName, SPR_EXT);
+  if (STORAGE.remove(otherDeleteName)) LOG_INF("File %s deleted", otherDeleteName);
 #endif  
 }
 
@@ -312,6 +365,10 @@ void deleteFolderOrFile(const char* deleteThis) {
   // delete supplied file or folder, unless it is a reserved folder
   char fileName[FILE_NAME_LEN];
   setFolderName(deleteThis, fileName);
+  if (inDashDir(fileName)) {
+    LOG_WRN("Deletion of %s not permitted, dashcam ring", fileName);
+    return;
+  }
   File df = STORAGE.open(fileName);
   if (!df) {
     LOG_WRN("Failed to open %s", fileName);
@@ -360,7 +417,7 @@ static esp_err_t writeHeader(File& inFile, httpd_req_t* req) {
   char tarHeader[BLOCKSIZE] = {0}; // 512 bytes tar header
   strncpy(tarHeader, inFile.name(), 99); // name of file
   sprintf(tarHeader + 100, "0000666"); // file permissions stored as ascii octal number
-  sprintf(tarHeader + 124, "%011o", inFile.size()); // length of file in bytes as 6 digit ascii octal number
+  sprintf(tarHeader + 124, "%011zo", inFile.size()); // length of file in bytes as 6 digit ascii octal number
   memcpy(tarHeader + 148, "        ", 8); // init as 8 spaces to calc checksum
   tarHeader[156] = '0'; // type of entry - 0 for ordinary file
   strcpy(tarHeader + 257, "ustar"); // magic
@@ -373,22 +430,55 @@ static esp_err_t writeHeader(File& inFile, httpd_req_t* req) {
   return httpd_resp_send_chunk(req, tarHeader, BLOCKSIZE);
 }
 
+static bool getByteRange(httpd_req_t* req, size_t fileSize, size_t* rangeStart, size_t* rangeLen) {
+  // single byte range requested in http header, eg bytes=1000-1999, bytes=1000- or bytes=-500
+  // otherwise whole file is sent
+  char rangeHdr[48];
+  if (!fileSize || httpd_req_get_hdr_value_str(req, "Range", rangeHdr, sizeof(rangeHdr)) != ESP_OK) return false;
+  char* rangeSep = strchr(rangeHdr, '-');
+  if (strncmp(rangeHdr, "bytes=", 6) || rangeSep == NULL || strchr(rangeHdr, ',') != NULL) return false;
+  size_t firstByte, lastByte = fileSize - 1;
+  if (rangeSep == rangeHdr + 6) {
+    // final bytes of file
+    size_t suffixLen = strtoul(rangeSep + 1, NULL, 10);
+    if (!suffixLen) return false;
+    firstByte = suffixLen < fileSize ? fileSize - suffixLen : 0;
+  } else {
+    firstByte = strtoul(rangeHdr + 6, NULL, 10);
+    if (isdigit(rangeSep[1])) lastByte = std::min((size_t)strtoul(rangeSep + 1, NULL, 10), lastByte);
+  }
+  if (firstByte > lastByte) return false;
+  *rangeStart = firstByte;
+  *rangeLen = lastByte - firstByte + 1;
+  return true;
+}
+
 esp_err_t downloadFile(File& df, httpd_req_t* req) {
   // download file as attachment, required file name in inFileName
   // setup download header, create zip file if required, and download file
+  // or requested byte range of file, so large recording can be resumed or sampled
   esp_err_t res = ESP_OK;
   bool needZip = false;
+  bool needMp4 = false;
   char downloadName[FILE_NAME_LEN];
   strcpy(downloadName, df.name());
   size_t downloadSize = df.size();
   char fsSavePath[FILE_NAME_LEN];
   strcpy(fsSavePath, inFileName);
 #ifdef ISCAM
+  // avi file optionally remuxed to fragmented mp4, without ancillary files
+  const char* downloadExt = strrchr(downloadName, '.');
+  needMp4 = mp4Remux && downloadExt != NULL && !strcmp(downloadExt + 1, AVI_EXT);
+  if (needMp4) {
+    changeExtension(downloadName, MP4_EXT);
+    downloadSize = 0; // not known until remuxed
+  }
   changeExtension(fsSavePath, CSV_EXT);
   
-  // check if ancillary files present
-  needZip = STORAGE.exists(fsSavePath);
-  const char* extensions[3] = {AVI_EXT, CSV_EXT, SRT_EXT};
+  // check if ancillary files present, event markers alone dont need a tarball
+  // as they are available from the events request
+  needZip = !needMp4 && STORAGE.exists(fsSavePath);
+  const char* extensions[4] = {AVI_EXT, CSV_EXT, SRT_EXT, EVT_EXT};
   if (needZip) {
     // ancillary files, calculate total size for http header
     downloadSize = 0;
@@ -414,10 +504,26 @@ esp_err_t downloadFile(File& df, httpd_req_t* req) {
   char contentDisp[IN_FILE_NAME_LEN + 50];
   snprintf(contentDisp, sizeof(contentDisp) - 1, "attachment; filename=%s", downloadName);
   httpd_resp_set_hdr(req, "Content-Disposition", contentDisp);
-  char contentLength[10];
-  snprintf(contentLength, sizeof(contentLength) - 1, "%i", downloadSize);
-  httpd_resp_set_hdr(req, "Content-Length", contentLength);
+  size_t rangeStart = 0, rangeLen = 0;
+  char contentRange[40];
+  if (!needZip && !needMp4) {
+    httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+    if (getByteRange(req, downloadSize, &rangeStart, &rangeLen)) {
+      LOG_INF("Download range %zu to %zu", rangeStart, rangeStart + rangeLen - 1);
+      httpd_resp_set_status(req, "206 Partial Content");
+      snprintf(contentRange, sizeof(contentRange), "bytes %zu-%zu/%zu", rangeStart, rangeStart + rangeLen - 1, downloadSize);
+      httpd_resp_set_hdr(req, "Content-Range", contentRange);
+      downloadSize = rangeLen;
+      df.seek(rangeStart, SeekSet);
+    }
+  }
+  char contentLength[12];
+  snprintf(contentLength, sizeof(contentLength), "%zu", downloadSize);
+  if (downloadSize) httpd_resp_set_hdr(req, "Content-Length", contentLength);
 
+#ifdef ISCAM
+  if (needMp4) return sendMp4(df, req);
+#endif
   if (needZip) {
 #ifdef ISCAM
     // package avi file and ancillary files into uncompressed tarball
@@ -445,7 +551,7 @@ esp_err_t downloadFile(File& df, httpd_req_t* req) {
     res = httpd_resp_send_chunk(req, zeroBlock, BLOCKSIZE);
     res = httpd_resp_sendstr_chunk(req, NULL);
 #endif
-  } else res = sendChunks(df, req); // send AVI
+  } else res = sendChunks(df, req, true, rangeLen); // send AVI, or byte range of it
   return res;
 }
 
@@ -468,10 +574,10 @@ bool formatSDcard() {
 
   size_t alloc_unit_size = esp_vfs_fat_get_allocation_unit_size(
       sector_size_default, allocation_unit_size);
-  const MKFS_PARM opt = {(BYTE)FM_ANY, 0, 0, 0, alloc_unit_size};
+  const MKFS_PARM opt = {(BYTE)FM_ANY, 0, 0, 0, (DWORD)alloc_unit_size};
   FRESULT res = f_mkfs(drv, &opt, workbuf, workbuf_size);
   ff_memfree(workbuf);
   if (res != FR_OK) LOG_ERR("SD card format failed");
-  else LOG_INF("SD card formatted with alloc unit size %d", alloc_unit_size);
+  else LOG_INF("SD card formatted with alloc unit size %zu", alloc_unit_size);
   return res != FR_OK ? false : true;
 }
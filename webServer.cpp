@@ -22,14 +22,15 @@ bool heartBeatDone = false;
 
 static byte* chunk;
 
-esp_err_t sendChunks(File df, httpd_req_t *req, bool endChunking) {   
-  // use chunked encoding to send large content to browser
+esp_err_t sendChunks(File df, httpd_req_t *req, bool endChunking, size_t sendLen) {   
+  // use chunked encoding to send large content to browser, limited to sendLen bytes if non zero
   size_t chunksize = 0;
   esp_err_t res = ESP_OK;
-  while ((chunksize = df.read(chunk, CHUNKSIZE))) {
+  while ((chunksize = df.read(chunk, sendLen ? std::min(sendLen, (size_t)CHUNKSIZE) : CHUNKSIZE))) {
     res = httpd_resp_send_chunk(req, (char*)chunk, chunksize);
     if (res != ESP_OK) break;
     // httpd_sess_update_lru_counter(req->handle, httpd_req_to_sockfd(req));
+    if (sendLen && !(sendLen -= chunksize)) break;
   } 
   if (endChunking) {
     df.close();
@@ -143,7 +144,7 @@ esp_err_t extractHeaderVal(httpd_req_t *req, const char* variable, char* value)
   esp_err_t res = ESP_FAIL;
   size_t hdrFieldLen = httpd_req_get_hdr_value_len(req, variable);
   if (!hdrFieldLen) return ESP_ERR_INVALID_ARG; // header not present
-  else if (hdrFieldLen >= IN_FILE_NAME_LEN - 1) LOG_WRN("Field %s value too long (%d)", variable, hdrFieldLen);
+  else if (hdrFieldLen >= IN_FILE_NAME_LEN - 1) LOG_WRN("Field %s value too long (%zu)", variable, hdrFieldLen);
   else {
     res = httpd_req_get_hdr_value_str(req, variable, value, hdrFieldLen + 1);
     if (res != ESP_OK) LOG_ERR("Value for %s could not be retrieved: %s", variable, espErrMsg(res));
@@ -451,7 +452,7 @@ void wsAsyncSendBinary(uint8_t* data, size_t len) {
   // websockets send binary function, used for app specific features
   if (checkWsSocketStatus()) {
     if (data == NULL || len == 0) {
-      LOG_WRN("Invalid data or length: data=%p, len=%u", data, len);
+      LOG_WRN("Invalid data or length: data=%p, len=%zu", data, len);
       return;
     }
     // send if connection active
@@ -493,7 +494,7 @@ static esp_err_t wsHandler(httpd_req_t *req) {
     wsPkt.payload = wsMsg;
     ret = httpd_ws_recv_frame(req, &wsPkt, MAX_PAYLOAD_LEN); 
     if (ret == ESP_OK) {
-      if (wsPkt.len >= MAX_PAYLOAD_LEN) LOG_ERR("websocket payload too long %d", wsPkt.len);
+      if (wsPkt.len >= MAX_PAYLOAD_LEN) LOG_ERR("websocket payload too long %zu", wsPkt.len);
       wsMsg[wsPkt.len] = 0; // terminator
       if (wsPkt.type == HTTPD_WS_TYPE_BINARY && wsPkt.len) appSpecificWsBinHandler(wsMsg, wsPkt.len);
       else if (wsPkt.type == HTTPD_WS_TYPE_TEXT) appSpecificWsHandler((const char*)wsMsg);